@@ -20,65 +20,118 @@
 
 #include <nori/mesh.h>
 #include <nori/medium.h>
+#include <nori/transform.h>
+#include <tbb/enumerable_thread_specific.h>
 
 NORI_NAMESPACE_BEGIN
 
+/// Maximum number of rays traced together by \ref Accel::rayIntersectPacket()
+#define NORI_PACKET_SIZE 64
+
 /**
  * \brief Acceleration data structure for ray intersection queries
  *
- * The current implementation falls back to a brute force loop
- * through the geometry.
+ * This is the interface shared by all backends (see \ref BVH and the
+ * brute force loop used as a reference), which are selected in the
+ * scene description with an <tt>&lt;accel type="..."&gt;</tt> tag.
+ * It keeps track of the registered meshes, maps global primitive
+ * indices to them and gathers traversal statistics.
  */
-class Accel {
-	friend class BVHBuildTask;
+class Accel : public NoriObject {
 public:
-	/// Create a new and empty BVH
-	Accel() { m_meshOffset.push_back(0u); }
-
 	/// Release all resources
-	virtual ~Accel() { clear(); };
+	virtual ~Accel() { Accel::clear(); }
 
-	/// Release all resources
-	void clear();
+	/// Release all resources, including the registered meshes
+	virtual void clear();
 
 	/**
-	 * \brief Register a triangle mesh for inclusion in the BVH.
+	 * \brief Register a triangle mesh or an analytic shape for inclusion in
+	 * the acceleration data structure. The Accel takes ownership of \c mesh.
 	 *
 	 * This function can only be used before \ref build() is called
 	 */
 	void addMesh(Mesh *mesh);
 
+	/**
+	 * \brief Register an instance of a triangle mesh
+	 *
+	 * The Accel takes ownership of \c mesh, which may be shared by
+	 * several instances. This function can only be used before
+	 * \ref build() is called.
+	 */
+	virtual void addInstance(Mesh *mesh, const Transform &toWorld) = 0;
+
 	/**
 	 * \brief Register a medium.
 	*/
 	void addMedium(Medium *medium);
 
-	/// Build the BVH
-	void build();
+	/**
+	 * \brief Cache the acceleration data structure in the given file
+	 *
+	 * Backends without a cache ignore this. This function can only be
+	 * used before \ref build() is called.
+	 */
+	virtual void setCacheFile(const std::string &) { }
+
+	/// Build the acceleration data structure
+	virtual void build() = 0;
+
+	/**
+	 * \brief Update the acceleration data structure after the vertex
+	 * positions of its meshes changed
+	 *
+	 * The number of triangles of every mesh must stay the same.
+	 */
+	virtual void refit() = 0;
 
 	/**
-	 * \brief Intersect a ray against all triangle meshes registered
-	 * with the BVH
+	 * \brief Intersect a ray against all meshes and shapes registered
+	 * with the acceleration data structure
 	 *
-	 * Detailed information about the intersection, if any, will be
-	 * stored in the provided \ref Intersection data record.
+	 * The minimal hit (distance, primitive and the coordinates within
+	 * it), if any, will be stored in the provided \ref Intersection data
+	 * record. The surface information is only reconstructed when the
+	 * caller asks for it with \ref Intersection::computeSurfaceInteraction().
 	 *
 	 * The <tt>shadowRay</tt> parameter specifies whether this detailed
 	 * information is really needed. When set to \c true, the
-	 * function just checks whether or not there is occlusion, but without
-	 * providing any more detail (i.e. \c its will not be filled with
-	 * contents). This is usually much faster.
+	 * function just forwards to \ref rayOccluded() (i.e. \c its will
+	 * not be filled with contents).
 	 *
 	 * \return \c true If an intersection was found
 	 */
-	bool rayIntersect(const Ray3f &ray, Intersection &its,
-		bool shadowRay = false) const;
+	virtual bool rayIntersect(const Ray3f &ray, Intersection &its,
+		bool shadowRay = false) const = 0;
 
-	/// Return the total number of meshes registered with the BVH
+	/**
+	 * \brief Check whether anything blocks the segment
+	 * <tt>[ray.mint, ray.maxt]</tt> of a ray
+	 *
+	 * Unlike \ref rayIntersect(), this may stop at the first intersection
+	 * it encounters and does not reconstruct any surface information.
+	 *
+	 * \return \c true If the segment is occluded
+	 */
+	virtual bool rayOccluded(const Ray3f &ray) const = 0;
+
+	/**
+	 * \brief Find the closest intersection of up to \ref NORI_PACKET_SIZE
+	 * coherent rays at once
+	 *
+	 * Meant for the primary rays of neighbouring pixels. The default
+	 * implementation traces the rays one by one.
+	 *
+	 * On return, <tt>its[i].mesh</tt> is \c nullptr if ray \c i missed.
+	 */
+	virtual void rayIntersectPacket(const Ray3f *rays, Intersection *its, int count) const;
+
+	/// Return the total number of meshes registered with the acceleration data structure
 	n_UINT getMeshCount() const { return (n_UINT)m_meshes.size(); }
 
-	/// Return the total number of internally represented triangles 
-	n_UINT getTriangleCount() const { return m_meshOffset.back(); }
+	/// Return the total number of internally represented primitives (triangles and analytic shapes)
+	n_UINT getPrimitiveCount() const { return m_meshOffset.back(); }
 
 	/// Return one of the registered meshes
 	Mesh *getMesh(n_UINT idx) { return m_meshes[idx]; }
@@ -86,15 +139,48 @@ public:
 	/// Return one of the registered meshes (const version)
 	const Mesh *getMesh(n_UINT idx) const { return m_meshes[idx]; }
 
-	//// Return an axis-aligned bounding box containing the entire tree
+	//// Return an axis-aligned bounding box containing all registered geometry
 	const BoundingBox3f &getBoundingBox() const {
 		return m_bbox;
 	}
 
+	/// Work done by closest-hit queries, see \ref setStatistics()
+	struct TraversalStatistics {
+		uint64_t rays = 0;
+		uint64_t nodes = 0;     ///< Inner nodes whose children were tested
+		uint64_t leaves = 0;    ///< Leaves whose primitives were tested
+		uint64_t primitives = 0; ///< Ray-primitive tests (including padding lanes)
+		uint64_t culled = 0;    ///< Subtrees skipped because they begin beyond the closest hit
+	};
+
+	/**
+	 * \brief Count the work done by closest-hit queries
+	 *
+	 * When enabled, every call to \ref rayIntersect() records the number
+	 * of nodes, leaves and primitives it visited and the number of subtrees
+	 * it skipped because they start beyond the closest hit found so far.
+	 * Backends without a hierarchy only count primitives.
+	 */
+	void setStatistics(bool statistics) { m_statistics = statistics; }
+
+	/// Return the totals of the statistics gathered so far over all threads
+	TraversalStatistics getStatistics() const;
+
+	/// Forget the statistics gathered so far
+	void resetStatistics() { m_traversalStats.clear(); }
+
+	/// Print the traversal statistics gathered so far (if enabled)
+	void printStatistics() const;
+
+	EClassType getClassType() const { return EAccel; }
+
 protected:
+	/// Create an empty acceleration data structure
+	Accel() { m_meshOffset.push_back(0u); }
+
 	/**
-	 * \brief Compute the mesh and triangle indices corresponding to
-	 * a primitive index used by the underlying generic BVH implementation.
+	 * \brief Compute the mesh and primitive indices corresponding to
+	 * a primitive index used by the underlying acceleration data structure.
 	 */
 	n_UINT findMesh(n_UINT &idx) const {
 		auto it = std::lower_bound(m_meshOffset.begin(), m_meshOffset.end(), idx + 1) - 1;
@@ -102,68 +188,33 @@ protected:
 		return (n_UINT)(it - m_meshOffset.begin());
 	}
 
-	//// Return an axis-aligned bounding box containing the given triangle
+	//// Return an axis-aligned bounding box containing the given primitive
 	BoundingBox3f getBoundingBox(n_UINT index) const {
 		n_UINT meshIdx = findMesh(index);
 		return m_meshes[meshIdx]->getBoundingBox(index);
 	}
 
-	//// Return the centroid of the given triangle
+	//// Return the centroid of the given primitive
 	Point3f getCentroid(n_UINT index) const {
 		n_UINT meshIdx = findMesh(index);
 		return m_meshes[meshIdx]->getCentroid(index);
 	}
 
-	/// Compute internal tree statistics
-	std::pair<float, n_UINT> statistics(n_UINT index = 0) const;
-
-	/* BVH node in 32 bytes */
-	struct BVHNode {
-		union {
-			struct {
-				unsigned flag : 1;
-				uint32_t size : 31;
-				n_UINT start;
-			} leaf;
-
-			struct {
-				unsigned flag : 1;
-				uint32_t axis : 31;
-				n_UINT rightChild;
-			} inner;
-
-			uint64_t data;
-		};
-		BoundingBox3f bbox;
-
-		bool isLeaf() const {
-			return leaf.flag == 1;
-		}
-
-		bool isInner() const {
-			return leaf.flag == 0;
-		}
-
-		bool isUnused() const {
-			return data == 0;
-		}
-
-		n_UINT start() const {
-			return leaf.start;
-		}
-
-		n_UINT end() const {
-			return leaf.start + leaf.size;
-		}
-	};
-private:
-	std::vector<Mesh *> m_meshes;       ///< List of meshes registered with the BVH
-	std::vector<Medium *> m_mediums;    ///< List of mediums registered with the BVH
-	std::vector<n_UINT> m_meshOffset; ///< Index of the first triangle for each shape
-	std::vector<BVHNode> m_nodes;       ///< BVH nodes
-	std::vector<n_UINT> m_indices;    ///< Index references by BVH nodes
-	BoundingBox3f m_bbox;               ///< Bounding box of the entire BVH
-};
+	/// Use an adaptive ray epsilon that scales with the magnitude of the origin
+	static void adaptEpsilon(Ray3f &ray) {
+		if (ray.mint == Epsilon)
+			ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+	}
 
+	/// Add the work of one closest-hit query to the statistics of the calling thread
+	void recordTraversal(uint64_t nodes, uint64_t leaves, uint64_t primitives, uint64_t culled) const;
+
+	std::vector<Mesh *> m_meshes;       ///< List of meshes registered with the Accel
+	std::vector<Medium *> m_mediums;    ///< List of mediums registered with the Accel
+	std::vector<n_UINT> m_meshOffset;   ///< Index of the first primitive for each shape
+	BoundingBox3f m_bbox;               ///< Bounding box of all registered geometry
+	bool m_statistics = false;          ///< Count the work of closest-hit queries?
+	mutable tbb::enumerable_thread_specific<TraversalStatistics> m_traversalStats;
+};
 
 NORI_NAMESPACE_END
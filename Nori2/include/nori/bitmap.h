@@ -44,13 +44,35 @@ public:
     /// Load an OpenEXR file with the specified filename
     Bitmap(const std::string &filename);
 
-    /// Save the bitmap as an EXR file with the specified filename
+    /// Additional named image stored next to the RGB channels, see \ref addLayer()
+    struct Layer {
+        std::string name;                  ///< Layer name, a prefix of the channel names
+        std::vector<std::string> channels; ///< Names of the (up to three) channels that are written
+        Base pixels;                       ///< Pixel values, channel \c i is stored in component \c i
+    };
+
+    /// Add a named layer (e.g. albedo or depth) that \ref saveEXR() writes next to the RGB channels
+    void addLayer(const std::string &name, const std::vector<std::string> &channels, const Base &pixels) {
+        m_layers.push_back(Layer { name, channels, pixels });
+    }
+
+    /// Return the layers that were added with \ref addLayer()
+    const std::vector<Layer> &getLayers() const { return m_layers; }
+
+    /**
+     * \brief Save the bitmap as an EXR file with the specified filename
+     *
+     * Layers are stored as channels named <tt>layer.channel</tt>.
+     */
     void saveEXR(const std::string &filename);
 
     /// Save the bitmap as a PNG file (with sRGB tonemapping) with the specified filename
     void savePNG(const std::string &filename);
 
     Color3f eval(const Point2f& uv) const;
+
+protected:
+    std::vector<Layer> m_layers;
 };
 
 /**
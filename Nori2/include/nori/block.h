@@ -24,7 +24,9 @@
 
 #include <nori/color.h>
 #include <nori/vector.h>
-#include <tbb/mutex.h>
+#include <mutex>
+#include <atomic>
+#include <memory>
 
 #define NORI_BLOCK_SIZE 32 /* Block size used for parallelization */
 
@@ -43,18 +45,32 @@ NORI_NAMESPACE_BEGIN
  * this region. For that reason, this class also stores information about
  * a small border region around the rectangle, whose size depends on the
  * properties of the reconstruction filter.
+ *
+ * Without a filter, there is no border region and every sample only
+ * contributes to a single pixel. This is used when the filter is
+ * importance sampled instead (see \ref ReconstructionFilter::sample()).
+ *
+ * The block can additionally store auxiliary outputs (AOVs) such as the
+ * albedo or depth, each with up to three channels. These are averaged
+ * over the samples of a pixel without a reconstruction filter, since
+ * e.g. blurred depths or normals are of little use.
  */
 class ImageBlock : public Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> {
 public:
+    typedef Eigen::Array<Color4f, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Pixels;
+
     /**
      * Create a new image block of the specified maximum size
      * \param size
      *     Desired maximum size of the block
      * \param filter
      *     Samples will be convolved with the image reconstruction
-     *     filter provided here.
+     *     filter provided here. If \c nullptr, every sample is only
+     *     added to the pixel that contains it.
+     * \param aovCount
+     *     Number of auxiliary outputs to allocate storage for
      */
-    ImageBlock(const Vector2i &size, const ReconstructionFilter *filter);
+    ImageBlock(const Vector2i &size, const ReconstructionFilter *filter, int aovCount = 0);
     
     /// Release all memory
     ~ImageBlock();
@@ -82,14 +98,54 @@ public:
      */
     Bitmap *toBitmap() const;
 
+    /// Turn an auxiliary output into a bitmap (normalized like \ref toBitmap())
+    Bitmap *toAOVBitmap(int index) const;
+
     /// Convert a bitmap into an image block
     void fromBitmap(const Bitmap &bitmap);
 
-    /// Clear all contents
-    void clear() { setConstant(Color4f()); }
+    /// Clear all contents, including the auxiliary outputs
+    void clear() {
+        setConstant(Color4f());
+        for (Pixels &aov : m_aovs)
+            aov.setConstant(Color4f());
+    }
 
     /// Record a sample with the given position and radiance value
-    void put(const Point2f &pos, const Color3f &value);
+    void put(const Point2f &pos, const Color3f &value) { put(&pos, &value, 1); }
+
+    /**
+     * \brief Record a batch of samples with the given positions and radiance values
+     *
+     * Box and tent filters (and blocks without a filter) are splatted with
+     * specialized code, other filters use the tabulated filter with the
+     * lookups of four neighbouring pixels computed at once. Invalid
+     * values are skipped and counted, see \ref getInvalidSampleCount().
+     */
+    void put(const Point2f *positions, const Color3f *values, int count);
+
+    /**
+     * \brief Record a weighted sample that only contributes to the given pixel
+     *
+     * Used with filter importance sampling, where the sample position may
+     * lie outside of the pixel it was generated for.
+     */
+    void put(const Point2i &pixel, const Color3f &value, float weight);
+
+    /// Add a sample of an auxiliary output to the pixel that contains it (non-finite values are skipped)
+    void putAOV(int index, const Point2i &pixel, const Color3f &value);
+
+    /// Return the number of auxiliary outputs
+    int getAOVCount() const { return (int) m_aovs.size(); }
+
+    /// Return the storage of an auxiliary output, which has the same layout as the block itself
+    Pixels &getAOV(int index) { return m_aovs[index]; }
+
+    /// Return the storage of an auxiliary output (const version)
+    const Pixels &getAOV(int index) const { return m_aovs[index]; }
+
+    /// Return the storage of all auxiliary outputs
+    const std::vector<Pixels> &getAOVs() const { return m_aovs; }
 
     /**
      * \brief Merge another image block into this one
@@ -99,6 +155,9 @@ public:
      */
     void put(ImageBlock &b);
 
+    /// Return the number of invalid radiance values that were skipped by all image blocks
+    static uint64_t getInvalidSampleCount() { return s_invalidSamples; }
+
     /// Lock the image block (using an internal mutex)
     inline void lock() const { m_mutex.lock(); }
     
@@ -108,15 +167,32 @@ public:
     /// Return a human-readable string summary
     std::string toString() const;
 protected:
+    /// How samples are distributed to the pixels
+    enum ESplat {
+        ENearest = 0,   ///< Only the nearest pixel (box filter or no filter)
+        EBilinear,      ///< The four nearest pixels (tent filter)
+        ETabulated      ///< All pixels within the radius of the tabulated filter
+    };
+
+    /// Splat a batch of samples with \c splat(pos, value), where \c pos is relative to the block storage
+    template <typename Functor> void putBatch(const Point2f *positions, const Color3f *values,
+        int count, Functor splat);
+
+    /// Look up the tabulated filter for the pixels <tt>[start, end]</tt> at a distance from \c pos
+    void lookupWeights(int start, int end, float pos, float *weights) const;
+
     Point2i m_offset;
     Vector2i m_size;
+    ESplat m_splat = ENearest;
     int m_borderSize = 0;
     float *m_filter = nullptr;
     float m_filterRadius = 0;
     float *m_weightsX = nullptr;
     float *m_weightsY = nullptr;
     float m_lookupFactor = 0;
-    mutable tbb::mutex m_mutex;
+    std::vector<Pixels> m_aovs;
+    mutable std::mutex m_mutex;
+    static std::atomic<uint64_t> s_invalidSamples;
 };
 
 /**
@@ -126,6 +202,22 @@ protected:
  * rectangular blocks suitable for parallel rendering. The blocks
  * are ordered in spiraling pattern so that the center is
  * rendered first.
+ *
+ * Threads join a block with \ref next() and then claim its pixel
+ * samples one at a time with \ref nextSample(), so several threads can
+ * work on the same block, each rendering into its own \ref ImageBlock.
+ * Optionally, every block is handed out to several threads from the
+ * start. This creates enough work for all threads when a small image
+ * is rendered with many samples per pixel.
+ *
+ * Once every block has been handed out, idle threads steal work by
+ * joining the unfinished block with the most unclaimed samples, so that
+ * a few expensive blocks do not keep the render running on a single
+ * core. The time spent on every block is recorded, so that the next
+ * frame can hand out the expensive blocks first.
+ *
+ * The order is computed up front, so that threads claim the next block
+ * with a single atomic increment instead of taking a lock.
  */
 class BlockGenerator {
 public:
@@ -135,32 +227,251 @@ public:
      *      Size of the image that should be split into blocks
      * \param blockSize
      *      Maximum size of the individual blocks
+     * \param sampleCount
+     *      Number of samples per pixel
+     * \param sampleSplits
+     *      Number of threads that every block is handed out to
+     * \param blockTimes
+     *      Time spent on every block in a previous frame (see
+     *      \ref getBlockTimes()). When given, the blocks are handed out
+     *      from the most expensive one down instead of in a spiral.
      */
-    BlockGenerator(const Vector2i &size, int blockSize);
+    BlockGenerator(const Vector2i &size, int blockSize,
+        uint32_t sampleCount = 1, uint32_t sampleSplits = 1,
+        const std::vector<float> &blockTimes = std::vector<float>());
     
     /**
      * \brief Return the next block to be rendered
      *
-     * This function is thread-safe
+     * The pixel samples of the block must then be claimed with
+     * \ref nextSample(). This function is thread-safe
      *
-     * \return \c false if there were no more blocks
+     * \return \c false if the samples of all blocks have been claimed
      */
     bool next(ImageBlock &block);
 
-    /// Return the total number of blocks
-    int getBlockCount() const { return m_blocksLeft; }
+    /**
+     * \brief Claim the next pixel sample of a block returned by \ref next()
+     *
+     * This function is thread-safe
+     *
+     * \return \c false if all samples of the block have been claimed
+     */
+    bool nextSample(const ImageBlock &block, uint32_t &sample);
+
+    /**
+     * \brief Only hand out the blocks whose offset satisfies \c predicate
+     *
+     * Used to skip converged blocks during adaptive sampling. This function
+     * must be called before any block is requested.
+     */
+    template <typename Predicate> void retainBlocks(Predicate predicate) {
+        m_blocks.erase(std::remove_if(m_blocks.begin(), m_blocks.end(), [&](const Point2i &b) {
+            return !predicate(Point2i(b * m_blockSize));
+        }), m_blocks.end());
+    }
+
+    /// Record time (in milliseconds) spent rendering a block (this function is thread-safe)
+    void addTime(const ImageBlock &block, double time);
+
+    /// Return the time in milliseconds spent on every block, indexed by <tt>y * getBlockGridSize().x() + x</tt>
+    std::vector<float> getBlockTimes() const;
+
+    /// Return the number of blocks that are handed out
+    int getBlockCount() const { return (int) m_blocks.size(); }
+
+    /// Return the maximum size of the individual blocks
+    int getBlockSize() const { return m_blockSize; }
+
+    /// Return the number of blocks along each axis
+    const Vector2i &getBlockGridSize() const { return m_numBlocks; }
+
+    /// Return the number of samples per pixel
+    uint32_t getSampleCount() const { return m_sampleCount; }
+protected:
+    /// Return the index of a block in the block grid
+    int getBlockIndex(const ImageBlock &block) const {
+        const Point2i &pos = block.getOffset();
+        return (pos.y() / m_blockSize) * m_numBlocks.x() + pos.x() / m_blockSize;
+    }
+
+    std::vector<Point2i> m_blocks;   ///< Block coordinates in rendering order
+    Vector2i m_numBlocks;
+    Vector2i m_size;
+    int m_blockSize;
+    uint32_t m_sampleCount;
+    uint32_t m_sampleSplits;
+    std::atomic<int> m_next;         ///< Next block to hand out (times \c m_sampleSplits)
+    std::unique_ptr<std::atomic<uint32_t>[]> m_claimed; ///< Claimed samples of every block
+    std::unique_ptr<std::atomic<uint64_t>[]> m_times;   ///< Microseconds spent on every block
+};
+
+/**
+ * \brief Accumulates the finished blocks of a \ref BlockGenerator into
+ * the full image without locking
+ *
+ * The blocks cover disjoint pixel regions, so their interiors are added
+ * to the image directly. When several threads rendered samples of the
+ * same block, their blocks are kept aside and the thread that finishes
+ * last sums all of them first. The border regions reach into the
+ * neighbouring blocks and are kept aside until \ref finish() adds them
+ * in a separate pass, in which blocks that are far enough apart are
+ * processed in parallel.
+ *
+ * The image is written without taking its mutex, so a concurrent
+ * preview may briefly show partially added blocks.
+ */
+class BlockAccumulator {
+public:
+    /// Prepare to accumulate the blocks of \c generator into \c image
+    BlockAccumulator(ImageBlock &image, const BlockGenerator &generator);
+
+    /// Release the blocks that are still kept aside
+    ~BlockAccumulator();
+
+    /**
+     * \brief Add a block that contains \c samples of the pixel samples
+     * of its region (this function is thread-safe)
+     */
+    void put(ImageBlock &block, uint32_t samples);
+
+    /**
+     * \brief Add the border regions of all blocks once they are finished
+     *
+     * Blocks whose samples were only partly put (because rendering
+     * stopped early) are added with the samples that were rendered.
+     */
+    void finish();
+
 protected:
-    enum EDirection { ERight = 0, EDown, ELeft, EUp };
+    typedef ImageBlock::Pixels Pixels;
+
+    /// Block of a thread that waits for the other threads rendering the same region
+    struct Partial {
+        Pixels pixels;
+        std::vector<Pixels> aovs;
+        Partial *next;
+    };
 
-    Point2i m_block;
+    /**
+     * \brief Add the interior of a complete block and its auxiliary outputs
+     * to the image and keep its border for \ref finish()
+     */
+    void addBlock(int index, const Pixels &block, const std::vector<Pixels> &aovs,
+        const Point2i &pos, const Vector2i &size);
+
+    /// Call \c f(y, x) for the border pixels of a block of the given size
+    template <typename Functor> void forEachBorderPixel(const Vector2i &size, Functor f) const;
+
+    ImageBlock &m_image;
+    int m_blockSize;
     Vector2i m_numBlocks;
+    uint32_t m_sampleCount;
+    std::vector<Point2i> m_offsets;                  ///< Offset of every block
+    std::vector<Vector2i> m_sizes;                   ///< Size of every block
+    std::vector<std::vector<Color4f>> m_borders;     ///< Border pixels of every finished block
+    std::unique_ptr<std::atomic<Partial *>[]> m_partials; ///< Lock-free list of the waiting blocks of every region
+    std::unique_ptr<std::atomic<uint32_t>[]> m_rendered;  ///< Samples of every region that were put
+};
+
+/**
+ * \brief Running mean and variance of a sequence of values
+ *
+ * Uses the numerically robust online algorithm proposed by Donald Knuth
+ * (TAOCP vol.2, 3rd ed., p.232). Two estimates of disjoint sequences are
+ * merged with the pairwise update of Chan et al.
+ */
+struct VarianceEstimate {
+    uint32_t count = 0;
+    double mean = 0;
+    double m2 = 0;   ///< Sum of the squared differences from the mean
+
+    /// Add a value
+    void add(double value) {
+        double delta = value - mean;
+        mean += delta / (double) ++count;
+        m2 += delta * (value - mean);
+    }
+
+    /// Add all values of another estimate
+    void add(const VarianceEstimate &other) {
+        if (other.count == 0)
+            return;
+        uint32_t total = count + other.count;
+        double delta = other.mean - mean;
+        mean += delta * other.count / (double) total;
+        m2 += other.m2 + delta * delta * count * (double) other.count / (double) total;
+        count = total;
+    }
+
+    /// Return the unbiased sample variance
+    double getVariance() const { return count > 1 ? m2 / (count - 1) : 0.0; }
+
+    /**
+     * \brief Return the standard error of the mean relative to the mean
+     *
+     * Dark pixels are compared to an absolute error of 1e-3 instead, so
+     * that they do not need an unbounded number of samples.
+     */
+    double getRelativeError() const {
+        if (count == 0)
+            return std::numeric_limits<double>::infinity();
+        return std::sqrt(getVariance() / count) / std::max(std::abs(mean), 1e-3);
+    }
+};
+
+/**
+ * \brief Per-pixel statistics of the rendered samples that drive
+ * adaptive sampling
+ *
+ * Every thread gathers the luminance statistics of the samples it renders
+ * into a block and merges them with \ref put(). Between two rendering
+ * passes, \ref update() decides which pixels have converged, so that the
+ * next pass only renders the remaining ones.
+ */
+class PixelStatistics {
+public:
+    /// Create empty statistics for an image of the given size, which is split into blocks of \c blockSize pixels
+    PixelStatistics(const Vector2i &size, int blockSize);
+
+    /**
+     * \brief Merge the statistics of some pixels of a block
+     *
+     * \c pixels are relative to the block \c offset. This function is
+     * thread-safe, threads rendering the same block are serialized.
+     */
+    void put(const Point2i &offset, const std::vector<Point2i> &pixels,
+        const std::vector<VarianceEstimate> &estimates);
+
+    /**
+     * \brief Mark the pixels that have at least \c minSamples samples and
+     * a relative error below \c threshold as converged
+     *
+     * \return The number of pixels that have not converged
+     */
+    int update(float threshold, uint32_t minSamples);
+
+    /// Has a pixel converged (see \ref update())?
+    bool isConverged(const Point2i &pixel) const {
+        return m_converged[pixel.y() * m_size.x() + pixel.x()] != 0;
+    }
+
+    /// Have all pixels of the block with the given offset converged?
+    bool isBlockConverged(const Point2i &offset) const;
+
+    /// Return the total number of samples that were rendered
+    uint64_t getSampleCount() const;
+
+    /// Return an image of the number of samples of every pixel
+    Bitmap *toSampleCountBitmap() const;
+
+protected:
     Vector2i m_size;
     int m_blockSize;
-    int m_numSteps;
-    int m_blocksLeft;
-    int m_stepsLeft;
-    int m_direction;
-    tbb::mutex m_mutex;
+    Vector2i m_numBlocks;
+    std::vector<VarianceEstimate> m_pixels;      ///< Statistics of every pixel
+    std::vector<uint8_t> m_converged;            ///< Converged flag of every pixel
+    std::unique_ptr<std::mutex[]> m_mutexes;     ///< Serializes the threads rendering a block
 };
 
 NORI_NAMESPACE_END
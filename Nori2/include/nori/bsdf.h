@@ -117,6 +117,15 @@ public:
      * or not to store photons on a surface
      */
     virtual bool isDiffuse() const { return false; }
+
+    /**
+     * \brief Return the reflectance of the surface at the given texture
+     * coordinates, as written to the albedo AOV of the renderer
+     *
+     * BSDFs without a meaningful albedo (e.g. perfect mirrors) keep the
+     * default of one.
+     */
+    virtual Color3f getAlbedo(const Point2f &uv) const { return Color3f(1.0f); }
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,566 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/accel.h>
+#include <map>
+
+NORI_NAMESPACE_BEGIN
+
+struct SIMDRay;
+struct PacketBounds;
+struct PacketStatistics;
+
+/**
+ * \brief Bounding volume hierarchy over the triangles of the scene
+ *
+ * A binary tree is built with one of several algorithms (see
+ * \ref setBuilder()) and traversed either directly or after collapsing
+ * it into a 4-wide tree. The backend is registered as \c bvh2 and
+ * \c bvh4 (SAH builds of the given width) and as \c lbvh (a 4-wide tree
+ * built from Morton-sorted triangles), which only differ in the defaults
+ * of the following properties:
+ *
+ * - \c builder, \c quality, \c compressed, \c splitBudget and
+ *   \c rebuildThreshold, see the setters below
+ * - \c leafSize: the maximum number of triangles per leaf; SAH builds
+ *   stop earlier when splitting does not pay off (default: 4 with
+ *   \c lbvh and \c hlbvh, 1020 otherwise, i.e. what a quantized node
+ *   can address)
+ * - \c binCount: the number of bins evaluated by binned SAH splits,
+ *   from 2 to \ref MaxBinCount (default: 16)
+ * - \c traversalCost and \c intersectionCost: the costs of a node
+ *   traversal and of a triangle test in the surface area heuristic
+ *   (default: 1 each)
+ * - \c statistics: see \ref setStatistics(); the \c sbvh builder then
+ *   also builds the plain SAH tree to report how much it improves on it,
+ *   and compressed trees time random rays through both node formats
+ */
+class BVH : public Accel {
+	friend class BVHBuildTask;
+	friend class LBVHBuilder;
+	friend class SBVHBuilder;
+	friend class TreeletOptimizer;
+	friend struct RebuiltSubtree;
+	friend struct SIMDRay;
+public:
+	/// Create a new and empty BVH with the default parameters
+	BVH() { }
+
+	/**
+	 * \brief Create a new and empty BVH from the properties of an
+	 * <tt>&lt;accel&gt;</tt> tag, with the given defaults for its
+	 * width and builder
+	 */
+	BVH(const PropertyList &props, int width, const std::string &builder);
+
+	/// Release all resources
+	virtual ~BVH() { clear(); }
+
+	/// Release all resources
+	void clear();
+
+	/**
+	 * \brief Register an instance of a triangle mesh
+	 *
+	 * All instances of the same mesh share one bottom-level BVH that is
+	 * built in object space; per instance, only the transformation and
+	 * an entry of the top-level tree over the instance bounds are stored.
+	 * The BVH takes ownership of \c mesh. This function can only be
+	 * used before \ref build() is called.
+	 */
+	void addInstance(Mesh *mesh, const Transform &toWorld);
+
+	/**
+	 * \brief Select the branching factor of the traversed tree
+	 *
+	 * A width of 2 traverses the binary SAH tree directly. A width of 4
+	 * collapses it into a 4-wide BVH whose child bounds are stored in SoA
+	 * form, so that a single vectorized slab test checks all children
+	 * of a node at once. This function can only be used before
+	 * \ref build() is called.
+	 */
+	void setWidth(int width);
+
+	/// Return the branching factor of the traversed tree
+	int getWidth() const { return m_width; }
+
+	/**
+	 * \brief Store the 4-wide tree with quantized child bounds
+	 *
+	 * Every node keeps the bounds of its children as 8 bit offsets on a
+	 * power-of-two grid spanning the node, rounded outwards so that the
+	 * decoded boxes always contain the exact ones, and its leaves refer
+	 * directly to triangle packets. Nodes shrink from 128 to 64 bytes,
+	 * and the binary tree and the index buffer are released after the
+	 * build. Requires a width of 4. This function can only be used
+	 * before \ref build() is called.
+	 */
+	void setCompressed(bool compressed) { m_compressed = compressed; }
+
+	/**
+	 * \brief Select the algorithm that builds the binary tree
+	 *
+	 * - \c sah: binned SAH splits at the top and a full SAH sweep below
+	 *   (default, best trees)
+	 * - \c lbvh: splits at the spatial median of Morton-sorted
+	 *   triangles; the fastest build, meant for previews
+	 * - \c hlbvh: SAH over clusters of Morton-sorted triangles and
+	 *   Morton splits within them
+	 * - \c sbvh: binned SAH with spatial splits, which may reference a
+	 *   triangle from several leaves (see \ref setSplitBudget()); the
+	 *   slowest build, meant for scenes with long, overlapping triangles
+	 *
+	 * This function can only be used before \ref build() is called.
+	 */
+	void setBuilder(const std::string &builder);
+
+	/**
+	 * \brief Limit the references duplicated by spatial splits
+	 *
+	 * The \c sbvh builder stops taking spatial splits once it has added
+	 * <tt>budget</tt> times the triangle count in extra references
+	 * (default: 0.3). This function can only be used before \ref build()
+	 * is called.
+	 */
+	void setSplitBudget(float budget);
+
+	/**
+	 * \brief Select how much time is spent on the quality of the tree
+	 *
+	 * - \c normal: use the tree of the builder as is (default)
+	 * - \c high: follow the build by a parallel treelet restructuring
+	 *   pass that lowers the SAH cost, which takes a few extra seconds
+	 *   on large scenes and is meant for long final renders
+	 *
+	 * This function can only be used before \ref build() is called.
+	 */
+	void setQuality(const std::string &quality);
+
+	/**
+	 * \brief Cache the BVH in the given file
+	 *
+	 * When set, \ref build() first tries to read the binary tree from
+	 * \c filename and only rebuilds it if the file is missing or was
+	 * written for different geometry, in which case it is replaced
+	 * (through a temporary file, so readers never see a partial one).
+	 * The file is keyed by a hash of all vertex positions and indices
+	 * and of the builder version. This function can only be used
+	 * before \ref build() is called.
+	 */
+	void setCacheFile(const std::string &filename) { m_cacheFile = filename; }
+
+	/**
+	 * \brief Limit the number of triangles per leaf
+	 *
+	 * This function can only be used before \ref build() is called.
+	 */
+	void setLeafSize(int leafSize);
+
+	/// Maximum number of bins of binned SAH splits
+	static const int MaxBinCount = 64;
+
+	/**
+	 * \brief Set the number of bins evaluated by binned SAH splits
+	 *
+	 * This function can only be used before \ref build() is called.
+	 */
+	void setBinCount(int binCount);
+
+	/**
+	 * \brief Set the costs of the surface area heuristic
+	 *
+	 * \param traversal
+	 *    Cost of traversing an inner node
+	 *
+	 * \param intersection
+	 *    Cost of intersecting a triangle
+	 *
+	 * This function can only be used before \ref build() is called.
+	 */
+	void setCosts(float traversal, float intersection);
+
+	/// Build the BVH
+	void build();
+
+	/**
+	 * \brief Update the BVH after the vertex positions of its meshes changed
+	 *
+	 * Recomputes all bounding boxes bottom-up in linear time, keeping the
+	 * topology of the tree. Subtrees whose SAH cost grew by more than the
+	 * rebuild threshold (see \ref setRebuildThreshold()) compared to
+	 * their last (re)build are then rebuilt from scratch and spliced back
+	 * into the tree. Instanced meshes refit their bottom-level trees and
+	 * the top-level tree over the instances. The number of triangles of
+	 * every mesh must stay the same. Quantized nodes cannot be refit.
+	 */
+	void refit();
+
+	/**
+	 * \brief Set the quality loss that makes \ref refit() rebuild a subtree
+	 *
+	 * A subtree is rebuilt when its SAH cost exceeds \c threshold times
+	 * its cost after its last (re)build (default: 1.5).
+	 */
+	void setRebuildThreshold(float threshold);
+
+	/// Find the closest intersection, see \ref Accel::rayIntersect()
+	bool rayIntersect(const Ray3f &ray, Intersection &its,
+		bool shadowRay = false) const;
+
+	/**
+	 * \brief Check whether anything blocks the segment
+	 * <tt>[ray.mint, ray.maxt]</tt> of a ray
+	 *
+	 * This uses a separate any-hit traversal that stops at the first
+	 * intersection it encounters, without ordering children by distance
+	 * and without reconstructing any surface information.
+	 *
+	 * \return \c true If the segment is occluded
+	 */
+	bool rayOccluded(const Ray3f &ray) const;
+
+	/**
+	 * \brief Find the closest intersection of up to \ref NORI_PACKET_SIZE
+	 * coherent rays at once
+	 *
+	 * The packet walks the tree once and culls nodes with an
+	 * interval-arithmetic slab test bounding all of its rays, so that
+	 * only leaves reached by the packet as a whole are tested ray by ray.
+	 * It uses the same tree as \ref rayIntersect(), i.e. the 4-wide
+	 * nodes unless the BVH has a width of 2. Packets whose rays do not
+	 * share direction signs fall back to \ref rayIntersect().
+	 */
+	void rayIntersectPacket(const Ray3f *rays, Intersection *its, int count) const;
+
+	/// Return a brief string summary of the BVH parameters
+	std::string toString() const;
+
+protected:
+	/// SAH cost of a leaf with \c size triangles (infinite beyond the leaf size)
+	float leafCost(n_UINT size) const {
+		return size > (n_UINT) m_leafSize ? std::numeric_limits<float>::infinity()
+			: m_intersectionCost * size;
+	}
+
+	/// Build and compact the binary SAH tree
+	void buildBVH();
+
+	/// Build the bottom-level trees and the top-level tree over the instances
+	void buildInstances();
+
+	/// Recursively split the instances <tt>[start, end)</tt> at their object median
+	void buildInstanceTree(n_UINT node_idx, n_UINT start, n_UINT end);
+
+	/// Hash of the geometry and builder version that identifies a cached tree
+	uint64_t cacheKey() const;
+
+	/// Read the binary tree from the cache file, if it is up to date
+	bool loadCache();
+
+	/// Write the binary tree to the cache file
+	void saveCache() const;
+
+	/// Compute internal tree statistics
+	std::pair<float, n_UINT> statistics(n_UINT index = 0) const;
+
+	/// Collapse the binary subtree rooted at \c index into 4-wide nodes
+	n_UINT collapse(n_UINT index);
+
+	/**
+	 * \brief Replace the 4-wide nodes by quantized ones
+	 *
+	 * \return \c false (keeping everything) if a leaf has too many
+	 * triangles to be addressed by a quantized node.
+	 */
+	bool quantize();
+
+	/// Number of rays traced by \ref timeTraversal()
+	static const int TimedRayCount = 100000;
+
+	/// Time the closest-hit traversal of random rays through a 4-wide tree (in ms, statistics only)
+	template <typename Node>
+	double timeTraversal(const std::vector<Node> &nodes) const;
+
+	/**
+	 * \brief Copy the triangles of every leaf into \ref m_triangles
+	 *
+	 * Leaves are re-addressed so that each one starts at a multiple of
+	 * four in \ref m_indices, which is padded accordingly.
+	 */
+	void buildTrianglePackets();
+
+	/// Fill \c costs with the SAH cost of every node in the subtree at \c index, return its own
+	float sahCosts(n_UINT index, float *costs) const;
+
+	/// Recompute the bounding boxes of the subtree at \c index from its triangles
+	void refitNodes(n_UINT index);
+
+	/// Collect the topmost subtrees whose cost exceeds the rebuild threshold
+	void findDegraded(n_UINT index, const float *costs, std::vector<n_UINT> &roots) const;
+
+	/// Rebuild the given disjoint subtrees with the SAH builder and rewrite the tree
+	void rebuildSubtrees(const std::vector<n_UINT> &roots);
+
+	/// Copy the current vertex positions into \ref m_triangles
+	void updateTrianglePackets();
+
+	/// Refit the bottom-level trees and the top-level tree over the instances
+	void refitInstances();
+
+	/// Closest-hit traversal of the tree over the triangles
+	bool traverse(Ray3f &ray, Intersection &its, n_UINT &f) const;
+
+	/// Any-hit traversal of the tree over the triangles
+	bool occluded(const Ray3f &ray) const;
+
+	/**
+	 * \brief Closest-hit traversal of the instances
+	 *
+	 * On a hit, \c instance and \c f receive the instance and the triangle
+	 * within its mesh, and \c its holds the object space hit.
+	 */
+	bool traverseInstances(Ray3f &ray, Intersection &its, n_UINT &f, n_UINT &instance) const;
+
+	/// Any-hit traversal of the instances
+	bool occludedInstances(const Ray3f &ray) const;
+
+	/// Record the primitive and the instance (if any) of a closest hit in \c its
+	void setHit(n_UINT instance, n_UINT f, Intersection &its) const;
+
+	/// Closest-hit traversal of the binary tree, visiting nearer children first
+	bool traverseBVH2(Ray3f &ray, Intersection &its, n_UINT &f) const;
+
+	/// Closest-hit traversal of a 4-wide tree (full precision or quantized)
+	template <typename Node>
+	bool traverseBVH4(const std::vector<Node> &nodes, Ray3f &ray, Intersection &its, n_UINT &f) const;
+
+	/// Any-hit traversal of the binary tree
+	bool occludedBVH2(const Ray3f &ray) const;
+
+	/// Any-hit traversal of a 4-wide tree (full precision or quantized)
+	template <typename Node>
+	bool occludedBVH4(const std::vector<Node> &nodes, const Ray3f &ray) const;
+
+	/// Packet traversal of the binary tree, see \ref rayIntersectPacket()
+	void packetBVH2(const PacketBounds &bounds, Ray3f *rays, const SIMDRay *rays4,
+		Intersection *its, n_UINT *prims, bool *found, int count, PacketStatistics &stats) const;
+
+	/// Packet traversal of a 4-wide tree (full precision or quantized), see \ref rayIntersectPacket()
+	template <typename Node>
+	void packetBVH4(const std::vector<Node> &nodes, const PacketBounds &bounds, Ray3f *rays,
+		const SIMDRay *rays4, Intersection *its, n_UINT *prims, bool *found, int count,
+		PacketStatistics &stats) const;
+
+	/// Find the closest primitive of the leaf <tt>[start, end)</tt>
+	bool intersectLeaf(n_UINT start, n_UINT end, const SIMDRay &ray4,
+		Ray3f &ray, Intersection &its, n_UINT &f) const;
+
+	/// Find the closest analytic shape of the leaf <tt>[start, end)</tt>
+	bool intersectAnalytic(n_UINT start, n_UINT end, Ray3f &ray,
+		Intersection &its, n_UINT &f) const;
+
+	/// Check whether any primitive of the leaf <tt>[start, end)</tt> is hit
+	bool occludedLeaf(n_UINT start, n_UINT end, const SIMDRay &ray4,
+		const Ray3f &ray) const;
+
+	/* BVH node in 32 bytes */
+	struct BVHNode {
+		union {
+			struct {
+				unsigned flag : 1;
+				uint32_t size : 31;
+				n_UINT start;
+			} leaf;
+
+			struct {
+				unsigned flag : 1;
+				uint32_t axis : 31;
+				n_UINT rightChild;
+			} inner;
+
+			uint64_t data;
+		};
+		BoundingBox3f bbox;
+
+		bool isLeaf() const {
+			return leaf.flag == 1;
+		}
+
+		bool isInner() const {
+			return leaf.flag == 0;
+		}
+
+		bool isUnused() const {
+			return data == 0;
+		}
+
+		n_UINT start() const {
+			return leaf.start;
+		}
+
+		n_UINT end() const {
+			return leaf.start + leaf.size;
+		}
+	};
+
+	/* 4-wide BVH node in 128 bytes */
+	struct BVH4Node {
+		/// Child bounds in SoA layout: min x/y/z followed by max x/y/z
+		float bounds[6][4];
+		/// Index of an inner child in m_nodes4, or the first index of a leaf
+		n_UINT child[4];
+		/// Number of triangles of a leaf child (zero for inner children)
+		uint32_t count[4];
+
+		bool isLeaf(int i) const {
+			return count[i] != 0;
+		}
+
+		/// Number of triangles of a leaf child (zero for inner children)
+		uint32_t leafSize(int i) const {
+			return count[i];
+		}
+
+		/// Bounds of child \c i (an invalid box for unused slots)
+		BoundingBox3f getChildBounds(int i) const {
+			BoundingBox3f bbox;
+			for (int axis = 0; axis < 3; ++axis) {
+				bbox.min[axis] = bounds[axis][i];
+				bbox.max[axis] = bounds[axis + 3][i];
+			}
+			return bbox;
+		}
+	};
+
+	/* Quantized 4-wide BVH node in 64 bytes */
+	struct BVH4QNode {
+		/// Lower corner of the quantization grid
+		float origin[3];
+		/// Per axis, the grid spacing is 2^exponent
+		int8_t exponent[3];
+		uint8_t unused;
+		/// Child bounds in grid units, in the same SoA layout as \ref BVH4Node
+		uint8_t bounds[6][4];
+		/// Index of an inner child in m_qnodes4, or the first index of a leaf
+		n_UINT child[4];
+		/// Number of triangle packets of a leaf child (zero for inner children)
+		uint8_t count[4];
+		uint32_t padding;
+
+		bool isLeaf(int i) const {
+			return count[i] != 0;
+		}
+
+		/// Number of triangles of a leaf child, including padding lanes
+		uint32_t leafSize(int i) const {
+			return 4 * (uint32_t) count[i];
+		}
+
+		/// Grid spacing along \c axis
+		float scale(int axis) const {
+			/* Assemble the power of two directly from its exponent bits */
+			union { uint32_t i; float f; } value;
+			value.i = (uint32_t) (exponent[axis] + 127) << 23;
+			return value.f;
+		}
+
+		/// Decoded bounds of child \c i, which contain its exact bounds
+		BoundingBox3f getChildBounds(int i) const {
+			BoundingBox3f bbox;
+			for (int axis = 0; axis < 3; ++axis) {
+				bbox.min[axis] = origin[axis] + bounds[axis][i] * scale(axis);
+				bbox.max[axis] = origin[axis] + bounds[axis + 3][i] * scale(axis);
+			}
+			return bbox;
+		}
+	};
+
+	/// Flags the lanes of \ref TrianglePacket that hold analytic shapes
+	static const n_UINT AnalyticLane = 0x80000000u;
+
+	/**
+	 * \brief Four leaf triangles in SoA layout (176 bytes)
+	 *
+	 * Stores the first vertex and the two edges that the Moeller-Trumbore
+	 * test needs, so that traversal never touches the mesh buffers.
+	 * Padding lanes have zero edges, which the test always rejects.
+	 * Analytic shapes occupy lanes of the same packets with zero
+	 * geometry and \ref AnalyticLane set in their mesh index; they are
+	 * intersected through \ref Mesh::rayIntersect() instead.
+	 */
+	struct TrianglePacket {
+		float p0[3][4];
+		float e1[3][4];
+		float e2[3][4];
+		/// Index of the mesh in m_meshes (-1 for padding)
+		n_UINT mesh[4];
+		/// Index of the triangle within its mesh
+		n_UINT prim[4];
+	};
+private:
+	std::vector<BVHNode> m_nodes;       ///< BVH nodes
+	std::vector<BVH4Node> m_nodes4;     ///< Collapsed 4-wide nodes (if m_width == 4)
+	std::vector<BVH4QNode> m_qnodes4;   ///< Quantized 4-wide nodes (if m_compressed)
+	std::vector<n_UINT> m_indices;    ///< Index references by BVH nodes (leaves padded to multiples of 4)
+	std::vector<TrianglePacket> m_triangles; ///< Leaf-ordered triangle data, m_indices[i] lives in lane i % 4 of packet i / 4
+	int m_width = 4;                    ///< Branching factor used for traversal
+	bool m_compressed = false;          ///< Quantize the 4-wide nodes?
+	bool m_analytic = false;            ///< Do the leaves contain analytic shapes?
+	int m_leafSize = 1020;              ///< Maximum number of triangles per leaf
+	int m_binCount = 16;                ///< Number of bins of binned SAH splits
+	float m_traversalCost = 1.f;        ///< SAH cost of traversing an inner node
+	float m_intersectionCost = 1.f;     ///< SAH cost of intersecting a triangle
+
+	/// Algorithms that build the binary tree
+	enum EBuilder {
+		ESAHBuilder = 0,
+		ELBVHBuilder,
+		EHLBVHBuilder,
+		ESBVHBuilder
+	};
+	EBuilder m_builder = ESAHBuilder;   ///< Algorithm used by \ref buildBVH()
+	float m_splitBudget = 0.3f;         ///< Extra references allowed per triangle (SBVH only)
+
+	/// Effort spent on the tree after the build
+	enum EQuality {
+		ENormalQuality = 0,
+		EHighQuality
+	};
+	EQuality m_quality = ENormalQuality;
+	float m_rebuildThreshold = 1.5f;    ///< Relative SAH cost increase at which \ref refit() rebuilds a subtree
+	std::vector<float> m_nodeCosts;     ///< SAH cost of every node after its last (re)build (once refit)
+	std::string m_cacheFile;            ///< File in which the binary tree is cached (if any)
+
+	/// Placement of a shared bottom-level BVH
+	struct InstanceRecord {
+		const BVH *accel;             ///< Bottom-level BVH over the instanced mesh
+		Transform toWorld;
+		Transform toLocal;
+		BoundingBox3f bbox;             ///< World space bounds
+	};
+
+	std::map<const Mesh *, BVH *> m_prototypes; ///< Bottom-level BVH of each instanced mesh
+	std::vector<InstanceRecord> m_instances;      ///< Registered instances
+	std::vector<BVHNode> m_instanceNodes;         ///< Top-level tree over the instance bounds
+	std::vector<n_UINT> m_instanceIndices;        ///< Instance references by top-level nodes
+};
+
+
+NORI_NAMESPACE_END
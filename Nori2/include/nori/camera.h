@@ -63,6 +63,15 @@ public:
     /// Return the camera's reconstruction filter in image space
     const ReconstructionFilter *getReconstructionFilter() const { return m_rfilter; }
 
+    /**
+     * \brief Should the pixel samples be placed by importance sampling the
+     * reconstruction filter instead of splatting them with it?
+     *
+     * Every sample then only contributes to its own pixel, so the image
+     * blocks need no borders.
+     */
+    bool useFilterSampling() const { return m_filterSampling; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/Camera/etc.) 
      * provided by this instance
@@ -71,6 +80,7 @@ public:
 protected:
     Vector2i m_outputSize;
     ReconstructionFilter *m_rfilter;
+    bool m_filterSampling = false;
 };
 
 NORI_NAMESPACE_END
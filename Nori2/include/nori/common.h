@@ -122,6 +122,7 @@ class Bitmap;
 class BlockGenerator;
 class Camera;
 class ImageBlock;
+class Instance;
 class Integrator;
 class KDTree;
 class Emitter;
@@ -237,6 +238,20 @@ inline int mod(int a, int b) {
     return (r < 0) ? r+b : r;
 }
 
+/// Insert two zero bits after each of the lower 10 bits of \c v
+inline uint32_t expandBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/// Interleave three 10-bit coordinates into a 30-bit Morton code
+inline uint32_t mortonCode(uint32_t x, uint32_t y, uint32_t z) {
+    return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
 /// Compute a direction for the given coordinates in spherical coordinates
 extern Vector3f sphericalDirection(float theta, float phi);
 
@@ -0,0 +1,86 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/object.h>
+#include <nori/transform.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Placement of a shared triangle mesh in the scene
+ *
+ * An instance either defines its mesh as a nested <tt>&lt;mesh&gt;</tt>
+ * (optionally publishing it under a \c name) or refers to the mesh of
+ * another instance through \c ref. All instances of a mesh share one
+ * bottom-level BVH built in object space, so only the \c toWorld
+ * transform is stored per instance:
+ *
+ * \code
+ * <instance>
+ *     <string name="name" value="tree"/>
+ *     <mesh type="obj"> ... </mesh>
+ *     <transform name="toWorld"> ... </transform>
+ * </instance>
+ * <instance>
+ *     <string name="ref" value="tree"/>
+ *     <transform name="toWorld"> ... </transform>
+ * </instance>
+ * \endcode
+ */
+class Instance : public NoriObject {
+public:
+    Instance(const PropertyList &props);
+
+    /**
+     * \brief Return the mesh defined by this instance (\c nullptr if it
+     * uses \ref getRef())
+     *
+     * Ownership passes to the \ref Accel that the scene registers it with.
+     */
+    Mesh *getMesh() const { return m_mesh; }
+
+    /// Return the name under which the mesh of this instance can be referenced
+    const std::string &getName() const { return m_name; }
+
+    /// Return the name of the mesh this instance refers to
+    const std::string &getRef() const { return m_ref; }
+
+    /// Return the object-to-world transformation
+    const Transform &getTransform() const { return m_toWorld; }
+
+    /// Register a child object (the mesh)
+    virtual void addChild(NoriObject *obj, const std::string& name = "none");
+
+    /// Check that the instance either defines or refers to a mesh
+    virtual void activate();
+
+    /// Return a human-readable summary
+    virtual std::string toString() const;
+
+    EClassType getClassType() const { return EInstance; }
+
+protected:
+    Mesh *m_mesh = nullptr;
+    std::string m_name;
+    std::string m_ref;
+    Transform m_toWorld;
+};
+
+NORI_NAMESPACE_END
@@ -19,6 +19,8 @@
 #pragma once
 
 #include <nori/object.h>
+#include <nori/scene.h>
+#include <nori/bsdf.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -51,7 +53,96 @@ public:
      * \return
      *    A (usually) unbiased estimate of the radiance in this direction
      */
-    virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
+    virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+        Intersection its;
+        if (!scene->rayIntersect(ray, its))
+            its.mesh = nullptr;
+        return Li(scene, sampler, ray, its);
+    }
+
+    /**
+     * \brief Sample the incident radiance along a ray whose first
+     * intersection has already been found
+     *
+     * This is the entry point used by the renderer, which traces the
+     * camera rays of a whole packet of pixels at once (see
+     * \ref Scene::rayIntersectPacket()) and hands each result over.
+     *
+     * \param scene
+     *    A pointer to the underlying scene
+     * \param sampler
+     *    A pointer to a sample generator
+     * \param ray
+     *    The ray in question
+     * \param its
+     *    The closest intersection along \c ray; <tt>its.mesh</tt> is
+     *    \c nullptr if the ray escaped the scene
+     * \return
+     *    A (usually) unbiased estimate of the radiance in this direction
+     */
+    virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+        const Intersection &its) const = 0;
+
+    /**
+     * \brief Sample the incident radiance along a batch of rays whose
+     * first intersections have already been found
+     *
+     * The renderer hands over the camera rays of a whole image block, one
+     * pixel sample at a time, and stores <tt>result[i]</tt> for ray \c i.
+     * The default implementation calls \ref Li() for each of them in turn;
+     * integrators that advance many paths together override it.
+     */
+    virtual void LiBatch(const Scene *scene, Sampler *sampler, const Ray3f *rays,
+        const Intersection *its, Color3f *result, int count) const {
+        for (int i = 0; i < count; ++i)
+            result[i] = Li(scene, sampler, rays[i], its[i]);
+    }
+
+    /// Description of an auxiliary output (AOV) written next to the radiance
+    struct AOV {
+        std::string name;                  ///< Layer name in the EXR file
+        std::vector<std::string> channels; ///< Channel names (at most three)
+        bool filtered = true;              ///< Reconstruct like the radiance or keep the first sample?
+    };
+
+    /**
+     * \brief Return the auxiliary outputs produced by \ref evalAOVs()
+     *
+     * The defaults are the first-hit albedo, shading normal, distance
+     * and mesh ID. The mesh ID is not filtered, since averaging the IDs
+     * of neighbouring meshes would produce meaningless values.
+     */
+    virtual std::vector<AOV> getAOVs() const {
+        return {
+            { "albedo", { "R", "G", "B" }, true },
+            { "normal", { "X", "Y", "Z" }, true },
+            { "depth", { "Z" }, true },
+            { "meshID", { "id" }, false }
+        };
+    }
+
+    /**
+     * \brief Evaluate the auxiliary outputs for a camera ray
+     *
+     * Called by the renderer next to \ref LiBatch() with the same first
+     * intersection, so that all outputs come from a single pass.
+     * Stores one value per entry of \ref getAOVs() in \c values;
+     * unused components are left at zero.
+     */
+    virtual void evalAOVs(const Scene *scene, const Ray3f &ray,
+        const Intersection &its, Color3f *values) const {
+        values[0] = values[1] = values[2] = values[3] = Color3f(0.0f);
+        if (!its.mesh)
+            return;
+
+        SurfaceInteraction si = its.computeSurfaceInteraction();
+        const BSDF *bsdf = its.mesh->getBSDF();
+        const Normal3f &n = si.shFrame.n;
+        values[0] = bsdf ? bsdf->getAlbedo(si.uv) : Color3f(0.0f);
+        values[1] = Color3f(n.x(), n.y(), n.z());
+        values[2] = Color3f(its.t * ray.d.norm(), 0.0f, 0.0f);
+        values[3] = Color3f((float) its.mesh->getID(), 0.0f, 0.0f);
+    }
 
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
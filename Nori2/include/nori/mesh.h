@@ -30,33 +30,62 @@
 
 NORI_NAMESPACE_BEGIN
 
+struct Transform;
+struct SurfaceInteraction;
+
 /**
  * \brief Intersection data structure
  *
- * This data structure records local information about a ray-triangle intersection.
- * This includes the position, traveled ray distance, uv coordinates, as well
- * as well as two local coordinate frames (one that corresponds to the true
- * geometry, and one that is used for shading computations).
+ * This data structure records the minimal information about a ray-surface
+ * intersection that the acceleration data structures produce: the traveled
+ * ray distance, the hit primitive and the coordinates of the hit within it.
+ * The position, texture coordinates and local frames are only needed by
+ * some callers and are reconstructed on demand by
+ * \ref computeSurfaceInteraction().
  */
 struct Intersection {
-    /// Position of the surface intersection
-    Point3f p;
     /// Unoccluded distance along the ray
     float t;
-    /// UV coordinates, if any
-    Point2f uv;
-    /// Shading frame (based on the shading normal)
-    Frame shFrame;
-    /// Geometric frame (based on the true geometry)
-    Frame geoFrame;
+    /// Coordinates of the hit within the primitive (barycentric for triangles)
+    float u, v;
+    /// Index of the hit primitive within its mesh
+    n_UINT prim;
     /// Pointer to the associated mesh
     const Mesh *mesh;
 
     /// Pointer to the associated medium
     const Medium* medium;
 
+    /// Object-to-world transformation of the hit instance (\c nullptr if not instanced)
+    const Transform *instance;
+
     /// Create an uninitialized intersection record
-    Intersection() : mesh(nullptr), medium(nullptr) { }
+    Intersection() : mesh(nullptr), medium(nullptr), instance(nullptr) { }
+
+    /// Reconstruct the world space surface information of the hit
+    SurfaceInteraction computeSurfaceInteraction() const;
+
+    /// Return a human-readable summary of the intersection record
+    std::string toString() const;
+};
+
+/**
+ * \brief Surface information at a ray-surface intersection
+ *
+ * This includes the position, uv coordinates, as well as two local
+ * coordinate frames (one that corresponds to the true geometry, and one
+ * that is used for shading computations). See
+ * \ref Intersection::computeSurfaceInteraction().
+ */
+struct SurfaceInteraction {
+    /// Position of the surface intersection
+    Point3f p;
+    /// UV coordinates, if any
+    Point2f uv;
+    /// Shading frame (based on the shading normal)
+    Frame shFrame;
+    /// Geometric frame (based on the true geometry)
+    Frame geoFrame;
 
     /// Transform a direction vector into the local shading frame
     Vector3f toLocal(const Vector3f &d) const {
@@ -68,7 +97,7 @@ struct Intersection {
         return shFrame.toWorld(d);
     }
 
-    /// Return a human-readable summary of the intersection record
+    /// Return a human-readable summary of the surface information
     std::string toString() const;
 };
 
@@ -79,6 +108,12 @@ struct Intersection {
  * for querying the individual triangles. Subclasses of \c Mesh implement
  * the specifics of how to create its contents (e.g. by loading from an
  * external file)
+ *
+ * The per-primitive queries used by the acceleration data structures
+ * (bounding box, centroid, intersection and surface information) and
+ * the area sampling used by emitters are virtual, so that analytic
+ * shapes such as spheres and quads can override them with exact versions
+ * and be placed into the same BVH as triangles (see \ref isAnalytic()).
  */
 class Mesh : public NoriObject {
 public:
@@ -91,6 +126,18 @@ public:
     /// Return the total number of triangles in this shape
     n_UINT getTriangleCount() const { return (n_UINT) m_F.cols(); }
 
+    /// Return the number of primitives that acceleration data structures index (the triangles by default)
+    virtual n_UINT getPrimitiveCount() const { return getTriangleCount(); }
+
+    /**
+     * \brief Is this an analytic shape?
+     *
+     * Analytic shapes have no triangles, so acceleration data structures
+     * must use the virtual per-primitive queries instead of reading the
+     * vertex buffers.
+     */
+    virtual bool isAnalytic() const { return false; }
+
     /// Return the total number of vertices in this shape
     n_UINT getVertexCount() const { return (n_UINT) m_V.cols(); }
 
@@ -98,22 +145,22 @@ public:
      * \brief Uniformly sample a position on the mesh with
      * respect to surface area. Returns both position and normal
      */
-    void samplePosition(const Point2f &sample, Point3f &p, Normal3f &n, Point2f &uv) const;
+    virtual void samplePosition(const Point2f &sample, Point3f &p, Normal3f &n, Point2f &uv) const;
 
-	/// Return the surface area of the given triangle
-	float pdf(const Point3f &p) const;
+	/// Return the probability density of \ref samplePosition() with respect to surface area
+	virtual float pdf(const Point3f &p) const;
 
-    /// Return the surface area of the given triangle
-    float surfaceArea(n_UINT index) const;
+    /// Return the surface area of the given primitive
+    virtual float surfaceArea(n_UINT index) const;
 
     //// Return an axis-aligned bounding box of the entire mesh
     const BoundingBox3f &getBoundingBox() const { return m_bbox; }
 
-    //// Return an axis-aligned bounding box containing the given triangle
-    BoundingBox3f getBoundingBox(n_UINT index) const;
+    //// Return an axis-aligned bounding box containing the given primitive
+    virtual BoundingBox3f getBoundingBox(n_UINT index) const;
 
-    //// Return the centroid of the given triangle
-    Point3f getCentroid(n_UINT index) const;
+    //// Return the centroid of the given primitive
+    virtual Point3f getCentroid(n_UINT index) const;
 
     /** \brief Ray-triangle intersection test
      *
@@ -139,12 +186,34 @@ public:
      *   in barycentric coordinates
      * \return
      *   \c true if an intersection has been detected
+     *
+     * Analytic shapes store their own surface parameterization in
+     * \c u and \c v, which is passed on to \ref computeSurfaceInteraction().
+     */
+    virtual bool rayIntersect(n_UINT index, const Ray3f &ray, float &u, float &v, float &t) const;
+
+    /**
+     * \brief Reconstruct the object space surface information of a hit
+     *
+     * Uses the primitive index and the coordinates computed by
+     * \ref rayIntersect() that are stored in \c its, and fills in the
+     * position, texture coordinates and both frames.
      */
-    bool rayIntersect(n_UINT index, const Ray3f &ray, float &u, float &v, float &t) const;
+    virtual void computeSurfaceInteraction(const Intersection &its, SurfaceInteraction &si) const;
 
     /// Return a pointer to the vertex positions
     const MatrixXf &getVertexPositions() const { return m_V; }
 
+    /**
+     * \brief Replace the vertex positions, e.g. for the next frame of an animation
+     *
+     * The triangles stay the same, so \c positions must have as many
+     * columns as the mesh has vertices. Vertex normals are replaced as
+     * well if \c normals is not empty. Acceleration structures holding
+     * the mesh must be refit afterwards (see \ref Scene::update()).
+     */
+    void setVertexPositions(const MatrixXf &positions, const MatrixXf &normals = MatrixXf());
+
     /// Return a pointer to the vertex normals (or \c nullptr if there are none)
     const MatrixXf &getVertexNormals() const { return m_N; }
 
@@ -181,6 +250,12 @@ public:
     /// Return the name of this mesh
     const std::string &getName() const { return m_name; }
 
+    /// Return the index of this mesh within the scene (0 is reserved for the background)
+    n_UINT getID() const { return m_id; }
+
+    /// Set the index of this mesh within the scene (done by \ref Scene::activate())
+    void setID(n_UINT id) { m_id = id; }
+
     /// Return a human-readable summary of this instance
     std::string toString() const;
 
@@ -205,6 +280,7 @@ protected:
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
     DiscretePDF   m_pdf;                 ///< Discrete pdf for sampling triangles uniformly wrt their area. 
     Medium       *m_medium = nullptr;    ///< Associated medium, if any
+    n_UINT        m_id = 0;              ///< Index within the scene, see \ref getID()
 };
 
 NORI_NAMESPACE_END
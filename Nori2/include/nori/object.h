@@ -44,6 +44,8 @@ public:
         ESampler,
         ETest,
         EReconstructionFilter,
+        EInstance,
+        EAccel,
         EClassTypeCount
     };
 
@@ -102,6 +104,8 @@ public:
             case ETest:       return "test";
             case EMedium:     return "medium";
             case EDensityFunction: return "density";
+            case EInstance:   return "instance";
+            case EAccel:      return "accel";
             default:          return "<unknown>";
         }
     }
@@ -19,6 +19,7 @@
 #pragma once
 
 #include <nori/object.h>
+#include <nori/dpdf.h>
 
 /// Reconstruction filters will be tabulated at this resolution
 #define NORI_FILTER_RESOLUTION 32
@@ -36,22 +37,53 @@ NORI_NAMESPACE_BEGIN
  * which is freely available at:
  *
  * http://graphics.stanford.edu/~mmp/chapters/pbrt_chapter7.pdf
+ *
+ * Alternatively, the filter can be importance sampled when choosing the
+ * position of a pixel sample (see \ref sample()), so that every sample
+ * only contributes to the pixel it was generated for.
  */
 class ReconstructionFilter : public NoriObject {
 public:
     /// Return the filter radius in fractional pixels
     float getRadius() const { return m_radius; }
 
+    /// Shapes of filters that \ref ImageBlock splats with specialized code
+    enum EShape {
+        EGeneric = 0,
+        EBox,
+        ETent
+    };
+
     /// Evaluate the filter function
     virtual float eval(float x) const = 0;
 
+    /// Return the shape of the filter (\c EGeneric unless it is a box or tent of the default radius)
+    virtual EShape getShape() const { return EGeneric; }
+
+    /// Tabulate the filter for \ref sample()
+    virtual void activate();
+
+    /**
+     * \brief Sample an offset from the pixel center proportional to the
+     * absolute value of the (separable) filter
+     *
+     * \param weight
+     *    Filter value divided by the sampling density, normalized to be
+     *    close to one. Negative where the filter has negative lobes.
+     */
+    Point2f sample(const Point2f &sample, float &weight) const;
+
     /**
      * \brief Return the type of object (i.e. Mesh/Camera/etc.) 
      * provided by this instance
      * */
     EClassType getClassType() const { return EReconstructionFilter; }
 protected:
+    /// Sample a 1D offset, see \ref sample()
+    float sample1D(float sample, float &weight) const;
+
     float m_radius;
+    DiscretePDF m_pdf;   ///< Tabulated absolute value of the filter over <tt>[-radius, radius]</tt>
 };
 
 NORI_NAMESPACE_END
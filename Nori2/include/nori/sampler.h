@@ -77,6 +77,17 @@ public:
      */
     virtual void prepare(const ImageBlock &block) = 0;
 
+    /**
+     * \brief Prepare to render the pixel sample with the given index
+     *
+     * This function is called before every pass over the pixels of the
+     * block given to \ref prepare(). The generated samples then only
+     * depend on the block and the sample index, so that disjoint sample
+     * ranges of one block can be rendered by different threads and still
+     * produce the same image.
+     */
+    virtual void prepareSample(uint32_t index) = 0;
+
     /**
      * \brief Prepare to generate new samples
      * 
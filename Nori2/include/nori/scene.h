@@ -41,7 +41,7 @@ public:
     /// Release all memory
     virtual ~Scene();
 
-    /// Return a pointer to the scene's kd-tree
+    /// Return a pointer to the scene's acceleration data structure
     const Accel *getAccel() const { return m_accel; }
 
     /// Return a pointer to the scene's integrator
@@ -62,6 +62,20 @@ public:
     /// Return a reference to an array containing all meshes
     const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
 
+    /**
+     * \brief Replace the vertex data of a mesh between frames without
+     * parsing the scene again
+     *
+     * The mesh is looked up by name (the file name for OBJ meshes) among
+     * the meshes and instanced meshes of the scene. Call \ref update()
+     * once all meshes of a frame have been changed.
+     */
+    void setVertexPositions(const std::string &meshName, const MatrixXf &positions,
+        const MatrixXf &normals = MatrixXf());
+
+    /// Refit the acceleration structure to changed vertex data, see \ref Accel::refit()
+    void update() { m_accel->refit(); }
+
 	/// Return a reference to an array containing all lights
 	const std::vector<Emitter *> &getLights() const { return m_emitters; }
 
@@ -81,15 +95,16 @@ public:
 
     /**
      * \brief Intersect a ray against all triangles stored in the scene
-     * and return detailed intersection information
+     * and return the closest hit
      *
      * \param ray
      *    A 3-dimensional ray data structure with minimum/maximum
      *    extent information
      *
      * \param its
-     *    A detailed intersection record, which will be filled by the
-     *    intersection query
+     *    A minimal intersection record, which will be filled by the
+     *    intersection query. Call \ref Intersection::computeSurfaceInteraction()
+     *    for the position, texture coordinates and frames of the hit.
      *
      * \return \c true if an intersection was found
      */
@@ -113,8 +128,52 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_accel->rayIntersect(ray, its, true);
+        return m_accel->rayOccluded(ray);
+    }
+
+    /**
+     * \brief Check whether the segment between two points is unoccluded
+     *
+     * This is the query to use for shadow rays: it runs the any-hit
+     * traversal of \ref Accel::rayOccluded() and stops at the first
+     * blocker. The segment is shortened by a small relative epsilon at
+     * both ends so that the surfaces containing \c p0 and \c p1 (e.g.
+     * the shading point and a sampled point on an area emitter) do
+     * not count as occluders.
+     *
+     * \return \c true if nothing blocks the segment
+     */
+    bool isVisible(const Point3f &p0, const Point3f &p1) const {
+        Vector3f d = p1 - p0;
+        float dist = d.norm();
+        if (dist == 0)
+            return true;
+        Ray3f ray(p0, d / dist, Epsilon, dist * (1 - Epsilon));
+        return !m_accel->rayOccluded(ray);
+    }
+
+    /**
+     * \brief Check whether an emitter sample is visible from its
+     * reference point <tt>eRec.ref</tt>
+     *
+     * Environment emitters only sample a direction, so the shadow ray
+     * along <tt>eRec.wi</tt> is unbounded. For all other emitters, this
+     * tests the segment to the sampled point <tt>eRec.p</tt> with
+     * \ref isVisible(const Point3f &, const Point3f &).
+     *
+     * \return \c true if nothing blocks the emitter sample
+     */
+    bool isVisible(const Emitter *emitter, const EmitterQueryRecord &eRec) const;
+
+    /**
+     * \brief Intersect a packet of coherent rays (e.g. the camera rays
+     * of a tile of pixels) against the scene
+     *
+     * See \ref Accel::rayIntersectPacket(). A miss leaves
+     * <tt>its[i].mesh</tt> set to \c nullptr.
+     */
+    void rayIntersectPacket(const Ray3f *rays, Intersection *its, int count) const {
+        m_accel->rayIntersectPacket(rays, its, count);
     }
 
     /// \brief Return an axis-aligned box that bounds the scene
@@ -139,6 +198,7 @@ public:
     EClassType getClassType() const { return EScene; }
 private:
     std::vector<Mesh *> m_meshes;
+    std::vector<Instance *> m_instances;
 	std::vector<Emitter *> m_emitters;
 	Emitter *m_enviromentalEmitter = nullptr;
     std::vector<Medium *> m_mediums;
@@ -147,6 +207,8 @@ private:
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     Accel *m_accel = nullptr;
+    PropertyList m_accelProps;      ///< Properties of the BVH created when the scene has no <accel> tag
+    std::string m_cacheFile;
 };
 
 NORI_NAMESPACE_END
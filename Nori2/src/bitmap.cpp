@@ -107,6 +107,22 @@ void Bitmap::saveEXR(const std::string &filename) {
     frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride)); ptr += compStride;
     frameBuffer.insert("B", Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
 
+    /* Every layer is stored as a set of channels named "layer.channel" */
+    for (Layer &layer : m_layers) {
+        if (layer.pixels.cols() != cols() || layer.pixels.rows() != rows())
+            throw NoriException("Bitmap::saveEXR(): layer \"%s\" has the wrong size!", layer.name);
+        if (layer.channels.size() > 3)
+            throw NoriException("Bitmap::saveEXR(): layer \"%s\" has too many channels!", layer.name);
+
+        ptr = reinterpret_cast<char *>(layer.pixels.data());
+        for (const std::string &channel : layer.channels) {
+            std::string name = layer.name + "." + channel;
+            channels.insert(name.c_str(), Imf::Channel(Imf::FLOAT));
+            frameBuffer.insert(name.c_str(), Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
+            ptr += compStride;
+        }
+    }
+
     Imf::OutputFile file(path.c_str(), header);
     file.setFrameBuffer(frameBuffer);
     file.writePixels((int) rows());
@@ -24,7 +24,9 @@
 
 NORI_NAMESPACE_BEGIN
 
-ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter) 
+std::atomic<uint64_t> ImageBlock::s_invalidSamples(0);
+
+ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter, int aovCount) 
         : m_offset(0, 0), m_size(size) {
     if (filter) {
         /* Tabulate the image reconstruction filter for performance reasons */
@@ -37,15 +39,25 @@ ImageBlock::ImageBlock(const Vector2i &size, const ReconstructionFilter *filter)
         }
         m_filter[NORI_FILTER_RESOLUTION] = 0.0f;
         m_lookupFactor = NORI_FILTER_RESOLUTION / m_filterRadius;
-        int weightSize = (int) std::ceil(2*m_filterRadius) + 1;
+
+        /* Weights are looked up four at a time */
+        int weightSize = ((int) std::ceil(2*m_filterRadius) + 4) & ~3;
         m_weightsX = new float[weightSize];
         m_weightsY = new float[weightSize];
         memset(m_weightsX, 0, sizeof(float) * weightSize);
         memset(m_weightsY, 0, sizeof(float) * weightSize);
+
+        if (filter->getShape() == ReconstructionFilter::EBox)
+            m_splat = ENearest;
+        else if (filter->getShape() == ReconstructionFilter::ETent)
+            m_splat = EBilinear;
+        else
+            m_splat = ETabulated;
     }
 
     /* Allocate space for pixels and border regions */
     resize(size.y() + 2*m_borderSize, size.x() + 2*m_borderSize);
+    m_aovs.resize(aovCount, Pixels(rows(), cols()));
 }
 
 ImageBlock::~ImageBlock() {
@@ -62,6 +74,15 @@ Bitmap *ImageBlock::toBitmap() const {
     return result;
 }
 
+Bitmap *ImageBlock::toAOVBitmap(int index) const {
+    Bitmap *result = new Bitmap(m_size);
+    const Pixels &aov = m_aovs[index];
+    for (int y=0; y<m_size.y(); ++y)
+        for (int x=0; x<m_size.x(); ++x)
+            result->coeffRef(y, x) = aov.coeff(y + m_borderSize, x + m_borderSize).divideByFilterWeight();
+    return result;
+}
+
 void ImageBlock::fromBitmap(const Bitmap &bitmap) {
     if (bitmap.cols() != cols() || bitmap.rows() != rows())
         throw NoriException("Invalid bitmap dimensions!");
@@ -71,35 +92,118 @@ void ImageBlock::fromBitmap(const Bitmap &bitmap) {
             coeffRef(y, x) << bitmap.coeff(y, x), 1;
 }
 
-void ImageBlock::put(const Point2f &_pos, const Color3f &value) {
+template <typename Functor> void ImageBlock::putBatch(const Point2f *positions, const Color3f *values,
+        int count, Functor splat) {
+    /* Shift into the block storage, with the pixel centers at integer positions */
+    Vector2f shift = (m_offset - Vector2i::Constant(m_borderSize)).cast<float>() + Vector2f::Constant(0.5f);
+
+    for (int i=0; i<count; ++i) {
+        if (!values[i].isValid()) {
+            /* If this happens, go fix your code instead of ignoring the warning at the end ;) */
+            s_invalidSamples.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        splat(Point2f(positions[i] - shift), Color4f(values[i]));
+    }
+}
+
+void ImageBlock::lookupWeights(int start, int end, float pos, float *weights) const {
+    typedef Eigen::Array<float, 4, 1> Array4f;
+    typedef Eigen::Array<int, 4, 1> Array4i;
+    const Array4f ramp(0.0f, 1.0f, 2.0f, 3.0f);
+
+    for (int x=start; x<=end; x+=4, weights+=4) {
+        Array4i index = (((ramp + (float) x) - pos).abs() * m_lookupFactor)
+            .cast<int>().min(NORI_FILTER_RESOLUTION);
+        weights[0] = m_filter[index[0]];
+        weights[1] = m_filter[index[1]];
+        weights[2] = m_filter[index[2]];
+        weights[3] = m_filter[index[3]];
+    }
+}
+
+void ImageBlock::put(const Point2f *positions, const Color3f *values, int count) {
+    int width = (int) cols(), height = (int) rows();
+
+    switch (m_splat) {
+        case ENearest:
+            putBatch(positions, values, count, [&](const Point2f &pos, const Color4f &value) {
+                int x = (int) std::floor(pos.x() + 0.5f), y = (int) std::floor(pos.y() + 0.5f);
+                if (x >= 0 && y >= 0 && x < width && y < height)
+                    coeffRef(y, x) += value;
+            });
+            break;
+
+        case EBilinear:
+            putBatch(positions, values, count, [&](const Point2f &pos, const Color4f &value) {
+                int x = (int) std::floor(pos.x()), y = (int) std::floor(pos.y());
+                float fx = pos.x() - x, fy = pos.y() - y;
+                Color4f top = value * (1.0f - fy), bottom = value * fy;
+                if (x >= 0 && y >= 0 && x + 1 < width && y + 1 < height) {
+                    Color4f *row = &coeffRef(y, x);
+                    row[0] += top * (1.0f - fx);
+                    row[1] += top * fx;
+                    row += width;
+                    row[0] += bottom * (1.0f - fx);
+                    row[1] += bottom * fx;
+                    return;
+                }
+
+                /* Near the edge of the block */
+                for (int yr=0; yr<2; ++yr)
+                    for (int xr=0; xr<2; ++xr)
+                        if (x + xr >= 0 && y + yr >= 0 && x + xr < width && y + yr < height)
+                            coeffRef(y + yr, x + xr) += (yr ? bottom : top) * (xr ? fx : 1.0f - fx);
+            });
+            break;
+
+        case ETabulated:
+            putBatch(positions, values, count, [&](const Point2f &pos, const Color4f &value) {
+                /* Compute the rectangle of pixels that will need to be updated */
+                BoundingBox2i bbox(
+                    Point2i((int)  std::ceil(pos.x() - m_filterRadius), (int)  std::ceil(pos.y() - m_filterRadius)),
+                    Point2i((int) std::floor(pos.x() + m_filterRadius), (int) std::floor(pos.y() + m_filterRadius))
+                );
+                bbox.clip(BoundingBox2i(Point2i(0, 0), Point2i(width - 1, height - 1)));
+
+                /* Lookup values from the pre-rasterized filter */
+                lookupWeights(bbox.min.x(), bbox.max.x(), pos.x(), m_weightsX);
+                lookupWeights(bbox.min.y(), bbox.max.y(), pos.y(), m_weightsY);
+
+                for (int y=bbox.min.y(), yr=0; y<=bbox.max.y(); ++y, ++yr) {
+                    Color4f valueY = value * m_weightsY[yr];
+                    Color4f *row = &coeffRef(y, 0);
+                    for (int x=bbox.min.x(), xr=0; x<=bbox.max.x(); ++x, ++xr)
+                        row[x] += valueY * m_weightsX[xr];
+                }
+            });
+            break;
+    }
+}
+
+void ImageBlock::put(const Point2i &pixel, const Color3f &value, float weight) {
     if (!value.isValid()) {
-        /* If this happens, go fix your code instead of removing this warning ;) */
-        cerr << "Integrator: computed an invalid radiance value: " << value.toString() << endl;
+        s_invalidSamples.fetch_add(1, std::memory_order_relaxed);
         return;
     }
 
-    /* Convert to pixel coordinates within the image block */
-    Point2f pos(
-        _pos.x() - 0.5f - (m_offset.x() - m_borderSize),
-        _pos.y() - 0.5f - (m_offset.y() - m_borderSize)
-    );
+    Point2i pos = pixel - m_offset + Vector2i::Constant(m_borderSize);
+    if (pos.x() < 0 || pos.y() < 0 || pos.x() >= cols() || pos.y() >= rows())
+        return;
 
-    /* Compute the rectangle of pixels that will need to be updated */
-    BoundingBox2i bbox(
-        Point2i((int)  std::ceil(pos.x() - m_filterRadius), (int)  std::ceil(pos.y() - m_filterRadius)),
-        Point2i((int) std::floor(pos.x() + m_filterRadius), (int) std::floor(pos.y() + m_filterRadius))
-    );
-    bbox.clip(BoundingBox2i(Point2i(0, 0), Point2i((int) cols() - 1, (int) rows() - 1)));
+    coeffRef(pos.y(), pos.x()) += Color4f(value) * weight;
+}
 
-    /* Lookup values from the pre-rasterized filter */
-    for (int x=bbox.min.x(), idx = 0; x<=bbox.max.x(); ++x)
-        m_weightsX[idx++] = m_filter[(int) (std::abs(x-pos.x()) * m_lookupFactor)];
-    for (int y=bbox.min.y(), idx = 0; y<=bbox.max.y(); ++y)
-        m_weightsY[idx++] = m_filter[(int) (std::abs(y-pos.y()) * m_lookupFactor)];
+void ImageBlock::putAOV(int index, const Point2i &pixel, const Color3f &value) {
+    /* Unlike radiance, auxiliary outputs such as normals may be negative */
+    if (!std::isfinite(value.r()) || !std::isfinite(value.g()) || !std::isfinite(value.b()))
+        return;
 
-    for (int y=bbox.min.y(), yr=0; y<=bbox.max.y(); ++y, ++yr) 
-        for (int x=bbox.min.x(), xr=0; x<=bbox.max.x(); ++x, ++xr) 
-            coeffRef(y, x) += Color4f(value) * m_weightsX[xr] * m_weightsY[yr];
+    Point2i pos = pixel - m_offset + Vector2i::Constant(m_borderSize);
+    if (pos.x() < 0 || pos.y() < 0 || pos.x() >= cols() || pos.y() >= rows())
+        return;
+
+    m_aovs[index](pos.y(), pos.x()) += Color4f(value);
 }
     
 void ImageBlock::put(ImageBlock &b) {
@@ -107,10 +211,13 @@ void ImageBlock::put(ImageBlock &b) {
         Vector2i::Constant(m_borderSize - b.getBorderSize());
     Vector2i size   = b.getSize()   + Vector2i(2*b.getBorderSize());
 
-    tbb::mutex::scoped_lock lock(m_mutex);
+    std::lock_guard<std::mutex> lock(m_mutex);
 
     block(offset.y(), offset.x(), size.y(), size.x()) 
         += b.topLeftCorner(size.y(), size.x());
+    for (int i=0; i<std::min(getAOVCount(), b.getAOVCount()); ++i)
+        m_aovs[i].block(offset.y(), offset.x(), size.y(), size.x())
+            += b.getAOV(i).topLeftCorner(size.y(), size.x());
 }
 
 std::string ImageBlock::toString() const {
@@ -118,49 +225,294 @@ std::string ImageBlock::toString() const {
         m_offset.toString(), m_size.toString());
 }
 
-BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
-        : m_size(size), m_blockSize(blockSize) {
+BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize,
+        uint32_t sampleCount, uint32_t sampleSplits, const std::vector<float> &blockTimes)
+        : m_size(size), m_blockSize(blockSize), m_sampleCount(sampleCount),
+          m_sampleSplits(std::max(1u, std::min(sampleSplits, sampleCount))), m_next(0) {
+    enum EDirection { ERight = 0, EDown, ELeft, EUp };
+
     m_numBlocks = Vector2i(
         (int) std::ceil(size.x() / (float) blockSize),
         (int) std::ceil(size.y() / (float) blockSize));
-    m_blocksLeft = m_numBlocks.x() * m_numBlocks.y();
-    m_direction = ERight;
-    m_block = Point2i(m_numBlocks / 2);
-    m_stepsLeft = 1;
-    m_numSteps = 1;
+
+    /* Walk the spiral once, starting at the center */
+    int blockCount = m_numBlocks.x() * m_numBlocks.y();
+    m_blocks.reserve(blockCount);
+    Point2i block(m_numBlocks / 2);
+    int direction = ERight, numSteps = 1, stepsLeft = 1;
+    while ((int) m_blocks.size() < blockCount) {
+        if ((block.array() >= 0).all() && (block.array() < m_numBlocks.array()).all())
+            m_blocks.push_back(block);
+
+        switch (direction) {
+            case ERight: ++block.x(); break;
+            case EDown:  ++block.y(); break;
+            case ELeft:  --block.x(); break;
+            case EUp:    --block.y(); break;
+        }
+
+        if (--stepsLeft == 0) {
+            direction = (direction + 1) % 4;
+            if (direction == ELeft || direction == ERight) 
+                ++numSteps;
+            stepsLeft = numSteps;
+        }
+    }
+
+    /* Start with the blocks that were expensive in the previous frame */
+    if ((int) blockTimes.size() == blockCount) {
+        std::stable_sort(m_blocks.begin(), m_blocks.end(), [&](const Point2i &a, const Point2i &b) {
+            return blockTimes[a.y() * m_numBlocks.x() + a.x()] > blockTimes[b.y() * m_numBlocks.x() + b.x()];
+        });
+    }
+
+    m_claimed.reset(new std::atomic<uint32_t>[blockCount]);
+    m_times.reset(new std::atomic<uint64_t>[blockCount]);
+    for (int i = 0; i < blockCount; ++i) {
+        m_claimed[i] = 0;
+        m_times[i] = 0;
+    }
 }
 
 bool BlockGenerator::next(ImageBlock &block) {
-    tbb::mutex::scoped_lock lock(m_mutex);
-
-    if (m_blocksLeft == 0)
-        return false;
+    Point2i coords;
+    int item = m_next.fetch_add(1, std::memory_order_relaxed);
+    if (item < getBlockCount() * (int) m_sampleSplits) {
+        /* Every block is handed out m_sampleSplits times in a row */
+        coords = m_blocks[item / m_sampleSplits];
+    } else {
+        /* All blocks are taken: join the one with the most unclaimed samples */
+        uint32_t mostLeft = 0;
+        for (const Point2i &b : m_blocks) {
+            uint32_t claimed = m_claimed[b.y() * m_numBlocks.x() + b.x()].load(std::memory_order_relaxed);
+            if (claimed < m_sampleCount && m_sampleCount - claimed > mostLeft) {
+                mostLeft = m_sampleCount - claimed;
+                coords = b;
+            }
+        }
+        if (mostLeft == 0)
+            return false;
+    }
 
-    Point2i pos = m_block * m_blockSize;
+    Point2i pos = coords * m_blockSize;
     block.setOffset(pos);
     block.setSize((m_size - pos).cwiseMin(Vector2i::Constant(m_blockSize)));
+    return true;
+}
+
+bool BlockGenerator::nextSample(const ImageBlock &block, uint32_t &sample) {
+    std::atomic<uint32_t> &claimed = m_claimed[getBlockIndex(block)];
 
-    if (--m_blocksLeft == 0)
-        return true;
+    /* Check first, so that the counter does not grow past the sample count */
+    if (claimed.load(std::memory_order_relaxed) >= m_sampleCount)
+        return false;
+    sample = claimed.fetch_add(1, std::memory_order_relaxed);
+    return sample < m_sampleCount;
+}
+
+void BlockGenerator::addTime(const ImageBlock &block, double time) {
+    m_times[getBlockIndex(block)].fetch_add((uint64_t) (time * 1000), std::memory_order_relaxed);
+}
+
+std::vector<float> BlockGenerator::getBlockTimes() const {
+    std::vector<float> times((size_t) m_numBlocks.x() * m_numBlocks.y());
+    for (size_t i = 0; i < times.size(); ++i)
+        times[i] = m_times[i].load(std::memory_order_relaxed) / 1000.0f;
+    return times;
+}
+
+BlockAccumulator::BlockAccumulator(ImageBlock &image, const BlockGenerator &generator)
+        : m_image(image), m_blockSize(generator.getBlockSize()),
+          m_numBlocks(generator.getBlockGridSize()), m_sampleCount(generator.getSampleCount()) {
+    /* Blocks two apart must not share border pixels, see finish() */
+    if (2 * image.getBorderSize() > m_blockSize)
+        throw NoriException("BlockAccumulator: the reconstruction filter is too wide for blocks of %i pixels!",
+            m_blockSize);
+
+    int blockCount = m_numBlocks.x() * m_numBlocks.y();
+    m_offsets.resize(blockCount, Point2i(0, 0));
+    m_sizes.resize(blockCount, Vector2i(0, 0));
+    m_borders.resize(blockCount);
+    m_partials.reset(new std::atomic<Partial *>[blockCount]);
+    m_rendered.reset(new std::atomic<uint32_t>[blockCount]);
+    for (int i = 0; i < blockCount; ++i) {
+        m_partials[i] = nullptr;
+        m_rendered[i] = 0;
+    }
+}
+
+BlockAccumulator::~BlockAccumulator() {
+    for (int i = 0; i < m_numBlocks.x() * m_numBlocks.y(); ++i) {
+        Partial *partial = m_partials[i].load();
+        while (partial) {
+            Partial *next = partial->next;
+            delete partial;
+            partial = next;
+        }
+    }
+}
 
-    do {
-        switch (m_direction) {
-            case ERight: ++m_block.x(); break;
-            case EDown:  ++m_block.y(); break;
-            case ELeft:  --m_block.x(); break;
-            case EUp:    --m_block.y(); break;
+template <typename Functor> void BlockAccumulator::forEachBorderPixel(const Vector2i &size, Functor f) const {
+    int border = m_image.getBorderSize();
+    for (int y = 0; y < size.y() + 2 * border; ++y) {
+        bool inside = y >= border && y < size.y() + border;
+        for (int x = 0; x < size.x() + 2 * border; ++x) {
+            if (inside && x == border)
+                x += size.x();
+            if (x < size.x() + 2 * border)
+                f(y, x);
         }
+    }
+}
+
+void BlockAccumulator::put(ImageBlock &block, uint32_t samples) {
+    Point2i pos = block.getOffset();
+    int index = (pos.y() / m_blockSize) * m_numBlocks.x() + pos.x() / m_blockSize;
+
+    Partial *own = nullptr;
+    if (samples < m_sampleCount) {
+        /* Other threads render samples of this block as well. Keep a copy
+           until the last one of them is done */
+        own = new Partial { block, block.getAOVs(), m_partials[index].load(std::memory_order_relaxed) };
+        while (!m_partials[index].compare_exchange_weak(own->next, own, std::memory_order_release,
+                std::memory_order_relaxed)) ;
+    }
+    if (m_rendered[index].fetch_add(samples, std::memory_order_acq_rel) + samples != m_sampleCount)
+        return;
 
-        if (--m_stepsLeft == 0) {
-            m_direction = (m_direction + 1) % 4;
-            if (m_direction == ELeft || m_direction == ERight) 
-                ++m_numSteps;
-            m_stepsLeft = m_numSteps;
+    if (own) {
+        /* The last one sums the blocks of all threads */
+        Partial *partial = m_partials[index].exchange(nullptr, std::memory_order_acquire);
+        while (partial) {
+            Partial *next = partial->next;
+            if (partial != own) {
+                block += partial->pixels;
+                for (int i = 0; i < block.getAOVCount(); ++i)
+                    block.getAOV(i) += partial->aovs[i];
+            }
+            delete partial;
+            partial = next;
         }
-    } while ((m_block.array() < 0).any() ||
-             (m_block.array() >= m_numBlocks.array()).any());
+    }
+
+    addBlock(index, block, block.getAOVs(), pos, block.getSize());
+}
 
+void BlockAccumulator::addBlock(int index, const Pixels &block, const std::vector<Pixels> &aovs,
+        const Point2i &pos, const Vector2i &size) {
+    /* The interiors of the blocks are disjoint */
+    int border = m_image.getBorderSize();
+    m_image.block(pos.y() + border, pos.x() + border, size.y(), size.x()) +=
+        block.block(border, border, size.y(), size.x());
+
+    /* Auxiliary outputs are never splatted into the border */
+    for (int i = 0; i < std::min(m_image.getAOVCount(), (int) aovs.size()); ++i)
+        m_image.getAOV(i).block(pos.y() + border, pos.x() + border, size.y(), size.x()) +=
+            aovs[i].block(border, border, size.y(), size.x());
+
+    /* Keep the border for finish() */
+    std::vector<Color4f> &pixels = m_borders[index];
+    pixels.clear();
+    forEachBorderPixel(size, [&](int y, int x) { pixels.push_back(block(y, x)); });
+    m_offsets[index] = pos;
+    m_sizes[index] = size;
+}
+
+void BlockAccumulator::finish() {
+    /* Add the blocks whose samples were not all rendered (if rendering stopped early) */
+    tbb::parallel_for(0, (int) m_borders.size(), [&](int index) {
+        Partial *partial = m_partials[index].exchange(nullptr);
+        if (!partial)
+            return;
+
+        Pixels block = partial->pixels;
+        std::vector<Pixels> aovs = partial->aovs;
+        Partial *next = partial->next;
+        delete partial;
+        for (partial = next; partial; partial = next) {
+            block += partial->pixels;
+            for (size_t i = 0; i < aovs.size(); ++i)
+                aovs[i] += partial->aovs[i];
+            next = partial->next;
+            delete partial;
+        }
+
+        Point2i pos = Point2i(index % m_numBlocks.x(), index / m_numBlocks.x()) * m_blockSize;
+        addBlock(index, block, aovs, pos, (m_image.getSize() - pos).cwiseMin(Vector2i::Constant(m_blockSize)));
+    });
+
+    /* Blocks whose coordinates have the same parity are at least one
+       block apart, so their borders never overlap */
+    for (int parity = 0; parity < 4; ++parity) {
+        tbb::parallel_for(0, (int) m_borders.size(), [&](int index) {
+            int bx = index % m_numBlocks.x(), by = index / m_numBlocks.x();
+            if ((bx % 2) + 2 * (by % 2) != parity || m_borders[index].empty())
+                return;
+
+            const Point2i &pos = m_offsets[index];
+            const Color4f *pixel = m_borders[index].data();
+            forEachBorderPixel(m_sizes[index], [&](int y, int x) {
+                m_image(pos.y() + y, pos.x() + x) += *pixel++;
+            });
+            m_borders[index].clear();
+            m_borders[index].shrink_to_fit();
+        });
+    }
+}
+
+PixelStatistics::PixelStatistics(const Vector2i &size, int blockSize)
+        : m_size(size), m_blockSize(blockSize) {
+    m_numBlocks = Vector2i(
+        (size.x() + blockSize - 1) / blockSize,
+        (size.y() + blockSize - 1) / blockSize);
+    m_pixels.resize((size_t) size.x() * size.y());
+    m_converged.resize(m_pixels.size(), 0);
+    m_mutexes.reset(new std::mutex[m_numBlocks.x() * m_numBlocks.y()]);
+}
+
+void PixelStatistics::put(const Point2i &offset, const std::vector<Point2i> &pixels,
+        const std::vector<VarianceEstimate> &estimates) {
+    int index = (offset.y() / m_blockSize) * m_numBlocks.x() + offset.x() / m_blockSize;
+    std::lock_guard<std::mutex> lock(m_mutexes[index]);
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        Point2i p = offset + pixels[i];
+        m_pixels[p.y() * m_size.x() + p.x()].add(estimates[i]);
+    }
+}
+
+int PixelStatistics::update(float threshold, uint32_t minSamples) {
+    int active = 0;
+    for (size_t i = 0; i < m_pixels.size(); ++i) {
+        const VarianceEstimate &pixel = m_pixels[i];
+        m_converged[i] = pixel.count >= minSamples && pixel.getRelativeError() < threshold;
+        if (!m_converged[i])
+            ++active;
+    }
+    return active;
+}
+
+bool PixelStatistics::isBlockConverged(const Point2i &offset) const {
+    Point2i end = (offset + Vector2i::Constant(m_blockSize)).cwiseMin(m_size);
+    for (int y = offset.y(); y < end.y(); ++y)
+        for (int x = offset.x(); x < end.x(); ++x)
+            if (!isConverged(Point2i(x, y)))
+                return false;
     return true;
 }
 
+uint64_t PixelStatistics::getSampleCount() const {
+    uint64_t total = 0;
+    for (const VarianceEstimate &pixel : m_pixels)
+        total += pixel.count;
+    return total;
+}
+
+Bitmap *PixelStatistics::toSampleCountBitmap() const {
+    Bitmap *result = new Bitmap(m_size);
+    for (int y = 0; y < m_size.y(); ++y)
+        for (int x = 0; x < m_size.x(); ++x)
+            result->coeffRef(y, x) = Color3f((float) m_pixels[y * m_size.x() + x].count);
+    return result;
+}
+
 NORI_NAMESPACE_END
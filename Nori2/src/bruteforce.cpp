@@ -0,0 +1,175 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <set>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Reference backend that tests every ray against every primitive
+ *
+ * Building takes no time, but every query is linear in the size of the
+ * scene, so this is only practical for tiny scenes. It is meant for
+ * validating the other backends and for measuring what they gain.
+ */
+class BruteForce : public Accel {
+public:
+	BruteForce(const PropertyList &props) {
+		setStatistics(props.getBoolean("statistics", false));
+	}
+
+	virtual ~BruteForce() {
+		std::set<Mesh *> meshes;
+		for (const InstanceRecord &instance : m_instances)
+			meshes.insert(instance.mesh);
+		for (Mesh *mesh : meshes)
+			delete mesh;
+	}
+
+	void addInstance(Mesh *mesh, const Transform &toWorld) {
+		InstanceRecord instance;
+		instance.mesh = mesh;
+		instance.toWorld = toWorld;
+		instance.toLocal = toWorld.inverse();
+		m_instances.push_back(instance);
+	}
+
+	void build() {
+		updateBoundingBox();
+		resetStatistics();
+	}
+
+	void refit() {
+		updateBoundingBox();
+	}
+
+	bool rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
+		if (shadowRay)
+			return rayOccluded(_ray);
+
+		its.t = std::numeric_limits<float>::infinity();
+
+		Ray3f ray(_ray);
+		adaptEpsilon(ray);
+		if (ray.maxt < ray.mint)
+			return false;
+
+		n_UINT f = 0, instance = NoInstance;
+		uint64_t primitives = 0;
+		bool foundIntersection = false;
+
+		for (const Mesh *mesh : m_meshes)
+			foundIntersection |= intersectMesh(mesh, ray, its, f, primitives);
+
+		for (n_UINT i = 0; i < (n_UINT) m_instances.size(); ++i) {
+			/* The direction is not renormalized, so distances along the
+			   object space ray are the same as in world space */
+			Ray3f localRay = m_instances[i].toLocal * ray;
+			if (intersectMesh(m_instances[i].mesh, localRay, its, f, primitives)) {
+				ray.maxt = localRay.maxt;
+				instance = i;
+				foundIntersection = true;
+			}
+		}
+
+		if (foundIntersection) {
+			its.prim = f;
+			its.instance = instance == NoInstance ? nullptr : &m_instances[instance].toWorld;
+		}
+
+		if (m_statistics)
+			recordTraversal(0, 0, primitives, 0);
+		return foundIntersection;
+	}
+
+	bool rayOccluded(const Ray3f &_ray) const {
+		Ray3f ray(_ray);
+		adaptEpsilon(ray);
+		if (ray.maxt < ray.mint)
+			return false;
+
+		float u, v, t;
+		for (const Mesh *mesh : m_meshes) {
+			for (n_UINT idx = 0; idx < mesh->getPrimitiveCount(); ++idx) {
+				if (mesh->rayIntersect(idx, ray, u, v, t))
+					return true;
+			}
+		}
+		for (const InstanceRecord &instance : m_instances) {
+			Ray3f localRay = instance.toLocal * ray;
+			for (n_UINT idx = 0; idx < instance.mesh->getPrimitiveCount(); ++idx) {
+				if (instance.mesh->rayIntersect(idx, localRay, u, v, t))
+					return true;
+			}
+		}
+		return false;
+	}
+
+	std::string toString() const {
+		return "BruteForce[]";
+	}
+
+private:
+	/// Marks hits on registered meshes rather than on an instance
+	static const n_UINT NoInstance = (n_UINT) -1;
+
+	/// Find the closest primitive of \c mesh, shortening \c ray on every hit
+	static bool intersectMesh(const Mesh *mesh, Ray3f &ray, Intersection &its,
+			n_UINT &f, uint64_t &primitives) {
+		bool foundIntersection = false;
+		float u, v, t;
+		for (n_UINT idx = 0; idx < mesh->getPrimitiveCount(); ++idx) {
+			if (mesh->rayIntersect(idx, ray, u, v, t)) {
+				ray.maxt = its.t = t;
+				its.u = u;
+				its.v = v;
+				its.mesh = mesh;
+				its.medium = mesh->getMedium();
+				f = idx;
+				foundIntersection = true;
+			}
+		}
+		primitives += mesh->getPrimitiveCount();
+		return foundIntersection;
+	}
+
+	/// Include the world space bounds of the instances into \ref m_bbox
+	void updateBoundingBox() {
+		m_bbox.reset();
+		for (const Mesh *mesh : m_meshes)
+			m_bbox.expandBy(mesh->getBoundingBox());
+		for (const InstanceRecord &instance : m_instances) {
+			const BoundingBox3f &bbox = instance.mesh->getBoundingBox();
+			for (int i = 0; i < 8; ++i)
+				m_bbox.expandBy(instance.toWorld * bbox.getCorner(i));
+		}
+	}
+
+	/// Placement of an instanced mesh
+	struct InstanceRecord {
+		Mesh *mesh;
+		Transform toWorld;
+		Transform toLocal;
+	};
+
+	std::vector<InstanceRecord> m_instances;
+};
+
+NORI_REGISTER_CLASS(BruteForce, "bruteforce");
+NORI_NAMESPACE_END
@@ -0,0 +1,3141 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <nori/timer.h>
+#include <pcg32.h>
+#include <tbb/tbb.h>
+#include <Eigen/Geometry>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+
+NORI_NAMESPACE_BEGIN
+
+/* Bin data structure for counting triangles and computing their bounding box
+   (only the first BVH::m_binCount bins are used) */
+struct Bins {
+	Bins() { memset(counts, 0, sizeof(n_UINT) * BVH::MaxBinCount); }
+	n_UINT counts[BVH::MaxBinCount];
+	BoundingBox3f bbox[BVH::MaxBinCount];
+};
+
+/**
+ * \brief Build task for parallel BVH construction
+ *
+ * This class uses the task groups of Intel's Thread Building Blocks
+ * to parallelize the divide and conquer BVH build at all levels.
+ *
+ * The used methodology is roughly that described in
+ * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
+ * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
+ */
+class BVHBuildTask {
+private:
+	BVH &bvh;
+	n_UINT node_idx;
+	n_UINT *start, *end, *temp;
+
+public:
+	/// Build-related parameters
+	enum {
+		/// Switch to a serial build when less than 32 triangles are left
+		SERIAL_THRESHOLD = 32,
+
+		/// Process triangles in batches of 1K for the purpose of parallelization
+		GRAIN_SIZE = 1000
+	};
+
+public:
+	/**
+	 * Create a new build task
+	 *
+	 * \param bvh
+	 *    Reference to the underlying BVH
+	 *
+	 * \param node_idx
+	 *    Index of the BVH node that should be built
+	 *
+	 * \param start
+	 *    Start pointer into a list of triangle indices to be processed
+	 *
+	 * \param end
+	 *    End pointer into a list of triangle indices to be processed
+	 *
+	 *  \param temp
+	 *    Pointer into a temporary memory region that can be used for
+	 *    construction purposes. The usable length is <tt>end-start</tt>
+	 *    unsigned integers.
+	 */
+	BVHBuildTask(BVH &bvh, n_UINT node_idx, n_UINT *start, n_UINT *end, n_UINT *temp)
+		: bvh(bvh), node_idx(node_idx), start(start), end(end), temp(temp) { }
+
+	void execute() {
+		/* The right subtrees run as tasks of this group, while the
+		   current thread directly continues with the left subtree */
+		tbb::task_group group;
+		while (split()) {
+			BVHBuildTask right(bvh, right_idx, right_start, end, right_temp);
+			group.run([right] { BVHBuildTask(right).execute(); });
+			end = right_start;
+		}
+		group.wait();
+	}
+
+private:
+	/**
+	 * Partition the current node, or build it serially if it is small
+	 *
+	 * \return \c true if the node was split. The current task then
+	 * describes its left child, and \c right_idx, \c right_start and
+	 * \c right_temp its right child.
+	 */
+	bool split() {
+		n_UINT size = (n_UINT)(end - start);
+		BVH::BVHNode &node = bvh.m_nodes[node_idx];
+
+		/* Switch to a serial build when less than SERIAL_THRESHOLD triangles are left */
+		if (size < SERIAL_THRESHOLD) {
+			execute_serially(bvh, node_idx, start, end, temp);
+			return false;
+		}
+
+		/* Always split along the largest axis */
+		int axis = node.bbox.getLargestAxis();
+		float min = node.bbox.min[axis], max = node.bbox.max[axis],
+			inv_bin_size = bvh.m_binCount / (max - min);
+
+		/* Accumulate all triangles into bins */
+		Bins bins = tbb::parallel_reduce(
+			tbb::blocked_range<n_UINT>(0u, size, GRAIN_SIZE),
+			Bins(),
+			/* MAP: Bin a number of triangles and return the resulting 'Bins' data structure */
+			[&](const tbb::blocked_range<n_UINT> &range, Bins result) {
+			for (n_UINT i = range.begin(); i != range.end(); ++i) {
+				n_UINT f = start[i];
+				float centroid = bvh.getCentroid(f)[axis];
+
+				int index = std::min(std::max(
+					(int)((centroid - min) * inv_bin_size), 0),
+					(bvh.m_binCount - 1));
+
+				result.counts[index]++;
+				result.bbox[index].expandBy(bvh.getBoundingBox(f));
+			}
+			return result;
+		},
+			/* REDUCE: Combine two 'Bins' data structures */
+			[&](const Bins &b1, const Bins &b2) {
+			Bins result;
+			for (int i = 0; i < bvh.m_binCount; ++i) {
+				result.counts[i] = b1.counts[i] + b2.counts[i];
+				result.bbox[i] = BoundingBox3f::merge(b1.bbox[i], b2.bbox[i]);
+			}
+			return result;
+		}
+		);
+
+		/* Choose the best split plane based on the binned data */
+		BoundingBox3f bbox_left[BVH::MaxBinCount];
+		bbox_left[0] = bins.bbox[0];
+		for (int i = 1; i < bvh.m_binCount; ++i) {
+			bins.counts[i] += bins.counts[i - 1];
+			bbox_left[i] = BoundingBox3f::merge(bbox_left[i - 1], bins.bbox[i]);
+		}
+
+		BoundingBox3f bbox_right = bins.bbox[bvh.m_binCount - 1], best_bbox_right;
+		int64_t best_index = -1;
+		float best_cost = bvh.leafCost(size);
+		float tri_factor = bvh.m_intersectionCost / node.bbox.getSurfaceArea();
+
+		for (int i = bvh.m_binCount - 2; i >= 0; --i) {
+			n_UINT prims_left = bins.counts[i], prims_right = (n_UINT)(end - start) - bins.counts[i];
+			float sah_cost = 2.0f * bvh.m_traversalCost +
+				tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
+					prims_right * bbox_right.getSurfaceArea());
+			if (sah_cost < best_cost) {
+				best_cost = sah_cost;
+				best_index = i;
+				best_bbox_right = bbox_right;
+			}
+			bbox_right = BoundingBox3f::merge(bbox_right, bins.bbox[i]);
+		}
+
+		if (best_index == -1) {
+			/* Could not find a good split plane -- retry with
+			   more careful serial code just to be sure.. */
+			execute_serially(bvh, node_idx, start, end, temp);
+			return false;
+		}
+
+		n_UINT left_count = bins.counts[best_index];
+		int node_idx_left = node_idx + 1;
+		int node_idx_right = node_idx + 2 * left_count;
+
+		bvh.m_nodes[node_idx_left].bbox = bbox_left[best_index];
+		bvh.m_nodes[node_idx_right].bbox = best_bbox_right;
+		node.inner.rightChild = node_idx_right;
+		node.inner.axis = axis;
+		node.inner.flag = 0;
+
+		std::atomic<n_UINT> offset_left(0),
+			offset_right(bins.counts[best_index]);
+
+		tbb::parallel_for(
+			tbb::blocked_range<n_UINT>(0u, size, GRAIN_SIZE),
+			[&](const tbb::blocked_range<n_UINT> &range) {
+			n_UINT count_left = 0, count_right = 0;
+			for (n_UINT i = range.begin(); i != range.end(); ++i) {
+				n_UINT f = start[i];
+				float centroid = bvh.getCentroid(f)[axis];
+				int index = (int)((centroid - min) * inv_bin_size);
+				(index <= best_index ? count_left : count_right)++;
+			}
+			n_UINT idx_l = offset_left.fetch_add(count_left);
+			n_UINT idx_r = offset_right.fetch_add(count_right);
+			for (n_UINT i = range.begin(); i != range.end(); ++i) {
+				n_UINT f = start[i];
+				float centroid = bvh.getCentroid(f)[axis];
+				int index = (int)((centroid - min) * inv_bin_size);
+				if (index <= best_index)
+					temp[idx_l++] = f;
+				else
+					temp[idx_r++] = f;
+			}
+		}
+		);
+		memcpy(start, temp, size * sizeof(n_UINT));
+		assert(offset_left == left_count && offset_right == size);
+
+		right_idx = node_idx_right;
+		right_start = start + left_count;
+		right_temp = temp + left_count;
+		node_idx = node_idx_left;
+		return true;
+	}
+
+	/// Right child produced by the last call to \ref split()
+	n_UINT right_idx;
+	n_UINT *right_start, *right_temp;
+
+public:
+
+	/// Single-threaded build function
+	static void execute_serially(BVH &bvh, n_UINT node_idx, n_UINT *start, n_UINT *end, n_UINT *temp) {
+		BVH::BVHNode &node = bvh.m_nodes[node_idx];
+		n_UINT size = (n_UINT)(end - start);
+		float best_cost = bvh.leafCost(size);
+		int64_t best_index = -1, best_axis = -1;
+		float *left_areas = (float *)temp;
+
+		/* Try splitting along every axis */
+		for (int axis = 0; axis < 3; ++axis) {
+			/* Sort all triangles based on their centroid positions projected on the axis */
+			std::sort(start, end, [&](n_UINT f1, n_UINT f2) {
+				return bvh.getCentroid(f1)[axis] < bvh.getCentroid(f2)[axis];
+			});
+
+			BoundingBox3f bbox;
+			for (n_UINT i = 0; i < size; ++i) {
+				n_UINT f = *(start + i);
+				bbox.expandBy(bvh.getBoundingBox(f));
+				left_areas[i] = (float)bbox.getSurfaceArea();
+			}
+			if (axis == 0)
+				node.bbox = bbox;
+
+			bbox.reset();
+
+			/* Choose the best split plane */
+			float tri_factor = bvh.m_intersectionCost / node.bbox.getSurfaceArea();
+			for (n_UINT i = size - 1; i >= 1; --i) {
+				n_UINT f = *(start + i);
+				bbox.expandBy(bvh.getBoundingBox(f));
+
+				float left_area = left_areas[i - 1];
+				float right_area = bbox.getSurfaceArea();
+				n_UINT prims_left = i;
+				n_UINT prims_right = size - i;
+
+				float sah_cost = 2.0f * bvh.m_traversalCost +
+					tri_factor * (prims_left * left_area +
+						prims_right * right_area);
+
+				if (sah_cost < best_cost) {
+					best_cost = sah_cost;
+					best_index = i;
+					best_axis = axis;
+				}
+			}
+		}
+
+		if (best_index == -1) {
+			/* Splitting does not reduce the cost, make a leaf */
+			node.leaf.flag = 1;
+			node.leaf.start = (n_UINT)(start - bvh.m_indices.data());
+			node.leaf.size = size;
+			return;
+		}
+
+		std::sort(start, end, [&](n_UINT f1, n_UINT f2) {
+			return bvh.getCentroid(f1)[best_axis] < bvh.getCentroid(f2)[best_axis];
+		});
+
+		n_UINT left_count = (n_UINT)best_index;
+		n_UINT node_idx_left = node_idx + 1;
+		n_UINT node_idx_right = node_idx + 2 * left_count;
+		node.inner.rightChild = node_idx_right;
+		node.inner.axis = best_axis;
+		node.inner.flag = 0;
+
+		execute_serially(bvh, node_idx_left, start, start + left_count, temp);
+		execute_serially(bvh, node_idx_right, start + left_count, end, temp + left_count);
+	}
+};
+
+/**
+ * \brief Builder for linear BVHs over Morton-sorted triangles
+ *
+ * Triangles are sorted along a Z-order curve through their centroids
+ * with a parallel radix sort. Every node then splits its range where the
+ * highest differing bit of the Morton codes flips, i.e. at the spatial
+ * median of an implicit octree ("Fast BVH Construction on GPUs" by
+ * Lauterbach et al., Eurographics 2009).
+ *
+ * The hierarchical variant ("Simpler and Faster HLBVH with Work Queues"
+ * by Garanzha et al., HPG 2011) groups triangles into clusters that share
+ * the top bits of their codes, builds the tree above the clusters with
+ * the surface area heuristic and the treelets below them with the Morton
+ * splits.
+ *
+ * The nodes follow the same implicit layout as \ref BVHBuildTask, so that
+ * the regular compaction pass can be used afterwards.
+ */
+class LBVHBuilder {
+public:
+	/// Build-related parameters
+	enum {
+		/// Build both children in parallel above this many triangles
+		PARALLEL_THRESHOLD = 4096,
+
+		/// Clusters of the hierarchical variant share this many top bits
+		CLUSTER_BITS = 12,
+
+		/// Number of elements that one radix sort task processes
+		SORT_BLOCK_SIZE = 16384
+	};
+
+	LBVHBuilder(BVH &bvh) : bvh(bvh) { }
+
+	/// Build the tree into \c bvh.m_nodes and \c bvh.m_indices
+	void build(bool hierarchical) {
+		n_UINT size = bvh.getPrimitiveCount();
+		computeBounds(size);
+		sortByMortonCode(size);
+
+		if (hierarchical) {
+			buildClusters(size);
+		}
+		else {
+			BoundingBox3f bbox = emit(0u, 0u, size);
+			bvh.m_nodes[0].bbox = bbox;
+		}
+	}
+
+protected:
+	/// Precompute the bounding box and centroid of every triangle
+	void computeBounds(n_UINT size) {
+		bboxes.resize(size);
+		centroids.resize(size);
+		tbb::parallel_for(tbb::blocked_range<n_UINT>(0u, size, BVHBuildTask::GRAIN_SIZE),
+			[&](const tbb::blocked_range<n_UINT> &range) {
+			for (n_UINT i = range.begin(); i != range.end(); ++i) {
+				n_UINT f = i;
+				const Mesh *mesh = bvh.m_meshes[bvh.findMesh(f)];
+				bboxes[i] = mesh->getBoundingBox(f);
+				centroids[i] = mesh->getCentroid(f);
+			}
+		});
+	}
+
+	/// Fill \c bvh.m_indices with all triangles in Morton order, and \c codes accordingly
+	void sortByMortonCode(n_UINT size) {
+		BoundingBox3f bounds = tbb::parallel_reduce(
+			tbb::blocked_range<n_UINT>(0u, size, BVHBuildTask::GRAIN_SIZE),
+			BoundingBox3f(),
+			[&](const tbb::blocked_range<n_UINT> &range, BoundingBox3f result) {
+			for (n_UINT i = range.begin(); i != range.end(); ++i)
+				result.expandBy(centroids[i]);
+			return result;
+		},
+			[](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+			return BoundingBox3f::merge(b1, b2);
+		}
+		);
+
+		Vector3f scale = Vector3f::Constant(1024.0f).cwiseQuotient(
+			bounds.getExtents().cwiseMax(Vector3f::Constant(Epsilon)));
+
+		/* Keys hold the Morton code in the upper and the triangle in the lower half */
+		std::vector<uint64_t> keys(size);
+		tbb::parallel_for(tbb::blocked_range<n_UINT>(0u, size, BVHBuildTask::GRAIN_SIZE),
+			[&](const tbb::blocked_range<n_UINT> &range) {
+			for (n_UINT i = range.begin(); i != range.end(); ++i) {
+				Vector3f p = (centroids[i] - bounds.min).cwiseProduct(scale);
+				uint32_t code = mortonCode(
+					(uint32_t) clamp((int) p.x(), 0, 1023),
+					(uint32_t) clamp((int) p.y(), 0, 1023),
+					(uint32_t) clamp((int) p.z(), 0, 1023));
+				keys[i] = ((uint64_t) code << 32) | i;
+			}
+		});
+
+		radixSort(keys);
+
+		codes.resize(size);
+		tbb::parallel_for(tbb::blocked_range<n_UINT>(0u, size, BVHBuildTask::GRAIN_SIZE),
+			[&](const tbb::blocked_range<n_UINT> &range) {
+			for (n_UINT i = range.begin(); i != range.end(); ++i) {
+				codes[i] = (uint32_t) (keys[i] >> 32);
+				bvh.m_indices[i] = (n_UINT) (keys[i] & 0xFFFFFFFFu);
+			}
+		});
+	}
+
+	/**
+	 * \brief Stable parallel LSD radix sort of the 30 bit codes in the
+	 * upper half of \c keys
+	 *
+	 * Each pass histograms fixed-size blocks in parallel, turns the
+	 * histograms into per-block output offsets and scatters the blocks in
+	 * parallel again.
+	 */
+	static void radixSort(std::vector<uint64_t> &keys) {
+		const int RADIX_BITS = 8, BUCKETS = 1 << RADIX_BITS;
+		size_t size = keys.size();
+		size_t blockCount = (size + SORT_BLOCK_SIZE - 1) / SORT_BLOCK_SIZE;
+		std::vector<uint64_t> temp(size);
+		std::vector<size_t> offsets(blockCount * BUCKETS);
+
+		for (int shift = 32; shift < 62; shift += RADIX_BITS) {
+			tbb::parallel_for(size_t(0), blockCount, [&](size_t block) {
+				size_t *histogram = &offsets[block * BUCKETS];
+				std::fill(histogram, histogram + BUCKETS, 0);
+				for (size_t i = block * SORT_BLOCK_SIZE, end = std::min(size, i + SORT_BLOCK_SIZE); i < end; ++i)
+					histogram[(keys[i] >> shift) & (BUCKETS - 1)]++;
+			});
+
+			size_t sum = 0;
+			for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+				for (size_t block = 0; block < blockCount; ++block) {
+					size_t count = offsets[block * BUCKETS + bucket];
+					offsets[block * BUCKETS + bucket] = sum;
+					sum += count;
+				}
+			}
+
+			tbb::parallel_for(size_t(0), blockCount, [&](size_t block) {
+				size_t *offset = &offsets[block * BUCKETS];
+				for (size_t i = block * SORT_BLOCK_SIZE, end = std::min(size, i + SORT_BLOCK_SIZE); i < end; ++i)
+					temp[offset[(keys[i] >> shift) & (BUCKETS - 1)]++] = keys[i];
+			});
+
+			keys.swap(temp);
+		}
+	}
+
+	/// Emit the subtree over the sorted triangles <tt>[start, end)</tt> at \c node_idx
+	BoundingBox3f emit(n_UINT node_idx, n_UINT start, n_UINT end) {
+		BVH::BVHNode &node = bvh.m_nodes[node_idx];
+		n_UINT size = end - start;
+		BoundingBox3f bbox;
+
+		if (size <= (n_UINT) bvh.m_leafSize) {
+			for (n_UINT i = start; i < end; ++i)
+				bbox.expandBy(bboxes[bvh.m_indices[i]]);
+			node.leaf.flag = 1;
+			node.leaf.start = start;
+			node.leaf.size = size;
+			node.bbox = bbox;
+			return bbox;
+		}
+
+		/* Split where the highest differing bit of the range flips */
+		uint32_t first = codes[start], last = codes[end - 1];
+		n_UINT split;
+		int axis = -1;
+		if (first == last) {
+			split = start + size / 2;
+		}
+		else {
+			int bit = 31;
+			while (!(((first ^ last) >> bit) & 1))
+				--bit;
+			split = (n_UINT) (std::partition_point(codes.begin() + start, codes.begin() + end,
+				[bit](uint32_t code) { return !((code >> bit) & 1); }) - codes.begin());
+			/* Bits cycle through x, y, z from the most significant one (see mortonCode()) */
+			axis = 2 - bit % 3;
+		}
+
+		n_UINT node_idx_left = node_idx + 1;
+		n_UINT node_idx_right = node_idx + 2 * (split - start);
+		BoundingBox3f bbox_left, bbox_right;
+
+		if (size > PARALLEL_THRESHOLD) {
+			tbb::parallel_invoke(
+				[&] { bbox_left = emit(node_idx_left, start, split); },
+				[&] { bbox_right = emit(node_idx_right, split, end); }
+			);
+		}
+		else {
+			bbox_left = emit(node_idx_left, start, split);
+			bbox_right = emit(node_idx_right, split, end);
+		}
+
+		bbox = BoundingBox3f::merge(bbox_left, bbox_right);
+		node.inner.flag = 0;
+		node.inner.axis = axis >= 0 ? axis : bbox.getLargestAxis();
+		node.inner.rightChild = node_idx_right;
+		node.bbox = bbox;
+		return bbox;
+	}
+
+	/// Run of Morton-sorted triangles that share the top \ref CLUSTER_BITS bits
+	struct Cluster {
+		n_UINT start, count;    ///< Range in Morton order
+		n_UINT dest;            ///< Range start after the clusters have been reordered
+		n_UINT node;            ///< Root node of the treelet
+		BoundingBox3f bbox;
+	};
+
+	/// Hierarchical variant: SAH above the clusters, Morton splits below
+	void buildClusters(n_UINT size) {
+		std::vector<Cluster> clusters;
+		const int shift = 30 - CLUSTER_BITS;
+		for (n_UINT i = 0; i < size; ) {
+			Cluster cluster;
+			cluster.start = i;
+			uint32_t prefix = codes[i] >> shift;
+			while (i < size && (codes[i] >> shift) == prefix)
+				++i;
+			cluster.count = i - cluster.start;
+			clusters.push_back(cluster);
+		}
+
+		tbb::parallel_for(size_t(0), clusters.size(), [&](size_t c) {
+			Cluster &cluster = clusters[c];
+			for (n_UINT i = cluster.start; i < cluster.start + cluster.count; ++i)
+				cluster.bbox.expandBy(bboxes[bvh.m_indices[i]]);
+		});
+
+		/* Lay out the upper levels, which may reorder the clusters */
+		buildTop(0u, clusters.data(), clusters.data() + clusters.size(), 0u);
+
+		std::vector<n_UINT> indices(size);
+		std::vector<uint32_t> sortedCodes(size);
+		tbb::parallel_for(size_t(0), clusters.size(), [&](size_t c) {
+			const Cluster &cluster = clusters[c];
+			std::copy(bvh.m_indices.begin() + cluster.start, bvh.m_indices.begin() + cluster.start + cluster.count,
+				indices.begin() + cluster.dest);
+			std::copy(codes.begin() + cluster.start, codes.begin() + cluster.start + cluster.count,
+				sortedCodes.begin() + cluster.dest);
+		});
+		bvh.m_indices.swap(indices);
+		codes.swap(sortedCodes);
+
+		tbb::parallel_for(size_t(0), clusters.size(), [&](size_t c) {
+			const Cluster &cluster = clusters[c];
+			emit(cluster.node, cluster.dest, cluster.dest + cluster.count);
+		});
+	}
+
+	/**
+	 * \brief Recursively split the clusters <tt>[begin, end)</tt> with a
+	 * full SAH sweep, placing their triangles at \c first
+	 */
+	void buildTop(n_UINT node_idx, Cluster *begin, Cluster *end, n_UINT first) {
+		if (end - begin == 1) {
+			begin->node = node_idx;
+			begin->dest = first;
+			return;
+		}
+
+		BVH::BVHNode &node = bvh.m_nodes[node_idx];
+		BoundingBox3f bbox;
+		for (Cluster *c = begin; c != end; ++c)
+			bbox.expandBy(c->bbox);
+
+		size_t count = end - begin;
+		std::vector<float> left_areas(count);
+		float best_cost = std::numeric_limits<float>::infinity();
+		int best_axis = 0;
+		size_t best_index = 1;
+
+		for (int axis = 0; axis < 3; ++axis) {
+			std::sort(begin, end, [axis](const Cluster &c1, const Cluster &c2) {
+				return c1.bbox.getCenter()[axis] < c2.bbox.getCenter()[axis];
+			});
+
+			BoundingBox3f left;
+			std::vector<n_UINT> left_counts(count);
+			n_UINT prims = 0;
+			for (size_t i = 0; i < count; ++i) {
+				left.expandBy(begin[i].bbox);
+				prims += begin[i].count;
+				left_areas[i] = left.getSurfaceArea();
+				left_counts[i] = prims;
+			}
+
+			BoundingBox3f right;
+			for (size_t i = count - 1; i >= 1; --i) {
+				right.expandBy(begin[i].bbox);
+				float cost = left_areas[i - 1] * left_counts[i - 1] +
+					right.getSurfaceArea() * (prims - left_counts[i - 1]);
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_index = i;
+				}
+			}
+		}
+
+		std::sort(begin, end, [best_axis](const Cluster &c1, const Cluster &c2) {
+			return c1.bbox.getCenter()[best_axis] < c2.bbox.getCenter()[best_axis];
+		});
+
+		n_UINT left_count = 0;
+		for (size_t i = 0; i < best_index; ++i)
+			left_count += begin[i].count;
+
+		n_UINT node_idx_right = node_idx + 2 * left_count;
+		node.inner.flag = 0;
+		node.inner.axis = best_axis;
+		node.inner.rightChild = node_idx_right;
+		node.bbox = bbox;
+
+		buildTop(node_idx + 1, begin, begin + best_index, first);
+		buildTop(node_idx_right, begin + best_index, end, first + left_count);
+	}
+
+	BVH &bvh;
+	std::vector<BoundingBox3f> bboxes;  ///< Bounding box of every triangle
+	std::vector<Point3f> centroids;     ///< Centroid of every triangle
+	std::vector<uint32_t> codes;        ///< Morton codes in the order of \c bvh.m_indices
+};
+
+/**
+ * \brief Builder for BVHs with spatial splits
+ *
+ * Follows "Spatial Splits in Bounding Volume Hierarchies" by Stich et al.
+ * (HPG 2009). Every node evaluates the binned object split of
+ * \ref BVHBuildTask on all three axes and, when the children of that
+ * split overlap, also a binned spatial split that clips the triangles
+ * against the bin planes. A spatial split references a straddling
+ * triangle from both children, so it is only taken while the number of
+ * duplicated references stays within the budget.
+ *
+ * Since duplication makes the size of a subtree unpredictable, nodes are
+ * first allocated in pairs from a shared pool and then written to
+ * \c bvh.m_nodes in the depth-first layout of \ref BVHBuildTask.
+ */
+class SBVHBuilder {
+public:
+	/// Build-related parameters
+	enum {
+		/// Build both children in parallel above this many references
+		PARALLEL_THRESHOLD = 4096
+	};
+
+	/// Spatial splits are only tried when the children of the object split overlap by this fraction of the scene's surface area
+	static constexpr float OVERLAP_THRESHOLD = 1e-5f;
+
+	SBVHBuilder(BVH &bvh, n_UINT budget) : bvh(bvh), budget(budget) { }
+
+	/**
+	 * \brief Build the tree into \c bvh.m_nodes and \c bvh.m_indices
+	 *
+	 * \c bvh.m_indices must have room for the triangles plus the
+	 * duplication budget and is shrunk to the references that were used.
+	 */
+	void build() {
+		n_UINT size = bvh.getPrimitiveCount();
+		std::vector<Reference> refs(size);
+		tbb::parallel_for(tbb::blocked_range<n_UINT>(0u, size, BVHBuildTask::GRAIN_SIZE),
+			[&](const tbb::blocked_range<n_UINT> &range) {
+			for (n_UINT i = range.begin(); i != range.end(); ++i)
+				refs[i] = Reference { i, bvh.getBoundingBox(i) };
+		});
+
+		rootArea = bvh.m_bbox.getSurfaceArea();
+		nodes.grow_by(1);
+		split(0u, refs, bvh.m_bbox);
+		bvh.m_indices.resize(leafOffset);
+
+		bvh.m_nodes.assign(nodes.size(), BVH::BVHNode());
+		emit(0u, 0u);
+	}
+
+	/// Number of spatial splits that were taken
+	n_UINT getSpatialSplitCount() const { return spatialSplits; }
+
+protected:
+	/// Node of the tree under construction
+	struct BuildNode {
+		BoundingBox3f bbox;
+		int axis;
+		n_UINT left;                ///< Index of the left child, the right one follows it
+		n_UINT start, size;         ///< Range in \c bvh.m_indices (leaves only)
+		bool leaf;
+	};
+
+	/// Write the subtree of \c nodes[index] to \c bvh.m_nodes[node_idx], return the next free node
+	n_UINT emit(n_UINT index, n_UINT node_idx) {
+		const BuildNode &build = nodes[index];
+		BVH::BVHNode &node = bvh.m_nodes[node_idx];
+		node.bbox = build.bbox;
+		if (build.leaf) {
+			node.leaf.flag = 1;
+			node.leaf.start = build.start;
+			node.leaf.size = build.size;
+			return node_idx + 1;
+		}
+		n_UINT node_idx_right = emit(build.left, node_idx + 1);
+		node.inner.flag = 0;
+		node.inner.axis = build.axis;
+		node.inner.rightChild = node_idx_right;
+		return emit(build.left + 1, node_idx_right);
+	}
+
+	/// Reference to a triangle, possibly clipped to a part of its bounds
+	struct Reference {
+		n_UINT f;
+		BoundingBox3f bbox;
+	};
+
+	/// Bins of a spatial split, counting the references that begin and end in each one
+	struct SpatialBins {
+		SpatialBins() {
+			memset(entries, 0, sizeof(n_UINT) * BVH::MaxBinCount);
+			memset(exits, 0, sizeof(n_UINT) * BVH::MaxBinCount);
+		}
+		n_UINT entries[BVH::MaxBinCount];
+		n_UINT exits[BVH::MaxBinCount];
+		BoundingBox3f bbox[BVH::MaxBinCount];
+	};
+
+	/// Best split found for a node
+	struct Split {
+		float cost = std::numeric_limits<float>::infinity();
+		int axis = -1;
+		float pos = 0.f;            ///< Split plane (spatial), or bin boundary of the centroids (object)
+		float min = 0.f, inv_bin_size = 0.f;
+		int index = -1;             ///< Last bin on the left side
+		n_UINT left_count = 0, right_count = 0;
+		BoundingBox3f bbox_left, bbox_right;
+	};
+
+	static BoundingBox3f bounds(const std::vector<Reference> &refs) {
+		return tbb::parallel_reduce(
+			tbb::blocked_range<size_t>(0, refs.size(), BVHBuildTask::GRAIN_SIZE),
+			BoundingBox3f(),
+			[&](const tbb::blocked_range<size_t> &range, BoundingBox3f result) {
+			for (size_t i = range.begin(); i != range.end(); ++i)
+				result.expandBy(refs[i].bbox);
+			return result;
+		},
+			[](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+			return BoundingBox3f::merge(b1, b2);
+		}
+		);
+	}
+
+	/// Binned SAH over the reference centroids, as in \ref BVHBuildTask, but on every axis
+	Split findObjectSplit(const std::vector<Reference> &refs, float tri_factor) const {
+		n_UINT size = (n_UINT) refs.size();
+		BoundingBox3f centroids;
+		for (const Reference &ref : refs)
+			centroids.expandBy(ref.bbox.getCenter());
+
+		Split best;
+		for (int axis = 0; axis < 3; ++axis) {
+			float min = centroids.min[axis], max = centroids.max[axis];
+			if (!(max > min))
+				continue;
+			float inv_bin_size = bvh.m_binCount / (max - min);
+
+			Bins bins = tbb::parallel_reduce(
+				tbb::blocked_range<n_UINT>(0u, size, BVHBuildTask::GRAIN_SIZE),
+				Bins(),
+				[&](const tbb::blocked_range<n_UINT> &range, Bins result) {
+				for (n_UINT i = range.begin(); i != range.end(); ++i) {
+					int index = binIndex(refs[i].bbox.getCenter()[axis], min, inv_bin_size);
+					result.counts[index]++;
+					result.bbox[index].expandBy(refs[i].bbox);
+				}
+				return result;
+			},
+				[&](const Bins &b1, const Bins &b2) {
+				Bins result;
+				for (int i = 0; i < bvh.m_binCount; ++i) {
+					result.counts[i] = b1.counts[i] + b2.counts[i];
+					result.bbox[i] = BoundingBox3f::merge(b1.bbox[i], b2.bbox[i]);
+				}
+				return result;
+			}
+			);
+
+			BoundingBox3f bbox_left[BVH::MaxBinCount];
+			bbox_left[0] = bins.bbox[0];
+			for (int i = 1; i < bvh.m_binCount; ++i) {
+				bins.counts[i] += bins.counts[i - 1];
+				bbox_left[i] = BoundingBox3f::merge(bbox_left[i - 1], bins.bbox[i]);
+			}
+
+			BoundingBox3f bbox_right = bins.bbox[bvh.m_binCount - 1];
+			for (int i = bvh.m_binCount - 2; i >= 0; --i) {
+				n_UINT prims_left = bins.counts[i], prims_right = size - bins.counts[i];
+				if (prims_left > 0 && prims_right > 0) {
+					float sah_cost = 2.0f * bvh.m_traversalCost +
+						tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
+							prims_right * bbox_right.getSurfaceArea());
+					if (sah_cost < best.cost) {
+						best.cost = sah_cost;
+						best.axis = axis;
+						best.index = i;
+						best.min = min;
+						best.inv_bin_size = inv_bin_size;
+						best.left_count = prims_left;
+						best.right_count = prims_right;
+						best.bbox_left = bbox_left[i];
+						best.bbox_right = bbox_right;
+					}
+				}
+				bbox_right = BoundingBox3f::merge(bbox_right, bins.bbox[i]);
+			}
+		}
+		return best;
+	}
+
+	/// Binned SAH over planes that cut the node into equal slabs, clipping the references
+	Split findSpatialSplit(const std::vector<Reference> &refs, const BoundingBox3f &bbox, float tri_factor) const {
+		n_UINT size = (n_UINT) refs.size();
+		Split best;
+		for (int axis = 0; axis < 3; ++axis) {
+			float min = bbox.min[axis], max = bbox.max[axis];
+			if (!(max > min))
+				continue;
+			float bin_size = (max - min) / bvh.m_binCount, inv_bin_size = 1.f / bin_size;
+
+			SpatialBins bins = tbb::parallel_reduce(
+				tbb::blocked_range<n_UINT>(0u, size, BVHBuildTask::GRAIN_SIZE),
+				SpatialBins(),
+				[&](const tbb::blocked_range<n_UINT> &range, SpatialBins result) {
+				for (n_UINT i = range.begin(); i != range.end(); ++i) {
+					const Reference &ref = refs[i];
+					int first = binIndex(ref.bbox.min[axis], min, inv_bin_size);
+					int last = std::max(first, binIndex(ref.bbox.max[axis], min, inv_bin_size));
+
+					/* Chop the reference into the bins it overlaps */
+					Reference rest = ref;
+					for (int j = first; j < last; ++j) {
+						Reference left, right;
+						splitReference(rest, axis, min + (j + 1) * bin_size, left, right);
+						result.bbox[j].expandBy(left.bbox);
+						rest = right;
+					}
+					result.bbox[last].expandBy(rest.bbox);
+					result.entries[first]++;
+					result.exits[last]++;
+				}
+				return result;
+			},
+				[&](const SpatialBins &b1, const SpatialBins &b2) {
+				SpatialBins result;
+				for (int i = 0; i < bvh.m_binCount; ++i) {
+					result.entries[i] = b1.entries[i] + b2.entries[i];
+					result.exits[i] = b1.exits[i] + b2.exits[i];
+					result.bbox[i] = BoundingBox3f::merge(b1.bbox[i], b2.bbox[i]);
+				}
+				return result;
+			}
+			);
+
+			BoundingBox3f bbox_left[BVH::MaxBinCount];
+			n_UINT entries[BVH::MaxBinCount];
+			bbox_left[0] = bins.bbox[0];
+			entries[0] = bins.entries[0];
+			for (int i = 1; i < bvh.m_binCount; ++i) {
+				bbox_left[i] = BoundingBox3f::merge(bbox_left[i - 1], bins.bbox[i]);
+				entries[i] = entries[i - 1] + bins.entries[i];
+			}
+
+			BoundingBox3f bbox_right;
+			n_UINT exits = 0;
+			for (int i = bvh.m_binCount - 2; i >= 0; --i) {
+				bbox_right.expandBy(bins.bbox[i + 1]);
+				exits += bins.exits[i + 1];
+				n_UINT prims_left = entries[i], prims_right = exits;
+				if (prims_left == 0 || prims_right == 0)
+					continue;
+				float sah_cost = 2.0f * bvh.m_traversalCost +
+					tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
+						prims_right * bbox_right.getSurfaceArea());
+				if (sah_cost < best.cost) {
+					best.cost = sah_cost;
+					best.axis = axis;
+					best.index = i;
+					best.pos = min + (i + 1) * bin_size;
+					best.left_count = prims_left;
+					best.right_count = prims_right;
+					best.bbox_left = bbox_left[i];
+					best.bbox_right = bbox_right;
+				}
+			}
+		}
+		return best;
+	}
+
+	int binIndex(float value, float min, float inv_bin_size) const {
+		return std::min(std::max((int) ((value - min) * inv_bin_size), 0), bvh.m_binCount - 1);
+	}
+
+	/// Clip the part of a triangle within \c ref.bbox against the plane <tt>x[axis] = pos</tt>
+	void splitReference(const Reference &ref, int axis, float pos, Reference &left, Reference &right) const {
+		left.f = right.f = ref.f;
+		left.bbox.reset();
+		right.bbox.reset();
+
+		n_UINT idx = ref.f;
+		const Mesh *mesh = bvh.m_meshes[bvh.findMesh(idx)];
+		if (mesh->isAnalytic()) {
+			/* Only the bounds are known, so split them conservatively */
+			left.bbox = right.bbox = ref.bbox;
+			left.bbox.max[axis] = std::min(left.bbox.max[axis], pos);
+			right.bbox.min[axis] = std::max(right.bbox.min[axis], pos);
+			return;
+		}
+
+		const MatrixXf &V = mesh->getVertexPositions();
+		const MatrixXu &F = mesh->getIndices();
+
+		for (int i = 0; i < 3; ++i) {
+			Point3f v0 = V.col(F(i, idx)), v1 = V.col(F((i + 1) % 3, idx));
+			float p0 = v0[axis], p1 = v1[axis];
+			if (p0 <= pos)
+				left.bbox.expandBy(v0);
+			if (p0 >= pos)
+				right.bbox.expandBy(v0);
+			if ((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos)) {
+				Point3f p = v0 + (v1 - v0) * clamp((pos - p0) / (p1 - p0), 0.f, 1.f);
+				p[axis] = pos;
+				left.bbox.expandBy(p);
+				right.bbox.expandBy(p);
+			}
+		}
+
+		left.bbox.clip(ref.bbox);
+		right.bbox.clip(ref.bbox);
+	}
+
+	/// Reserve \c count duplicated references from the budget
+	bool reserve(n_UINT count) {
+		n_UINT current = duplicates.load();
+		do {
+			if (current + count > budget)
+				return false;
+		} while (!duplicates.compare_exchange_weak(current, current + count));
+		return true;
+	}
+
+	/// Turn \c node into a leaf over \c refs
+	void makeLeaf(BuildNode &node, const std::vector<Reference> &refs) {
+		n_UINT size = (n_UINT) refs.size();
+		n_UINT start = leafOffset.fetch_add(size);
+		for (n_UINT i = 0; i < size; ++i)
+			bvh.m_indices[start + i] = refs[i].f;
+		node.leaf = true;
+		node.start = start;
+		node.size = size;
+	}
+
+	/// Build the subtree over \c refs (which are released) with tight bounds \c bbox
+	void split(n_UINT node_idx, std::vector<Reference> &refs, const BoundingBox3f &bbox) {
+		BuildNode &node = nodes[node_idx];
+		n_UINT size = (n_UINT) refs.size();
+		node.bbox = bbox;
+
+		float leaf_cost = bvh.leafCost(size);
+		float tri_factor = bvh.m_intersectionCost / bbox.getSurfaceArea();
+		Split object = size > 1 ? findObjectSplit(refs, tri_factor) : Split();
+
+		/* Only overlapping children can profit from splitting references */
+		Split spatial;
+		BoundingBox3f overlap = object.bbox_left;
+		overlap.clip(object.bbox_right);
+		if (size > 1 && (object.axis < 0 || (overlap.isValid() &&
+				overlap.getSurfaceArea() > OVERLAP_THRESHOLD * rootArea)))
+			spatial = findSpatialSplit(refs, bbox, tri_factor);
+
+		bool use_spatial = spatial.cost < object.cost && spatial.cost < leaf_cost;
+		n_UINT reserved = 0;
+		if (use_spatial) {
+			reserved = spatial.left_count + spatial.right_count - size;
+			use_spatial = reserve(reserved);
+		}
+
+		if (!use_spatial && !(object.cost < leaf_cost)) {
+			makeLeaf(node, refs);
+			return;
+		}
+
+		std::vector<Reference> left, right;
+		left.reserve(use_spatial ? spatial.left_count : object.left_count);
+		right.reserve(use_spatial ? spatial.right_count : object.right_count);
+		int axis;
+
+		if (use_spatial) {
+			axis = spatial.axis;
+			float pos = spatial.pos;
+			BoundingBox3f bbox_left = spatial.bbox_left, bbox_right = spatial.bbox_right;
+			float count_left = (float) spatial.left_count, count_right = (float) spatial.right_count;
+
+			for (const Reference &ref : refs) {
+				if (ref.bbox.max[axis] <= pos) {
+					left.push_back(ref);
+					continue;
+				}
+				if (ref.bbox.min[axis] >= pos) {
+					right.push_back(ref);
+					continue;
+				}
+
+				Reference ref_left, ref_right;
+				splitReference(ref, axis, pos, ref_left, ref_right);
+				if (!ref_left.bbox.isValid() || !ref_right.bbox.isValid()) {
+					(ref_left.bbox.isValid() ? left : right).push_back(ref);
+					continue;
+				}
+
+				/* Unsplit the reference if moving it entirely to one side is cheaper */
+				float area_left = bbox_left.getSurfaceArea(), area_right = bbox_right.getSurfaceArea();
+				float cost_split = area_left * count_left + area_right * count_right;
+				float cost_left = BoundingBox3f::merge(bbox_left, ref.bbox).getSurfaceArea() * count_left +
+					area_right * (count_right - 1);
+				float cost_right = area_left * (count_left - 1) +
+					BoundingBox3f::merge(bbox_right, ref.bbox).getSurfaceArea() * count_right;
+
+				if (cost_left < cost_split && cost_left <= cost_right) {
+					left.push_back(ref);
+					bbox_left.expandBy(ref.bbox);
+					count_right--;
+				}
+				else if (cost_right < cost_split) {
+					right.push_back(ref);
+					bbox_right.expandBy(ref.bbox);
+					count_left--;
+				}
+				else {
+					left.push_back(ref_left);
+					right.push_back(ref_right);
+				}
+			}
+
+			/* Return what unsplitting saved to the budget */
+			n_UINT used = (n_UINT) (left.size() + right.size()) - size;
+			if (used < reserved)
+				duplicates.fetch_sub(reserved - used);
+			spatialSplits++;
+		}
+		else {
+			axis = object.axis;
+			for (const Reference &ref : refs) {
+				int index = binIndex(ref.bbox.getCenter()[axis], object.min, object.inv_bin_size);
+				(index <= object.index ? left : right).push_back(ref);
+			}
+		}
+
+		if (left.empty() || right.empty()) {
+			/* Degenerate partition (e.g. due to rounding), fall back to a leaf */
+			makeLeaf(node, left.empty() ? right : left);
+			return;
+		}
+
+		/* Release the references of this node before descending */
+		std::vector<Reference>().swap(refs);
+
+		n_UINT node_idx_left = (n_UINT) (nodes.grow_by(2) - nodes.begin());
+		n_UINT node_idx_right = node_idx_left + 1;
+		node.leaf = false;
+		node.axis = axis;
+		node.left = node_idx_left;
+
+		BoundingBox3f bbox_left = bounds(left), bbox_right = bounds(right);
+		if (left.size() + right.size() > PARALLEL_THRESHOLD) {
+			tbb::parallel_invoke(
+				[&] { split(node_idx_left, left, bbox_left); },
+				[&] { split(node_idx_right, right, bbox_right); }
+			);
+		}
+		else {
+			split(node_idx_left, left, bbox_left);
+			split(node_idx_right, right, bbox_right);
+		}
+	}
+
+	BVH &bvh;
+	tbb::concurrent_vector<BuildNode> nodes;
+	n_UINT budget;                          ///< Maximal number of duplicated references
+	float rootArea = 0.f;                   ///< Surface area of the scene
+	std::atomic<n_UINT> duplicates { 0 };   ///< Duplicated references so far
+	std::atomic<n_UINT> leafOffset { 0 };   ///< Next free entry of \c bvh.m_indices
+	std::atomic<n_UINT> spatialSplits { 0 };
+};
+
+/**
+ * \brief Post-build optimization of a binary BVH by treelet restructuring
+ *
+ * Follows "Fast Parallel Construction of High-Quality Bounding Volume
+ * Hierarchies" by Karras and Aila (HPG 2013). Proceeding bottom-up, every
+ * inner node is grown into a treelet of up to \ref TREELET_SIZE subtrees
+ * by repeatedly opening the one with the largest surface area. Dynamic
+ * programming over all subsets of these subtrees then finds the binary
+ * tree above them with the lowest SAH cost, which replaces the treelet if
+ * it is cheaper. Siblings are processed in parallel.
+ *
+ * The tree is restructured in a pool of explicitly linked nodes and then
+ * written back to \c bvh.m_nodes in the usual depth-first layout.
+ */
+class TreeletOptimizer {
+public:
+	/// Build-related parameters
+	enum {
+		/// Number of subtrees below a treelet
+		TREELET_SIZE = 7,
+
+		/// Maximal number of passes over the tree
+		MAX_PASSES = 3
+	};
+
+	TreeletOptimizer(BVH &bvh) : bvh(bvh) { }
+
+	/// Optimize \c bvh.m_nodes, return the SAH cost before and after
+	std::pair<float, float> optimize() {
+		n_UINT count = (n_UINT) bvh.m_nodes.size();
+		nodes.resize(count);
+		tbb::parallel_for(tbb::blocked_range<n_UINT>(0u, count, BVHBuildTask::GRAIN_SIZE),
+			[&](const tbb::blocked_range<n_UINT> &range) {
+			for (n_UINT i = range.begin(); i != range.end(); ++i) {
+				const BVH::BVHNode &node = bvh.m_nodes[i];
+				Node &opt = nodes[i];
+				opt.bbox = node.bbox;
+				opt.axis = node.isInner() ? (int) node.inner.axis : 0;
+				opt.leaf = node.isLeaf();
+				if (opt.leaf) {
+					opt.left = opt.right = 0;
+					opt.start = node.leaf.start;
+					opt.size = node.leaf.size;
+				} else {
+					opt.left = i + 1;
+					opt.right = node.inner.rightChild;
+				}
+			}
+		});
+		computeCosts(0u);
+
+		float rootArea = nodes[0].bbox.getSurfaceArea();
+		float initial = nodes[0].cost / rootArea;
+		for (int pass = 0; pass < MAX_PASSES; ++pass) {
+			float cost = nodes[0].cost;
+			restructure(0u);
+			/* Stop once a pass gains less than 0.1% */
+			if (nodes[0].cost > 0.999f * cost)
+				break;
+		}
+
+		emit(0u, 0u);
+		return std::make_pair(initial, nodes[0].cost / rootArea);
+	}
+
+protected:
+	/// Explicitly linked node, see \ref BVH::BVHNode
+	struct Node {
+		BoundingBox3f bbox;
+		float cost;             ///< SAH cost of the subtree, scaled by the surface area of its root
+		n_UINT count;           ///< Number of nodes in the subtree
+		n_UINT left, right;     ///< Children (inner nodes only)
+		n_UINT start, size;     ///< Range in \c bvh.m_indices (leaves only)
+		int axis;
+		bool leaf;
+	};
+
+	void computeCosts(n_UINT index) {
+		Node &node = nodes[index];
+		if (node.leaf) {
+			node.cost = bvh.m_intersectionCost * node.size * node.bbox.getSurfaceArea();
+			node.count = 1;
+			return;
+		}
+		/* The implicit layout tells the size of the left subtree */
+		if (node.right - index > BVHBuildTask::GRAIN_SIZE) {
+			tbb::parallel_invoke(
+				[&] { computeCosts(node.left); },
+				[&] { computeCosts(node.right); }
+			);
+		}
+		else {
+			computeCosts(node.left);
+			computeCosts(node.right);
+		}
+		update(node);
+	}
+
+	/// Recompute bounds, cost and size of an inner node from its children
+	void update(Node &node) {
+		const Node &left = nodes[node.left], &right = nodes[node.right];
+		node.bbox = BoundingBox3f::merge(left.bbox, right.bbox);
+		node.cost = 2.0f * bvh.m_traversalCost * node.bbox.getSurfaceArea() + left.cost + right.cost;
+		node.count = left.count + right.count + 1;
+	}
+
+	/// Restructure the subtrees of \c index bottom-up, then its own treelet
+	void restructure(n_UINT index) {
+		Node &node = nodes[index];
+		if (node.leaf)
+			return;
+		if (node.count > BVHBuildTask::GRAIN_SIZE) {
+			tbb::parallel_invoke(
+				[&] { restructure(node.left); },
+				[&] { restructure(node.right); }
+			);
+		}
+		else {
+			restructure(node.left);
+			restructure(node.right);
+		}
+		restructureTreelet(index);
+	}
+
+	void restructureTreelet(n_UINT root) {
+		/* Grow the treelet by opening the largest inner subtree */
+		n_UINT leaves[TREELET_SIZE], internal[TREELET_SIZE - 1];
+		int leafCount = 2, internalCount = 1;
+		leaves[0] = nodes[root].left;
+		leaves[1] = nodes[root].right;
+		internal[0] = root;
+		while (leafCount < TREELET_SIZE) {
+			int best = -1;
+			float bestArea = -1.f;
+			for (int i = 0; i < leafCount; ++i) {
+				const Node &node = nodes[leaves[i]];
+				if (!node.leaf && node.bbox.getSurfaceArea() > bestArea) {
+					bestArea = node.bbox.getSurfaceArea();
+					best = i;
+				}
+			}
+			if (best == -1)
+				break;
+			n_UINT opened = leaves[best];
+			internal[internalCount++] = opened;
+			leaves[best] = nodes[opened].left;
+			leaves[leafCount++] = nodes[opened].right;
+		}
+		if (leafCount < 3)
+			return;
+
+		/* Optimal partition of every subset of the treelet's subtrees */
+		const int subsetCount = 1 << leafCount;
+		BoundingBox3f bbox[1 << TREELET_SIZE];
+		float cost[1 << TREELET_SIZE];
+		int partition[1 << TREELET_SIZE];
+		for (int s = 1; s < subsetCount; ++s) {
+			int low = s & -s;
+			if (s == low) {
+				int i = 0;
+				while (!((low >> i) & 1))
+					++i;
+				bbox[s] = nodes[leaves[i]].bbox;
+				cost[s] = nodes[leaves[i]].cost;
+				continue;
+			}
+			bbox[s] = BoundingBox3f::merge(bbox[low], bbox[s ^ low]);
+
+			/* Each partition is enumerated once by keeping the lowest subtree on the left */
+			float best = std::numeric_limits<float>::infinity();
+			int bestPart = low;
+			int rest = s ^ low;
+			for (int p = rest; ; p = (p - 1) & rest) {
+				int left = p | low, right = s ^ left;
+				if (right != 0 && cost[left] + cost[right] < best) {
+					best = cost[left] + cost[right];
+					bestPart = left;
+				}
+				if (p == 0)
+					break;
+			}
+			cost[s] = 2.0f * bvh.m_traversalCost * bbox[s].getSurfaceArea() + best;
+			partition[s] = bestPart;
+		}
+
+		const int full = subsetCount - 1;
+		if (!(cost[full] < nodes[root].cost * 0.9999f))
+			return;
+
+		/* Reuse the inner nodes of the treelet for its new topology */
+		int next = 1;
+		assemble(root, full, leaves, internal, next, partition);
+	}
+
+	/// Link \c index as the root of subset \c s of the treelet's subtrees
+	void assemble(n_UINT index, int s, const n_UINT *leaves, const n_UINT *internal, int &next, const int *partition) {
+		n_UINT children[2];
+		int subsets[2] = { partition[s], s ^ partition[s] };
+		for (int k = 0; k < 2; ++k) {
+			int sub = subsets[k];
+			if ((sub & (sub - 1)) == 0) {
+				int i = 0;
+				while (!((sub >> i) & 1))
+					++i;
+				children[k] = leaves[i];
+			}
+			else {
+				children[k] = internal[next++];
+				assemble(children[k], sub, leaves, internal, next, partition);
+			}
+		}
+
+		/* Split along the axis that separates the children best, nearer child first */
+		Node &node = nodes[index];
+		Vector3f delta = nodes[children[1]].bbox.getCenter() - nodes[children[0]].bbox.getCenter();
+		int axis = 0;
+		for (int i = 1; i < 3; ++i) {
+			if (std::abs(delta[i]) > std::abs(delta[axis]))
+				axis = i;
+		}
+		if (delta[axis] < 0)
+			std::swap(children[0], children[1]);
+		node.leaf = false;
+		node.axis = axis;
+		node.left = children[0];
+		node.right = children[1];
+		update(node);
+	}
+
+	/// Write the subtree of \c nodes[index] to \c bvh.m_nodes[node_idx], return the next free node
+	n_UINT emit(n_UINT index, n_UINT node_idx) {
+		const Node &opt = nodes[index];
+		BVH::BVHNode &node = bvh.m_nodes[node_idx];
+		node.bbox = opt.bbox;
+		if (opt.leaf) {
+			node.leaf.flag = 1;
+			node.leaf.start = opt.start;
+			node.leaf.size = opt.size;
+			return node_idx + 1;
+		}
+		n_UINT node_idx_right = emit(opt.left, node_idx + 1);
+		node.inner.flag = 0;
+		node.inner.axis = opt.axis;
+		node.inner.rightChild = node_idx_right;
+		return emit(opt.right, node_idx_right);
+	}
+
+	BVH &bvh;
+	std::vector<Node> nodes;
+};
+
+BVH::BVH(const PropertyList &props, int width, const std::string &builder) {
+	/* Branching factor of the traversed tree (2: binary, 4: collapsed 4-wide tree) */
+	setWidth(props.getInteger("width", width));
+	/* Tree builder: "sah" (best quality), "sbvh" (spatial splits for long, overlapping triangles),
+	   "lbvh" or "hlbvh" (fastest builds, for previews) */
+	setBuilder(props.getString("builder", builder));
+	/* Maximum number of triangles per leaf (Morton builders split down to one triangle packet) */
+	setLeafSize(props.getInteger("leafSize",
+		m_builder == ELBVHBuilder || m_builder == EHLBVHBuilder ? 4 : 1020));
+	/* Number of bins and costs of the surface area heuristic */
+	setBinCount(props.getInteger("binCount", 16));
+	setCosts(props.getFloat("traversalCost", 1.f), props.getFloat("intersectionCost", 1.f));
+	/* With "sbvh": extra references that spatial splits may add, relative to the triangle count */
+	setSplitBudget(props.getFloat("splitBudget", 0.3f));
+	/* "high" restructures the tree after the build for a lower SAH cost, meant for final renders */
+	setQuality(props.getString("quality", "normal"));
+	/* Relative SAH cost increase at which a refit after vertex updates rebuilds a subtree */
+	setRebuildThreshold(props.getFloat("rebuildThreshold", 1.5f));
+	/* Quantize the 4-wide nodes to 8 bits, halving the memory used by the tree */
+	setCompressed(props.getBoolean("compressed", false));
+	/* Report the nodes and leaves visited per closest-hit query after rendering */
+	setStatistics(props.getBoolean("statistics", false));
+}
+
+void BVH::addInstance(Mesh *mesh, const Transform &toWorld) {
+	BVH *&accel = m_prototypes[mesh];
+	if (!accel) {
+		accel = new BVH();
+		accel->addMesh(mesh);
+	}
+
+	InstanceRecord instance;
+	instance.accel = accel;
+	instance.toWorld = toWorld;
+	instance.toLocal = toWorld.inverse();
+	m_instances.push_back(instance);
+}
+
+void BVH::setWidth(int width) {
+	if (width != 2 && width != 4)
+		throw NoriException("BVH::setWidth(): unsupported BVH width %i (expected 2 or 4)", width);
+	m_width = width;
+}
+
+void BVH::setBuilder(const std::string &builder) {
+	if (builder == "sah")
+		m_builder = ESAHBuilder;
+	else if (builder == "lbvh")
+		m_builder = ELBVHBuilder;
+	else if (builder == "hlbvh")
+		m_builder = EHLBVHBuilder;
+	else if (builder == "sbvh")
+		m_builder = ESBVHBuilder;
+	else
+		throw NoriException("BVH::setBuilder(): unknown BVH builder \"%s\" (expected sah, lbvh, hlbvh or sbvh)", builder);
+}
+
+void BVH::setQuality(const std::string &quality) {
+	if (quality == "normal")
+		m_quality = ENormalQuality;
+	else if (quality == "high")
+		m_quality = EHighQuality;
+	else
+		throw NoriException("BVH::setQuality(): unknown BVH quality \"%s\" (expected normal or high)", quality);
+}
+
+void BVH::setLeafSize(int leafSize) {
+	if (leafSize < 1)
+		throw NoriException("BVH::setLeafSize(): the leaf size must be positive (got %i)", leafSize);
+	m_leafSize = leafSize;
+}
+
+void BVH::setBinCount(int binCount) {
+	if (binCount < 2 || binCount > MaxBinCount)
+		throw NoriException("BVH::setBinCount(): unsupported bin count %i (expected 2 to %i)", binCount, (int) MaxBinCount);
+	m_binCount = binCount;
+}
+
+void BVH::setCosts(float traversal, float intersection) {
+	if (!(traversal >= 0.f) || !(intersection > 0.f))
+		throw NoriException("BVH::setCosts(): invalid SAH costs (traversal %f, intersection %f)", traversal, intersection);
+	m_traversalCost = traversal;
+	m_intersectionCost = intersection;
+}
+
+void BVH::setSplitBudget(float budget) {
+	if (!(budget >= 0.f))
+		throw NoriException("BVH::setSplitBudget(): the duplication budget must not be negative (got %f)", budget);
+	m_splitBudget = budget;
+}
+
+void BVH::clear() {
+	Accel::clear();
+	m_nodes.clear();
+	m_nodes4.clear();
+	m_qnodes4.clear();
+	m_indices.clear();
+	m_triangles.clear();
+	for (auto prototype : m_prototypes)
+		delete prototype.second;
+	m_prototypes.clear();
+	m_instances.clear();
+	m_instanceNodes.clear();
+	m_instanceIndices.clear();
+	m_nodeCosts.clear();
+	m_nodes.shrink_to_fit();
+	m_nodes4.shrink_to_fit();
+	m_qnodes4.shrink_to_fit();
+	m_triangles.shrink_to_fit();
+	m_indices.shrink_to_fit();
+}
+
+void BVH::build() {
+	if (m_compressed && m_width != 4)
+		throw NoriException("BVH::build(): compressed nodes require a BVH width of 4");
+
+	if (getPrimitiveCount() > 0) {
+		if (!loadCache()) {
+			buildBVH();
+			if (m_quality == EHighQuality) {
+				Timer timer;
+				std::pair<float, float> cost = TreeletOptimizer(*this).optimize();
+				cout << "Restructured the BVH treelets (took " << timer.elapsedString()
+					<< ", SAH cost = " << cost.second << " instead of " << cost.first << ")." << endl;
+			}
+			saveCache();
+		}
+
+		Timer timer;
+		buildTrianglePackets();
+		cout << "Stored leaf triangles in " << m_triangles.size() << " packets (took "
+			<< timer.elapsedString() << " and "
+			<< memString(sizeof(TrianglePacket) * m_triangles.size()) << ")." << endl;
+
+		if (m_width == 4) {
+			timer.reset();
+			m_nodes4.reserve(m_nodes.size() / 2 + 1);
+			collapse(0u);
+			cout << "Collapsed into " << m_nodes4.size() << " 4-wide nodes (took "
+				<< timer.elapsedString() << " and "
+				<< memString(sizeof(BVH4Node) * m_nodes4.size()) << ")." << endl;
+		}
+
+		if (m_compressed) {
+			timer.reset();
+			size_t fullMemory = sizeof(BVHNode) * m_nodes.size() + sizeof(n_UINT) * m_indices.size() +
+				sizeof(BVH4Node) * m_nodes4.size();
+			if (quantize()) {
+				cout << "Quantized the 4-wide nodes (took " << timer.elapsedString() << " and "
+					<< memString(sizeof(BVH4QNode) * m_qnodes4.size()) << " instead of "
+					<< memString(fullMemory);
+				if (m_statistics) {
+					double fullTime = timeTraversal(m_nodes4), quantizedTime = timeTraversal(m_qnodes4);
+					cout << ", " << TimedRayCount << " random rays took " << timeString(quantizedTime)
+						<< " instead of " << timeString(fullTime);
+				}
+				cout << ")." << endl;
+
+				/* Traversal only needs the quantized nodes and the triangle packets */
+				m_nodes.clear();
+				m_nodes.shrink_to_fit();
+				m_nodes4.clear();
+				m_nodes4.shrink_to_fit();
+				m_indices.clear();
+				m_indices.shrink_to_fit();
+			}
+			else {
+				cerr << "Warning: a BVH leaf is too large for quantized nodes, "
+					"keeping the full precision tree." << endl;
+			}
+		}
+	}
+
+	if (!m_instances.empty())
+		buildInstances();
+
+	/* Only count the queries of the render */
+	resetStatistics();
+}
+
+void BVH::buildInstances() {
+	/* One bottom-level BVH per distinct mesh, in object space */
+	for (auto prototype : m_prototypes) {
+		prototype.second->setWidth(m_width);
+		prototype.second->setCompressed(m_compressed);
+		prototype.second->m_builder = m_builder;
+		prototype.second->m_leafSize = m_leafSize;
+		prototype.second->m_binCount = m_binCount;
+		prototype.second->m_traversalCost = m_traversalCost;
+		prototype.second->m_intersectionCost = m_intersectionCost;
+		prototype.second->m_splitBudget = m_splitBudget;
+		prototype.second->m_quality = m_quality;
+		prototype.second->build();
+	}
+
+	cout << "Constructing the top-level BVH (" << m_instances.size() << " instances of "
+		<< m_prototypes.size() << (m_prototypes.size() == 1 ? " mesh" : " meshes") << ") .. ";
+	cout.flush();
+	Timer timer;
+
+	for (InstanceRecord &instance : m_instances) {
+		const BoundingBox3f &bbox = instance.accel->getBoundingBox();
+		instance.bbox.reset();
+		for (int i = 0; i < 8; ++i)
+			instance.bbox.expandBy(instance.toWorld * bbox.getCorner(i));
+	}
+
+	n_UINT count = (n_UINT) m_instances.size();
+	m_instanceIndices.resize(count);
+	for (n_UINT i = 0; i < count; ++i)
+		m_instanceIndices[i] = i;
+
+	m_instanceNodes.reserve(2 * count);
+	m_instanceNodes.push_back(BVHNode());
+	buildInstanceTree(0u, 0u, count);
+	m_bbox.expandBy(m_instanceNodes[0].bbox);
+
+	size_t instanceMemory = sizeof(BVHNode) * m_instanceNodes.size() +
+		(sizeof(n_UINT) + sizeof(InstanceRecord)) * count;
+	cout << "done (took " << timer.elapsedString() << " and "
+		<< memString(instanceMemory) << ")." << endl;
+}
+
+void BVH::buildInstanceTree(n_UINT node_idx, n_UINT start, n_UINT end) {
+	BoundingBox3f bbox, centroids;
+	for (n_UINT i = start; i < end; ++i) {
+		const BoundingBox3f &instanceBox = m_instances[m_instanceIndices[i]].bbox;
+		bbox.expandBy(instanceBox);
+		centroids.expandBy(instanceBox.getCenter());
+	}
+
+	BVHNode &node = m_instanceNodes[node_idx];
+	node = BVHNode();
+	node.bbox = bbox;
+
+	if (end - start <= 2) {
+		node.leaf.flag = 1;
+		node.leaf.size = end - start;
+		node.leaf.start = start;
+		return;
+	}
+
+	/* Object median split along the largest axis of the centroid bounds */
+	int axis = centroids.getMajorAxis();
+	n_UINT mid = start + (end - start) / 2;
+	std::nth_element(m_instanceIndices.begin() + start, m_instanceIndices.begin() + mid,
+		m_instanceIndices.begin() + end, [&](n_UINT a, n_UINT b) {
+			return m_instances[a].bbox.getCenter()[axis] < m_instances[b].bbox.getCenter()[axis];
+		});
+	node.inner.flag = 0;
+	node.inner.axis = axis;
+
+	/* The left child directly follows its parent */
+	m_instanceNodes.push_back(BVHNode());
+	buildInstanceTree(node_idx + 1, start, mid);
+
+	n_UINT right = (n_UINT) m_instanceNodes.size();
+	m_instanceNodes.push_back(BVHNode());
+	buildInstanceTree(right, mid, end);
+	m_instanceNodes[node_idx].inner.rightChild = right;
+}
+
+/// Names of the builders in log messages, indexed by BVH::EBuilder
+static const char *builderNames[] = { "SAH", "LBVH", "HLBVH", "SBVH" };
+
+void BVH::buildBVH() {
+	n_UINT size = getPrimitiveCount();
+	cout << "Constructing a BVH (" << builderNames[m_builder] << ", " << m_meshes.size()
+		<< (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
+		<< size << " primitives) .. ";
+	cout.flush();
+	Timer timer;
+
+	/* Conservative estimate for the total number of nodes */
+	m_nodes.assign(2 * size, BVHNode());
+	m_nodes[0].bbox = m_bbox;
+	m_indices.resize(size);
+
+	cout << "Size of each node is " << sizeof(BVHNode);
+
+	if ((sizeof(n_UINT) == 4) && (sizeof(BVHNode) != 32))
+		throw NoriException("BVH Node is not packed! Investigate compiler settings.");
+
+	/* With statistics enabled, an SBVH is compared against the
+	   object split tree of the SAH builder, which is built first */
+	bool compareObjectSplits = m_builder == ESBVHBuilder && m_statistics;
+	float objectCost = 0.f;
+	n_UINT spatialSplits = 0;
+	if (m_builder == ESAHBuilder || compareObjectSplits) {
+		for (n_UINT i = 0; i < size; ++i)
+			m_indices[i] = i;
+
+		n_UINT *indices = m_indices.data(), *temp = new n_UINT[size];
+		BVHBuildTask(*this, 0u, indices, indices + size, temp).execute();
+		delete[] temp;
+
+		if (compareObjectSplits)
+			objectCost = statistics().first;
+	}
+	else if (m_builder != ESBVHBuilder) {
+		LBVHBuilder(*this).build(m_builder == EHLBVHBuilder);
+	}
+
+	if (m_builder == ESBVHBuilder) {
+		n_UINT budget = (n_UINT) (m_splitBudget * size);
+		m_indices.resize(size + budget);
+
+		SBVHBuilder builder(*this, budget);
+		builder.build();
+		spatialSplits = builder.getSpatialSplitCount();
+	}
+	std::pair<float, n_UINT> stats = statistics();
+
+	/* The node array was allocated conservatively and now contains
+	   many unused entries -- do a compactification pass. A prefix sum
+	   over the used entries gives the new index of every node. */
+	n_UINT nodeCount = (n_UINT) m_nodes.size();
+	std::vector<n_UINT> remap(nodeCount);
+	tbb::parallel_scan(tbb::blocked_range<n_UINT>(0u, nodeCount, BVHBuildTask::GRAIN_SIZE), 0u,
+		[&](const tbb::blocked_range<n_UINT> &range, n_UINT sum, bool final) {
+			for (n_UINT j = range.begin(); j != range.end(); ++j) {
+				if (final)
+					remap[j] = sum;
+				sum += m_nodes[j].isUnused() ? 0u : 1u;
+			}
+			return sum;
+		},
+		[](n_UINT a, n_UINT b) { return a + b; }
+	);
+	assert(nodeCount == 0 || remap[nodeCount - 1] + (m_nodes[nodeCount - 1].isUnused() ? 0u : 1u) == stats.second);
+
+	std::vector<BVHNode> compactified(stats.second);
+	tbb::parallel_for(tbb::blocked_range<n_UINT>(0u, nodeCount, BVHBuildTask::GRAIN_SIZE),
+		[&](const tbb::blocked_range<n_UINT> &range) {
+			for (n_UINT j = range.begin(); j != range.end(); ++j) {
+				if (m_nodes[j].isUnused())
+					continue;
+				BVHNode &new_node = compactified[remap[j]];
+				new_node = m_nodes[j];
+				if (new_node.isInner())
+					new_node.inner.rightChild = remap[new_node.inner.rightChild];
+			}
+		}
+	);
+	cout << "done (took " << timer.elapsedString() << " and "
+		<< memString(sizeof(BVHNode) * m_nodes.size() + sizeof(n_UINT)*m_indices.size())
+		<< ", SAH cost = " << stats.first;
+	if (m_builder == ESBVHBuilder) {
+		if (compareObjectSplits)
+			cout << " instead of " << objectCost << " with object splits only";
+		cout << ", " << spatialSplits << " spatial splits, " << (m_indices.size() - size)
+			<< " duplicated references";
+	}
+	cout << ")." << endl;
+
+	m_nodes = std::move(compactified);
+}
+
+/// Header of a BVH cache file
+struct BVHCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t nodeSize;
+	uint64_t key;
+	uint64_t nodeCount;
+	uint64_t indexCount;
+};
+
+static const char BVHCacheMagic[8] = { 'N', 'O', 'R', 'I', 'B', 'V', 'H', '\0' };
+
+/// Bump whenever the builder or the node layout changes
+static const uint32_t BVHCacheVersion = 1;
+
+/// 64 bit FNV-1a hash of a block of memory
+static uint64_t fnv1a(const void *data, size_t size, uint64_t hash) {
+	const uint8_t *ptr = (const uint8_t *) data;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ ptr[i]) * 0x100000001b3ull;
+	return hash;
+}
+
+uint64_t BVH::cacheKey() const {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	hash = fnv1a(&BVHCacheVersion, sizeof(BVHCacheVersion), hash);
+	hash = fnv1a(&m_builder, sizeof(m_builder), hash);
+	if (m_builder == ESBVHBuilder)
+		hash = fnv1a(&m_splitBudget, sizeof(m_splitBudget), hash);
+	hash = fnv1a(&m_quality, sizeof(m_quality), hash);
+	hash = fnv1a(&m_leafSize, sizeof(m_leafSize), hash);
+	hash = fnv1a(&m_binCount, sizeof(m_binCount), hash);
+	hash = fnv1a(&m_traversalCost, sizeof(m_traversalCost), hash);
+	hash = fnv1a(&m_intersectionCost, sizeof(m_intersectionCost), hash);
+	for (const Mesh *mesh : m_meshes) {
+		if (mesh->isAnalytic()) {
+			for (n_UINT idx = 0; idx < mesh->getPrimitiveCount(); ++idx) {
+				BoundingBox3f bbox = mesh->getBoundingBox(idx);
+				hash = fnv1a(bbox.min.data(), sizeof(float) * 3, hash);
+				hash = fnv1a(bbox.max.data(), sizeof(float) * 3, hash);
+			}
+			continue;
+		}
+		const MatrixXf &V = mesh->getVertexPositions();
+		const MatrixXu &F = mesh->getIndices();
+		uint64_t sizes[2] = { (uint64_t) V.size(), (uint64_t) F.size() };
+		hash = fnv1a(sizes, sizeof(sizes), hash);
+		hash = fnv1a(V.data(), sizeof(float) * V.size(), hash);
+		hash = fnv1a(F.data(), sizeof(uint32_t) * F.size(), hash);
+	}
+	return hash;
+}
+
+bool BVH::loadCache() {
+	if (m_cacheFile.empty())
+		return false;
+
+	std::ifstream is(m_cacheFile, std::ios::binary);
+	if (!is)
+		return false;
+
+	Timer timer;
+	BVHCacheHeader header;
+	is.read((char *) &header, sizeof(BVHCacheHeader));
+	if (!is || memcmp(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic)) != 0 ||
+		header.version != BVHCacheVersion || header.nodeSize != sizeof(BVHNode) ||
+		header.indexCount < getPrimitiveCount() || header.key != cacheKey()) {
+		cout << "BVH cache \"" << m_cacheFile << "\" is out of date." << endl;
+		return false;
+	}
+
+	m_nodes.resize(header.nodeCount);
+	m_indices.resize(header.indexCount);
+	is.read((char *) m_nodes.data(), sizeof(BVHNode) * m_nodes.size());
+	is.read((char *) m_indices.data(), sizeof(n_UINT) * m_indices.size());
+	if (!is) {
+		cerr << "Warning: BVH cache \"" << m_cacheFile << "\" is truncated." << endl;
+		m_nodes.clear();
+		m_indices.clear();
+		return false;
+	}
+
+	cout << "Loaded BVH from \"" << m_cacheFile << "\" (took " << timer.elapsedString()
+		<< " and " << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(n_UINT) * m_indices.size())
+		<< ")." << endl;
+	return true;
+}
+
+void BVH::saveCache() const {
+	if (m_cacheFile.empty())
+		return;
+
+	BVHCacheHeader header;
+	memcpy(header.magic, BVHCacheMagic, sizeof(BVHCacheMagic));
+	header.version = BVHCacheVersion;
+	header.nodeSize = sizeof(BVHNode);
+	header.key = cacheKey();
+	header.nodeCount = m_nodes.size();
+	header.indexCount = m_indices.size();
+
+	/* Write to a temporary file first, so that an interrupted or concurrent
+	   render never leaves a partially written cache behind */
+	std::string tempFile = tfm::format("%s.%x.tmp", m_cacheFile,
+		(uint64_t) std::chrono::steady_clock::now().time_since_epoch().count());
+	std::ofstream os(tempFile, std::ios::binary | std::ios::trunc);
+	os.write((const char *) &header, sizeof(BVHCacheHeader));
+	os.write((const char *) m_nodes.data(), sizeof(BVHNode) * m_nodes.size());
+	os.write((const char *) m_indices.data(), sizeof(n_UINT) * m_indices.size());
+	os.close();
+
+	/* On Windows, rename() does not replace an existing file */
+	bool written = (bool) os;
+	if (written && std::rename(tempFile.c_str(), m_cacheFile.c_str()) != 0) {
+		std::remove(m_cacheFile.c_str());
+		written = std::rename(tempFile.c_str(), m_cacheFile.c_str()) == 0;
+	}
+	if (!written) {
+		std::remove(tempFile.c_str());
+		cerr << "Warning: could not write the BVH cache \"" << m_cacheFile << "\"!" << endl;
+	}
+}
+
+void BVH::buildTrianglePackets() {
+	m_analytic = std::any_of(m_meshes.begin(), m_meshes.end(),
+		[](const Mesh *mesh) { return mesh->isAnalytic(); });
+
+	/* Assign every leaf a range that starts at a multiple of four */
+	std::vector<n_UINT> leaves;
+	n_UINT padded = 0;
+	for (n_UINT i = 0; i < (n_UINT) m_nodes.size(); ++i) {
+		if (m_nodes[i].isLeaf()) {
+			leaves.push_back(i);
+			padded += (m_nodes[i].leaf.size + 3) & ~3u;
+		}
+	}
+
+	std::vector<n_UINT> indices(padded, (n_UINT) -1);
+	m_triangles.resize(padded / 4);
+
+	std::vector<n_UINT> starts(leaves.size());
+	for (size_t i = 0, offset = 0; i < leaves.size(); ++i) {
+		starts[i] = (n_UINT) offset;
+		offset += (m_nodes[leaves[i]].leaf.size + 3) & ~3u;
+	}
+
+	tbb::parallel_for(size_t(0), leaves.size(), [&](size_t i) {
+		BVHNode &node = m_nodes[leaves[i]];
+		n_UINT start = starts[i], size = node.leaf.size;
+
+		for (n_UINT j = 0; j < ((size + 3) & ~3u); ++j) {
+			TrianglePacket &tri = m_triangles[(start + j) / 4];
+			int lane = (start + j) % 4;
+
+			if (j >= size) {
+				/* Padding: a degenerate triangle that is never hit */
+				for (int axis = 0; axis < 3; ++axis)
+					tri.p0[axis][lane] = tri.e1[axis][lane] = tri.e2[axis][lane] = 0.f;
+				tri.mesh[lane] = tri.prim[lane] = (n_UINT) -1;
+				continue;
+			}
+
+			n_UINT idx = m_indices[node.start() + j];
+			indices[start + j] = idx;
+			n_UINT meshIdx = findMesh(idx);
+
+			const Mesh *mesh = m_meshes[meshIdx];
+			tri.prim[lane] = idx;
+			if (mesh->isAnalytic()) {
+				/* Degenerate for the vectorized test, see intersectAnalytic() */
+				for (int axis = 0; axis < 3; ++axis)
+					tri.p0[axis][lane] = tri.e1[axis][lane] = tri.e2[axis][lane] = 0.f;
+				tri.mesh[lane] = meshIdx | AnalyticLane;
+				continue;
+			}
+
+			const MatrixXf &V = mesh->getVertexPositions();
+			const MatrixXu &F = mesh->getIndices();
+			Point3f p0 = V.col(F(0, idx)), p1 = V.col(F(1, idx)), p2 = V.col(F(2, idx));
+			Vector3f e1 = p1 - p0, e2 = p2 - p0;
+
+			for (int axis = 0; axis < 3; ++axis) {
+				tri.p0[axis][lane] = p0[axis];
+				tri.e1[axis][lane] = e1[axis];
+				tri.e2[axis][lane] = e2[axis];
+			}
+			tri.mesh[lane] = meshIdx;
+		}
+
+		node.leaf.start = start;
+	});
+
+	m_indices = std::move(indices);
+}
+
+void BVH::setRebuildThreshold(float threshold) {
+	if (!(threshold >= 1.f))
+		throw NoriException("BVH::setRebuildThreshold(): the threshold must be at least 1 (got %f)", threshold);
+	m_rebuildThreshold = threshold;
+}
+
+float BVH::sahCosts(n_UINT node_idx, float *costs) const {
+	const BVHNode &node = m_nodes[node_idx];
+	float cost;
+	if (node.isLeaf()) {
+		cost = m_intersectionCost * node.leaf.size;
+	}
+	else {
+		float cost_left, cost_right;
+		if (node.inner.rightChild - node_idx > BVHBuildTask::GRAIN_SIZE) {
+			tbb::parallel_invoke(
+				[&] { cost_left = sahCosts(node_idx + 1u, costs); },
+				[&] { cost_right = sahCosts(node.inner.rightChild, costs); }
+			);
+		}
+		else {
+			cost_left = sahCosts(node_idx + 1u, costs);
+			cost_right = sahCosts(node.inner.rightChild, costs);
+		}
+		cost = 2 * m_traversalCost +
+			(m_nodes[node_idx + 1u].bbox.getSurfaceArea() * cost_left +
+			 m_nodes[node.inner.rightChild].bbox.getSurfaceArea() * cost_right) / node.bbox.getSurfaceArea();
+	}
+	costs[node_idx] = cost;
+	return cost;
+}
+
+void BVH::refitNodes(n_UINT node_idx) {
+	BVHNode &node = m_nodes[node_idx];
+	if (node.isLeaf()) {
+		node.bbox.reset();
+		for (n_UINT i = node.start(); i < node.end(); ++i)
+			node.bbox.expandBy(getBoundingBox(m_indices[i]));
+		return;
+	}
+	if (node.inner.rightChild - node_idx > BVHBuildTask::GRAIN_SIZE) {
+		tbb::parallel_invoke(
+			[&] { refitNodes(node_idx + 1u); },
+			[&] { refitNodes(node.inner.rightChild); }
+		);
+	}
+	else {
+		refitNodes(node_idx + 1u);
+		refitNodes(node.inner.rightChild);
+	}
+	node.bbox = BoundingBox3f::merge(m_nodes[node_idx + 1u].bbox, m_nodes[node.inner.rightChild].bbox);
+}
+
+void BVH::findDegraded(n_UINT node_idx, const float *costs, std::vector<n_UINT> &roots) const {
+	if (costs[node_idx] > m_rebuildThreshold * m_nodeCosts[node_idx]) {
+		roots.push_back(node_idx);
+		return;
+	}
+	const BVHNode &node = m_nodes[node_idx];
+	if (node.isInner()) {
+		findDegraded(node_idx + 1u, costs, roots);
+		findDegraded(node.inner.rightChild, costs, roots);
+	}
+}
+
+/// A subtree rebuilt by \ref BVH::rebuildSubtrees(), in the layout of \ref BVHBuildTask
+struct RebuiltSubtree {
+	std::vector<BVH::BVHNode> nodes;
+	std::vector<n_UINT> indices;
+};
+
+void BVH::rebuildSubtrees(const std::vector<n_UINT> &roots) {
+	std::vector<RebuiltSubtree> subtrees(roots.size());
+	tbb::parallel_for(size_t(0), roots.size(), [&](size_t r) {
+		/* Gather the triangles of the subtree (once, even if spatial splits duplicated them) */
+		std::vector<n_UINT> triangles;
+		std::vector<n_UINT> stack(1, roots[r]);
+		while (!stack.empty()) {
+			n_UINT node_idx = stack.back();
+			const BVHNode &node = m_nodes[node_idx];
+			stack.pop_back();
+			if (node.isLeaf()) {
+				triangles.insert(triangles.end(), m_indices.begin() + node.start(), m_indices.begin() + node.end());
+			} else {
+				stack.push_back(node.inner.rightChild);
+				stack.push_back(node_idx + 1u);
+			}
+		}
+		std::sort(triangles.begin(), triangles.end());
+		triangles.erase(std::unique(triangles.begin(), triangles.end()), triangles.end());
+
+		/* Build with the regular SAH builder in a scratch tree that borrows the meshes */
+		n_UINT size = (n_UINT) triangles.size();
+		BVH scratch;
+		scratch.m_leafSize = m_leafSize;
+		scratch.m_binCount = m_binCount;
+		scratch.m_traversalCost = m_traversalCost;
+		scratch.m_intersectionCost = m_intersectionCost;
+		scratch.m_meshes = m_meshes;
+		scratch.m_meshOffset = m_meshOffset;
+		scratch.m_nodes.assign(2 * size, BVHNode());
+		scratch.m_nodes[0].bbox = m_nodes[roots[r]].bbox;
+		scratch.m_indices = std::move(triangles);
+
+		n_UINT *indices = scratch.m_indices.data(), *temp = new n_UINT[size];
+		BVHBuildTask(scratch, 0u, indices, indices + size, temp).execute();
+		delete[] temp;
+
+		subtrees[r].nodes = std::move(scratch.m_nodes);
+		subtrees[r].indices = std::move(scratch.m_indices);
+		scratch.m_meshes.clear();
+	});
+
+	/* Write the tree again in depth-first order, splicing in the rebuilt subtrees */
+	std::map<n_UINT, const RebuiltSubtree *> rebuilt;
+	for (size_t r = 0; r < roots.size(); ++r)
+		rebuilt[roots[r]] = &subtrees[r];
+
+	std::vector<BVHNode> nodes;
+	std::vector<n_UINT> indices;
+	std::vector<float> costs;
+	std::vector<n_UINT> newRoots;
+	nodes.reserve(m_nodes.size());
+	indices.reserve(m_indices.size());
+	costs.reserve(m_nodes.size());
+
+	std::function<void(const std::vector<BVHNode> &, const n_UINT *, n_UINT, const float *)> emit =
+		[&](const std::vector<BVHNode> &source, const n_UINT *sourceIndices, n_UINT node_idx, const float *sourceCosts) {
+		if (sourceCosts) {
+			auto it = rebuilt.find(node_idx);
+			if (it != rebuilt.end()) {
+				newRoots.push_back((n_UINT) nodes.size());
+				emit(it->second->nodes, it->second->indices.data(), 0u, nullptr);
+				return;
+			}
+		}
+
+		const BVHNode &node = source[node_idx];
+		n_UINT index = (n_UINT) nodes.size();
+		nodes.push_back(node);
+		costs.push_back(sourceCosts ? sourceCosts[node_idx] : 0.f);
+		if (node.isLeaf()) {
+			nodes[index].leaf.start = (n_UINT) indices.size();
+			indices.insert(indices.end(), sourceIndices + node.start(), sourceIndices + node.end());
+			return;
+		}
+		emit(source, sourceIndices, node_idx + 1u, sourceCosts);
+		nodes[index].inner.rightChild = (n_UINT) nodes.size();
+		emit(source, sourceIndices, node.inner.rightChild, sourceCosts);
+	};
+	emit(m_nodes, m_indices.data(), 0u, m_nodeCosts.data());
+
+	m_nodes = std::move(nodes);
+	m_indices = std::move(indices);
+	m_nodeCosts = std::move(costs);
+
+	/* The rebuilt subtrees are the new reference for their quality */
+	for (n_UINT root : newRoots)
+		sahCosts(root, m_nodeCosts.data());
+}
+
+void BVH::updateTrianglePackets() {
+	tbb::parallel_for(size_t(0), m_triangles.size(), [&](size_t i) {
+		TrianglePacket &tri = m_triangles[i];
+		for (int lane = 0; lane < 4; ++lane) {
+			if (tri.mesh[lane] & AnalyticLane)
+				continue;
+			const Mesh *mesh = m_meshes[tri.mesh[lane]];
+			const MatrixXf &V = mesh->getVertexPositions();
+			const MatrixXu &F = mesh->getIndices();
+			n_UINT idx = tri.prim[lane];
+			Point3f p0 = V.col(F(0, idx)), p1 = V.col(F(1, idx)), p2 = V.col(F(2, idx));
+			Vector3f e1 = p1 - p0, e2 = p2 - p0;
+			for (int axis = 0; axis < 3; ++axis) {
+				tri.p0[axis][lane] = p0[axis];
+				tri.e1[axis][lane] = e1[axis];
+				tri.e2[axis][lane] = e2[axis];
+			}
+		}
+	});
+}
+
+void BVH::refit() {
+	if (!m_qnodes4.empty())
+		throw NoriException("BVH::refit(): quantized BVH nodes cannot be refit, disable bvhCompressed");
+
+	Timer timer;
+	m_bbox.reset();
+	for (const Mesh *mesh : m_meshes)
+		m_bbox.expandBy(mesh->getBoundingBox());
+
+	size_t rebuiltCount = 0;
+	if (!m_nodes.empty()) {
+		/* The bounds still describe the last (re)build, which is the quality reference */
+		if (m_nodeCosts.size() != m_nodes.size()) {
+			m_nodeCosts.resize(m_nodes.size());
+			sahCosts(0u, m_nodeCosts.data());
+		}
+
+		refitNodes(0u);
+		std::vector<float> costs(m_nodes.size());
+		sahCosts(0u, costs.data());
+
+		std::vector<n_UINT> roots;
+		findDegraded(0u, costs.data(), roots);
+		rebuiltCount = roots.size();
+
+		if (roots.empty()) {
+			updateTrianglePackets();
+		}
+		else {
+			rebuildSubtrees(roots);
+			buildTrianglePackets();
+		}
+
+		if (m_width == 4) {
+			m_nodes4.clear();
+			collapse(0u);
+		}
+	}
+
+	if (!m_instances.empty())
+		refitInstances();
+
+	cout << "Refit the BVH (took " << timer.elapsedString() << ", rebuilt " << rebuiltCount
+		<< (rebuiltCount == 1 ? " subtree" : " subtrees");
+	if (!m_nodes.empty())
+		cout << ", SAH cost = " << statistics().first;
+	cout << ")." << endl;
+}
+
+void BVH::refitInstances() {
+	for (auto prototype : m_prototypes)
+		prototype.second->refit();
+
+	for (InstanceRecord &instance : m_instances) {
+		const BoundingBox3f &bbox = instance.accel->getBoundingBox();
+		instance.bbox.reset();
+		for (int i = 0; i < 8; ++i)
+			instance.bbox.expandBy(instance.toWorld * bbox.getCorner(i));
+	}
+
+	/* Children follow their parents, so a reverse sweep visits them first */
+	for (n_UINT i = (n_UINT) m_instanceNodes.size(); i-- > 0; ) {
+		BVHNode &node = m_instanceNodes[i];
+		if (node.isLeaf()) {
+			node.bbox.reset();
+			for (n_UINT j = node.start(); j < node.end(); ++j)
+				node.bbox.expandBy(m_instances[m_instanceIndices[j]].bbox);
+		}
+		else {
+			node.bbox = BoundingBox3f::merge(m_instanceNodes[i + 1].bbox, m_instanceNodes[node.inner.rightChild].bbox);
+		}
+	}
+	m_bbox.expandBy(m_instanceNodes[0].bbox);
+}
+
+n_UINT BVH::collapse(n_UINT index) {
+	/* Open up the inner child with the largest surface area
+	   until the node has four children or only leaves are left */
+	n_UINT children[4] = { index }, childCount = 1;
+	while (childCount < 4) {
+		int best = -1;
+		float bestArea = -1.f;
+		for (n_UINT i = 0; i < childCount; ++i) {
+			const BVHNode &node = m_nodes[children[i]];
+			if (node.isInner() && node.bbox.getSurfaceArea() > bestArea) {
+				bestArea = node.bbox.getSurfaceArea();
+				best = (int) i;
+			}
+		}
+		if (best == -1)
+			break;
+		n_UINT node_idx = children[best];
+		children[best] = node_idx + 1;
+		children[childCount++] = m_nodes[node_idx].inner.rightChild;
+	}
+
+	n_UINT wide_idx = (n_UINT) m_nodes4.size();
+	m_nodes4.emplace_back();
+
+	BVH4Node node;
+	for (int i = 0; i < 4; ++i) {
+		/* Unused slots get an empty box, which the slab test always rejects */
+		for (int axis = 0; axis < 3; ++axis) {
+			node.bounds[axis][i] = std::numeric_limits<float>::infinity();
+			node.bounds[axis + 3][i] = -std::numeric_limits<float>::infinity();
+		}
+		node.child[i] = 0;
+		node.count[i] = 0;
+	}
+
+	for (n_UINT i = 0; i < childCount; ++i) {
+		const BVHNode &child = m_nodes[children[i]];
+		for (int axis = 0; axis < 3; ++axis) {
+			node.bounds[axis][i] = child.bbox.min[axis];
+			node.bounds[axis + 3][i] = child.bbox.max[axis];
+		}
+		if (child.isLeaf()) {
+			node.child[i] = child.start();
+			node.count[i] = child.leaf.size;
+		} else {
+			node.child[i] = collapse(children[i]);
+		}
+	}
+
+	m_nodes4[wide_idx] = node;
+	return wide_idx;
+}
+
+/// Largest exponent of a quantization grid whose spacing is still a normal float
+static const int MaxGridExponent = 127, MinGridExponent = -126;
+
+bool BVH::quantize() {
+	for (const BVH4Node &node : m_nodes4) {
+		for (int i = 0; i < 4; ++i) {
+			if ((node.count[i] + 3) / 4 > std::numeric_limits<uint8_t>::max())
+				return false;
+		}
+	}
+
+	m_qnodes4.resize(m_nodes4.size());
+	tbb::parallel_for(size_t(0), m_nodes4.size(), [&](size_t index) {
+		const BVH4Node &node = m_nodes4[index];
+		BVH4QNode &qnode = m_qnodes4[index];
+		memset(&qnode, 0, sizeof(BVH4QNode));
+
+		/* Unused slots keep inverted bounds of infinite extent */
+		bool used[4];
+		for (int i = 0; i < 4; ++i)
+			used[i] = node.bounds[0][i] <= node.bounds[3][i];
+
+		for (int axis = 0; axis < 3; ++axis) {
+			float min = std::numeric_limits<float>::infinity(), max = -min;
+			for (int i = 0; i < 4; ++i) {
+				if (used[i]) {
+					min = std::min(min, node.bounds[axis][i]);
+					max = std::max(max, node.bounds[axis + 3][i]);
+				}
+			}
+
+			/* Smallest power-of-two spacing whose 255 steps cover the node */
+			int exponent = MinGridExponent;
+			if (max > min)
+				exponent = clamp((int) std::ceil(std::log2((max - min) / 255.f)), MinGridExponent, MaxGridExponent);
+			qnode.origin[axis] = min;
+			qnode.exponent[axis] = (int8_t) exponent;
+			while (exponent < MaxGridExponent && min + 255.f * qnode.scale(axis) < max)
+				qnode.exponent[axis] = (int8_t) ++exponent;
+
+			/* Round outwards, then correct for the rounding of the decoded value */
+			float scale = qnode.scale(axis), invScale = 1.f / scale;
+			for (int i = 0; i < 4; ++i) {
+				if (!used[i]) {
+					qnode.bounds[axis][i] = 255;
+					qnode.bounds[axis + 3][i] = 0;
+					continue;
+				}
+				float lower = node.bounds[axis][i], upper = node.bounds[axis + 3][i];
+				int qmin = clamp((int) std::floor((lower - min) * invScale), 0, 255);
+				int qmax = clamp((int) std::ceil((upper - min) * invScale), 0, 255);
+				while (qmin > 0 && min + qmin * scale > lower)
+					--qmin;
+				while (qmax < 255 && min + qmax * scale < upper)
+					++qmax;
+				qnode.bounds[axis][i] = (uint8_t) qmin;
+				qnode.bounds[axis + 3][i] = (uint8_t) qmax;
+			}
+		}
+
+		/* Leaves are already aligned to packets by buildTrianglePackets() */
+		for (int i = 0; i < 4; ++i) {
+			qnode.child[i] = node.child[i];
+			qnode.count[i] = (uint8_t) ((node.count[i] + 3) / 4);
+		}
+	});
+	return true;
+}
+
+template <typename Node>
+double BVH::timeTraversal(const std::vector<Node> &nodes) const {
+	/* Random segments through the scene, the same ones for every call */
+	pcg32 random;
+	Vector3f extents = m_bbox.getExtents();
+	Timer timer;
+	for (int i = 0; i < TimedRayCount; ++i) {
+		Point3f o, p;
+		for (int axis = 0; axis < 3; ++axis) {
+			o[axis] = m_bbox.min[axis] + random.nextFloat() * extents[axis];
+			p[axis] = m_bbox.min[axis] + random.nextFloat() * extents[axis];
+		}
+		Ray3f ray(o, (p - o).normalized());
+		Intersection its;
+		n_UINT f;
+		traverseBVH4(nodes, ray, its, f);
+	}
+	return timer.elapsed();
+}
+
+std::pair<float, n_UINT> BVH::statistics(n_UINT node_idx) const {
+	const BVHNode &node = m_nodes[node_idx];
+	if (node.isLeaf()) {
+		return std::make_pair(m_intersectionCost * node.leaf.size, 1u);
+	}
+	else {
+		/* Subtrees whose left child spans many entries are processed in parallel */
+		std::pair<float, n_UINT> stats_left, stats_right;
+		if (node.inner.rightChild - node_idx > BVHBuildTask::GRAIN_SIZE) {
+			tbb::parallel_invoke(
+				[&] { stats_left = statistics(node_idx + 1u); },
+				[&] { stats_right = statistics(node.inner.rightChild); }
+			);
+		}
+		else {
+			stats_left = statistics(node_idx + 1u);
+			stats_right = statistics(node.inner.rightChild);
+		}
+		float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
+		float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
+		float saCur = node.bbox.getSurfaceArea();
+		float sahCost =
+			2 * m_traversalCost +
+			(saLeft * stats_left.first + saRight * stats_right.first) / saCur;
+		return std::make_pair(
+			sahCost,
+			stats_left.second + stats_right.second + 1u
+		);
+	}
+}
+
+/// Marks hits on the triangles of the tree itself rather than on an instance
+static const n_UINT NoInstance = (n_UINT) -1;
+
+/**
+ * \brief Per-ray constants broadcast to four lanes
+ *
+ * Used by the vectorized slab test of 4-wide nodes and by the
+ * vectorized triangle test of \ref BVH::TrianglePacket.
+ */
+struct SIMDRay {
+	typedef Eigen::Array<float, 4, 1> Array4f;
+
+	int nearX, nearY, nearZ, farX, farY, farZ;
+	Array4f ox, oy, oz, dx, dy, dz, rx, ry, rz;
+
+	SIMDRay() { }
+
+	SIMDRay(const Ray3f &ray) {
+		/* Select the near and far slab of each axis based on the direction sign */
+		nearX = ray.dRcp.x() < 0 ? 3 : 0; farX = 3 - nearX;
+		nearY = ray.dRcp.y() < 0 ? 4 : 1; farY = 5 - nearY;
+		nearZ = ray.dRcp.z() < 0 ? 5 : 2; farZ = 7 - nearZ;
+		ox = Array4f::Constant(ray.o.x()); rx = Array4f::Constant(ray.dRcp.x());
+		oy = Array4f::Constant(ray.o.y()); ry = Array4f::Constant(ray.dRcp.y());
+		oz = Array4f::Constant(ray.o.z()); rz = Array4f::Constant(ray.dRcp.z());
+		dx = Array4f::Constant(ray.d.x());
+		dy = Array4f::Constant(ray.d.y());
+		dz = Array4f::Constant(ray.d.z());
+	}
+
+	/// Test all four children of \c node at once, return a bit mask of hits
+	template <typename Node>
+	int intersect(const Node &node, float mint, float maxt, Array4f &tmin) const {
+		typedef Eigen::Map<const Array4f> ConstMap4f;
+		tmin = ((ConstMap4f(node.bounds[nearX]) - ox) * rx)
+			.max((ConstMap4f(node.bounds[nearY]) - oy) * ry)
+			.max((ConstMap4f(node.bounds[nearZ]) - oz) * rz)
+			.max(Array4f::Constant(mint));
+		Array4f tmax = ((ConstMap4f(node.bounds[farX]) - ox) * rx)
+			.min((ConstMap4f(node.bounds[farY]) - oy) * ry)
+			.min((ConstMap4f(node.bounds[farZ]) - oz) * rz)
+			.min(Array4f::Constant(maxt));
+		int mask = 0;
+		for (int i = 0; i < 4; ++i)
+			mask |= (tmin[i] <= tmax[i]) << i;
+		return mask;
+	}
+
+	/// Test all four children of a quantized node, decoding their bounds first
+	int intersect(const BVH::BVH4QNode &node, float mint, float maxt, Array4f &tmin) const {
+		typedef Eigen::Map<const Eigen::Array<uint8_t, 4, 1>> ConstMap4u8;
+		struct DecodedNode {
+			float bounds[6][4];
+		} decoded;
+		for (int k = 0; k < 6; ++k) {
+			int axis = k % 3;
+			Eigen::Map<Array4f>(decoded.bounds[k]) =
+				ConstMap4u8(node.bounds[k]).cast<float>() * node.scale(axis) + node.origin[axis];
+		}
+		return intersect(decoded, mint, maxt, tmin);
+	}
+
+	/**
+	 * \brief Moeller-Trumbore test against four triangles at once
+	 *
+	 * Returns a bit mask of the lanes hit within <tt>[mint, maxt]</tt>
+	 * and their barycentric coordinates and distances.
+	 */
+	int intersect(const BVH::TrianglePacket &tri, float mint, float maxt,
+			Array4f &u, Array4f &v, Array4f &t) const {
+		typedef Eigen::Map<const Array4f> ConstMap4f;
+		ConstMap4f e1x(tri.e1[0]), e1y(tri.e1[1]), e1z(tri.e1[2]);
+		ConstMap4f e2x(tri.e2[0]), e2y(tri.e2[1]), e2z(tri.e2[2]);
+
+		/* Begin calculating determinant - also used to calculate U parameter */
+		Array4f px = dy * e2z - dz * e2y;
+		Array4f py = dz * e2x - dx * e2z;
+		Array4f pz = dx * e2y - dy * e2x;
+
+		/* If determinant is near zero, ray lies in plane of triangle */
+		Array4f det = e1x * px + e1y * py + e1z * pz;
+		Array4f inv_det = det.inverse();
+
+		/* Calculate distance from v[0] to ray origin */
+		Array4f tx = ox - ConstMap4f(tri.p0[0]);
+		Array4f ty = oy - ConstMap4f(tri.p0[1]);
+		Array4f tz = oz - ConstMap4f(tri.p0[2]);
+
+		/* Calculate U parameter */
+		u = (tx * px + ty * py + tz * pz) * inv_det;
+
+		/* Calculate V parameter */
+		Array4f qx = ty * e1z - tz * e1y;
+		Array4f qy = tz * e1x - tx * e1z;
+		Array4f qz = tx * e1y - ty * e1x;
+		v = (dx * qx + dy * qy + dz * qz) * inv_det;
+
+		/* Compute t */
+		t = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+
+		int mask = 0;
+		for (int i = 0; i < 4; ++i) {
+			bool hit = std::abs(det[i]) >= 1e-8f &&
+				u[i] >= 0.f && u[i] <= 1.f &&
+				v[i] >= 0.f && u[i] + v[i] <= 1.f &&
+				t[i] >= mint && t[i] <= maxt;
+			mask |= hit << i;
+		}
+		return mask;
+	}
+};
+
+bool BVH::intersectLeaf(n_UINT start, n_UINT end, const SIMDRay &ray4,
+		Ray3f &ray, Intersection &its, n_UINT &f) const {
+	bool foundIntersection = false;
+	SIMDRay::Array4f u, v, t;
+
+	for (n_UINT i = start / 4, last = (end + 3) / 4; i < last; ++i) {
+		const TrianglePacket &tri = m_triangles[i];
+		int mask = ray4.intersect(tri, ray.mint, ray.maxt, u, v, t);
+		if (!mask)
+			continue;
+
+		/* Keep the closest of the hit lanes */
+		int best = -1;
+		for (int j = 0; j < 4; ++j) {
+			if ((mask & (1 << j)) && (best < 0 || t[j] < t[best]))
+				best = j;
+		}
+
+		const Mesh *mesh = m_meshes[tri.mesh[best]];
+		foundIntersection = true;
+		ray.maxt = its.t = t[best];
+		its.u = u[best];
+		its.v = v[best];
+		its.mesh = mesh;
+		// ADD THE MEDIUM TOO
+		its.medium = mesh->getMedium();
+		f = tri.prim[best];
+	}
+
+	if (m_analytic)
+		foundIntersection |= intersectAnalytic(start, end, ray, its, f);
+
+	return foundIntersection;
+}
+
+bool BVH::intersectAnalytic(n_UINT start, n_UINT end, Ray3f &ray, Intersection &its, n_UINT &f) const {
+	bool foundIntersection = false;
+	float u, v, t;
+	for (n_UINT i = start; i < end; ++i) {
+		const TrianglePacket &tri = m_triangles[i / 4];
+		n_UINT meshIdx = tri.mesh[i % 4];
+		if (meshIdx == (n_UINT) -1 || !(meshIdx & AnalyticLane))
+			continue;
+
+		const Mesh *mesh = m_meshes[meshIdx & ~AnalyticLane];
+		if (mesh->rayIntersect(tri.prim[i % 4], ray, u, v, t)) {
+			foundIntersection = true;
+			ray.maxt = its.t = t;
+			its.u = u;
+			its.v = v;
+			its.mesh = mesh;
+			its.medium = mesh->getMedium();
+			f = tri.prim[i % 4];
+		}
+	}
+	return foundIntersection;
+}
+
+bool BVH::occludedLeaf(n_UINT start, n_UINT end, const SIMDRay &ray4,
+		const Ray3f &ray) const {
+	SIMDRay::Array4f u, v, t;
+	for (n_UINT i = start / 4, last = (end + 3) / 4; i < last; ++i) {
+		if (ray4.intersect(m_triangles[i], ray.mint, ray.maxt, u, v, t))
+			return true;
+	}
+
+	if (m_analytic) {
+		float u1, v1, t1;
+		for (n_UINT i = start; i < end; ++i) {
+			n_UINT meshIdx = m_triangles[i / 4].mesh[i % 4];
+			if (meshIdx != (n_UINT) -1 && (meshIdx & AnalyticLane) &&
+				m_meshes[meshIdx & ~AnalyticLane]->rayIntersect(m_triangles[i / 4].prim[i % 4], ray, u1, v1, t1))
+				return true;
+		}
+	}
+	return false;
+}
+
+/// Distance at which \c ray enters \c bbox, if it does so within <tt>[ray.mint, ray.maxt]</tt>
+static inline bool boxEntry(const BoundingBox3f &bbox, const Ray3f &ray, float &tnear) {
+	float nearT, farT;
+	if (!bbox.rayIntersect(ray, nearT, farT) || farT < ray.mint || nearT > ray.maxt)
+		return false;
+	tnear = std::max(nearT, ray.mint);
+	return true;
+}
+
+bool BVH::traverseBVH2(Ray3f &ray, Intersection &its, n_UINT &f) const {
+	struct StackEntry {
+		n_UINT index;
+		float tnear;
+	} stack[64];
+	n_UINT node_idx = 0, stack_idx = 0;
+	uint64_t nodes = 0, leaves = 0, triangles = 0, culled = 0;
+	SIMDRay ray4(ray);
+	bool foundIntersection = false;
+
+	float tnear;
+	if (!boxEntry(m_nodes[0].bbox, ray, tnear))
+		return false;
+
+	while (true) {
+		const BVHNode &node = m_nodes[node_idx];
+
+		if (node.isInner()) {
+			/* The child on the side of the split plane facing the ray comes first */
+			n_UINT near_idx = node_idx + 1, far_idx = node.inner.rightChild;
+			if (ray.d[node.inner.axis] < 0)
+				std::swap(near_idx, far_idx);
+
+			float tnearNear, tnearFar;
+			bool hitNear = boxEntry(m_nodes[near_idx].bbox, ray, tnearNear);
+			bool hitFar = boxEntry(m_nodes[far_idx].bbox, ray, tnearFar);
+			++nodes;
+
+			if (hitNear) {
+				if (hitFar) {
+					stack[stack_idx++] = StackEntry { far_idx, tnearFar };
+					assert(stack_idx < 64);
+				}
+				node_idx = near_idx;
+				continue;
+			}
+			if (hitFar) {
+				node_idx = far_idx;
+				continue;
+			}
+		}
+		else {
+			foundIntersection |= intersectLeaf(node.start(), node.end(), ray4, ray, its, f);
+			++leaves;
+			triangles += node.leaf.size;
+		}
+
+		/* Continue with the next subtree that begins before the closest hit */
+		while (stack_idx > 0 && stack[stack_idx - 1].tnear > ray.maxt) {
+			--stack_idx;
+			++culled;
+		}
+		if (stack_idx == 0)
+			break;
+		node_idx = stack[--stack_idx].index;
+	}
+
+	if (m_statistics)
+		recordTraversal(nodes, leaves, triangles, culled);
+	return foundIntersection;
+}
+
+template <typename Node>
+bool BVH::traverseBVH4(const std::vector<Node> &nodes, Ray3f &ray, Intersection &its, n_UINT &f) const {
+	/* Stack entries reference either a wide node or a leaf, together
+	   with the distance at which the ray enters its bounding box */
+	struct StackEntry {
+		n_UINT index;
+		uint32_t count;
+		float tnear;
+	} stack[256];
+	int stack_idx = 0;
+
+	SIMDRay ray4(ray);
+	SIMDRay::Array4f tmin;
+	uint64_t visited = 0, leaves = 0, triangles = 0, culled = 0;
+	bool foundIntersection = false;
+	stack[stack_idx++] = StackEntry { 0u, 0u, ray.mint };
+
+	while (stack_idx > 0) {
+		const StackEntry entry = stack[--stack_idx];
+
+		/* Skip subtrees that begin beyond the closest hit found so far */
+		if (entry.tnear > ray.maxt) {
+			++culled;
+			continue;
+		}
+
+		if (entry.count != 0) {
+			foundIntersection |= intersectLeaf(entry.index, entry.index + entry.count, ray4, ray, its, f);
+			++leaves;
+			triangles += entry.count;
+			continue;
+		}
+
+		/* Test all four children with a single slab test */
+		const Node &node = nodes[entry.index];
+		int mask = ray4.intersect(node, ray.mint, ray.maxt, tmin);
+		++visited;
+
+		/* Sort the hit children by entry distance (farthest first) */
+		int hits[4], hitCount = 0;
+		for (int i = 0; i < 4; ++i) {
+			if (!(mask & (1 << i)))
+				continue;
+			int j = hitCount++;
+			while (j > 0 && tmin[hits[j - 1]] < tmin[i]) {
+				hits[j] = hits[j - 1];
+				--j;
+			}
+			hits[j] = i;
+		}
+
+		/* Push them so that the nearest child is visited first */
+		for (int j = 0; j < hitCount; ++j) {
+			int i = hits[j];
+			stack[stack_idx++] = StackEntry { node.child[i], node.leafSize(i), tmin[i] };
+		}
+		assert(stack_idx < 256);
+	}
+
+	if (m_statistics)
+		recordTraversal(visited, leaves, triangles, culled);
+	return foundIntersection;
+}
+
+bool BVH::occludedBVH2(const Ray3f &ray) const {
+	n_UINT node_idx = 0, stack_idx = 0, stack[64];
+	SIMDRay ray4(ray);
+
+	while (true) {
+		const BVHNode &node = m_nodes[node_idx];
+
+		if (node.bbox.rayIntersect(ray)) {
+			if (node.isInner()) {
+				stack[stack_idx++] = node.inner.rightChild;
+				node_idx++;
+				assert(stack_idx < 64);
+				continue;
+			}
+			if (occludedLeaf(node.start(), node.end(), ray4, ray))
+				return true;
+		}
+
+		if (stack_idx == 0)
+			return false;
+		node_idx = stack[--stack_idx];
+	}
+}
+
+template <typename Node>
+bool BVH::occludedBVH4(const std::vector<Node> &nodes, const Ray3f &ray) const {
+	struct StackEntry {
+		n_UINT index;
+		uint32_t count;
+	} stack[256];
+	int stack_idx = 0;
+
+	SIMDRay ray4(ray);
+	SIMDRay::Array4f tmin;
+	stack[stack_idx++] = StackEntry { 0u, 0u };
+
+	while (stack_idx > 0) {
+		const StackEntry entry = stack[--stack_idx];
+
+		if (entry.count != 0) {
+			if (occludedLeaf(entry.index, entry.index + entry.count, ray4, ray))
+				return true;
+			continue;
+		}
+
+		/* Push every hit child, there is no need to order them */
+		const Node &node = nodes[entry.index];
+		int mask = ray4.intersect(node, ray.mint, ray.maxt, tmin);
+		for (int i = 0; i < 4; ++i) {
+			if (mask & (1 << i))
+				stack[stack_idx++] = StackEntry { node.child[i], node.leafSize(i) };
+		}
+		assert(stack_idx < 256);
+	}
+
+	return false;
+}
+
+bool BVH::traverse(Ray3f &ray, Intersection &its, n_UINT &f) const {
+	if (!m_qnodes4.empty())
+		return traverseBVH4(m_qnodes4, ray, its, f);
+	if (m_nodes.empty())
+		return false;
+	return m_nodes4.empty() ? traverseBVH2(ray, its, f) : traverseBVH4(m_nodes4, ray, its, f);
+}
+
+bool BVH::occluded(const Ray3f &ray) const {
+	if (!m_qnodes4.empty())
+		return occludedBVH4(m_qnodes4, ray);
+	if (m_nodes.empty())
+		return false;
+	return m_nodes4.empty() ? occludedBVH2(ray) : occludedBVH4(m_nodes4, ray);
+}
+
+bool BVH::traverseInstances(Ray3f &ray, Intersection &its, n_UINT &f, n_UINT &instance) const {
+	n_UINT node_idx = 0, stack_idx = 0, stack[64];
+	bool foundIntersection = false;
+
+	while (true) {
+		const BVHNode &node = m_instanceNodes[node_idx];
+
+		if (!node.bbox.rayIntersect(ray)) {
+			if (stack_idx == 0)
+				break;
+			node_idx = stack[--stack_idx];
+			continue;
+		}
+
+		if (node.isInner()) {
+			stack[stack_idx++] = node.inner.rightChild;
+			node_idx++;
+			assert(stack_idx < 64);
+		}
+		else {
+			for (n_UINT i = node.start(); i < node.end(); ++i) {
+				const InstanceRecord &record = m_instances[m_instanceIndices[i]];
+
+				/* The direction is not renormalized, so distances along the
+				   object space ray are the same as in world space */
+				Ray3f localRay = record.toLocal * ray;
+				if (record.accel->traverse(localRay, its, f)) {
+					ray.maxt = localRay.maxt;
+					instance = m_instanceIndices[i];
+					foundIntersection = true;
+				}
+			}
+			if (stack_idx == 0)
+				break;
+			node_idx = stack[--stack_idx];
+			continue;
+		}
+	}
+
+	return foundIntersection;
+}
+
+bool BVH::occludedInstances(const Ray3f &ray) const {
+	n_UINT node_idx = 0, stack_idx = 0, stack[64];
+
+	while (true) {
+		const BVHNode &node = m_instanceNodes[node_idx];
+
+		if (node.bbox.rayIntersect(ray)) {
+			if (node.isInner()) {
+				stack[stack_idx++] = node.inner.rightChild;
+				node_idx++;
+				assert(stack_idx < 64);
+				continue;
+			}
+			for (n_UINT i = node.start(); i < node.end(); ++i) {
+				const InstanceRecord &record = m_instances[m_instanceIndices[i]];
+				if (record.accel->occluded(record.toLocal * ray))
+					return true;
+			}
+		}
+
+		if (stack_idx == 0)
+			return false;
+		node_idx = stack[--stack_idx];
+	}
+}
+
+void BVH::setHit(n_UINT instance, n_UINT f, Intersection &its) const {
+	its.prim = f;
+	its.instance = instance == NoInstance ? nullptr : &m_instances[instance].toWorld;
+}
+
+bool BVH::rayOccluded(const Ray3f &_ray) const {
+	Ray3f ray(_ray);
+	adaptEpsilon(ray);
+
+	if (ray.maxt < ray.mint)
+		return false;
+
+	return occluded(ray) || (!m_instances.empty() && occludedInstances(ray));
+}
+
+bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
+	if (shadowRay)
+		return rayOccluded(_ray);
+
+	its.t = std::numeric_limits<float>::infinity();
+
+	Ray3f ray(_ray);
+	adaptEpsilon(ray);
+
+	if (ray.maxt < ray.mint)
+		return false;
+
+	n_UINT f = 0, instance = NoInstance;
+	bool foundIntersection = traverse(ray, its, f);
+	if (!m_instances.empty())
+		foundIntersection |= traverseInstances(ray, its, f, instance);
+
+	if (foundIntersection)
+		setHit(instance, f, its);
+
+	return foundIntersection;
+}
+
+/// Bounds of the product of the intervals <tt>[a0, a1]</tt> and <tt>[b0, b1]</tt>
+static inline void intervalMul(float a0, float a1, float b0, float b1, float &lo, float &hi) {
+	float p0 = a0 * b0, p1 = a0 * b1, p2 = a1 * b0, p3 = a1 * b1;
+	lo = std::min(std::min(p0, p1), std::min(p2, p3));
+	hi = std::max(std::max(p0, p1), std::max(p2, p3));
+}
+
+/**
+ * \brief Conservative bounds of a packet of rays sharing direction signs
+ *
+ * Stores intervals of the origins and reciprocal directions of all rays.
+ * Evaluating the slab test with interval arithmetic yields a segment that
+ * contains the entry/exit distances of every ray of the packet, so a box
+ * missed by it is missed by all of them.
+ */
+struct PacketBounds {
+	Vector3f oMin, oMax, rMin, rMax;
+	float mint, maxt;
+	bool negative[3];
+
+	bool intersect(const BoundingBox3f &bbox) const {
+		float nearT;
+		return intersect(bbox, nearT);
+	}
+
+	/// Also return a lower bound of the distance at which the rays enter \c bbox
+	bool intersect(const BoundingBox3f &bbox, float &nearT) const {
+		float farT = maxt;
+		nearT = mint;
+		for (int axis = 0; axis < 3; ++axis) {
+			float lo0, hi0, lo1, hi1;
+			intervalMul(bbox.min[axis] - oMax[axis], bbox.min[axis] - oMin[axis],
+				rMin[axis], rMax[axis], lo0, hi0);
+			intervalMul(bbox.max[axis] - oMax[axis], bbox.max[axis] - oMin[axis],
+				rMin[axis], rMax[axis], lo1, hi1);
+			if (negative[axis]) {
+				nearT = std::max(nearT, lo1);
+				farT = std::min(farT, hi0);
+			}
+			else {
+				nearT = std::max(nearT, lo0);
+				farT = std::min(farT, hi1);
+			}
+		}
+		return nearT <= farT;
+	}
+};
+
+/**
+ * \brief Traversal statistics of a packet, see \ref Accel::recordTraversal()
+ *
+ * Nodes are tested and subtrees culled for the packet as a whole, so these
+ * counts are charged to each of its rays. Leaves and triangles are only
+ * counted for the rays that actually enter the leaf.
+ */
+struct PacketStatistics {
+	uint64_t nodes = 0, culled = 0;
+	uint64_t leaves[NORI_PACKET_SIZE] = { }, triangles[NORI_PACKET_SIZE] = { };
+};
+
+void BVH::packetBVH2(const PacketBounds &_bounds, Ray3f *rays, const SIMDRay *rays4,
+		Intersection *its, n_UINT *prims, bool *found, int count, PacketStatistics &stats) const {
+	n_UINT node_idx = 0, stack_idx = 0, stack[64];
+	PacketBounds bounds(_bounds);
+
+	while (true) {
+		const BVHNode &node = m_nodes[node_idx];
+
+		if (!bounds.intersect(node.bbox)) {
+			if (stack_idx == 0)
+				break;
+			node_idx = stack[--stack_idx];
+			continue;
+		}
+
+		if (node.isInner()) {
+			++stats.nodes;
+
+			/* Visit the child on the side the packet is travelling from first */
+			if (bounds.negative[node.inner.axis]) {
+				stack[stack_idx++] = node_idx + 1;
+				node_idx = node.inner.rightChild;
+			}
+			else {
+				stack[stack_idx++] = node.inner.rightChild;
+				node_idx++;
+			}
+			assert(stack_idx < 64);
+		}
+		else {
+			bounds.maxt = -std::numeric_limits<float>::infinity();
+			for (int i = 0; i < count; ++i) {
+				Ray3f &ray = rays[i];
+				if (ray.maxt < ray.mint)
+					continue;
+				if (node.bbox.rayIntersect(ray)) {
+					found[i] |= intersectLeaf(node.start(), node.end(), rays4[i], ray, its[i], prims[i]);
+					++stats.leaves[i];
+					stats.triangles[i] += node.leaf.size;
+				}
+				bounds.maxt = std::max(bounds.maxt, ray.maxt);
+			}
+			if (stack_idx == 0)
+				break;
+			node_idx = stack[--stack_idx];
+		}
+	}
+}
+
+template <typename Node>
+void BVH::packetBVH4(const std::vector<Node> &nodes, const PacketBounds &_bounds, Ray3f *rays,
+		const SIMDRay *rays4, Intersection *its, n_UINT *prims, bool *found, int count,
+		PacketStatistics &stats) const {
+	/* Leaves carry their decoded bounds, so that rays missing them skip the triangles */
+	struct StackEntry {
+		n_UINT index;
+		uint32_t count;
+		float tnear;
+		BoundingBox3f bbox;
+	} stack[256];
+	int stack_idx = 0;
+
+	PacketBounds bounds(_bounds);
+	stack[stack_idx++] = StackEntry { 0u, 0u, bounds.mint, m_bbox };
+
+	while (stack_idx > 0) {
+		const StackEntry entry = stack[--stack_idx];
+
+		/* Skip subtrees that begin beyond the closest hit of every ray */
+		if (entry.tnear > bounds.maxt) {
+			++stats.culled;
+			continue;
+		}
+
+		if (entry.count != 0) {
+			bounds.maxt = -std::numeric_limits<float>::infinity();
+			for (int i = 0; i < count; ++i) {
+				Ray3f &ray = rays[i];
+				if (ray.maxt < ray.mint)
+					continue;
+				if (entry.bbox.rayIntersect(ray)) {
+					found[i] |= intersectLeaf(entry.index, entry.index + entry.count, rays4[i], ray, its[i], prims[i]);
+					++stats.leaves[i];
+					stats.triangles[i] += entry.count;
+				}
+				bounds.maxt = std::max(bounds.maxt, ray.maxt);
+			}
+			continue;
+		}
+
+		/* Cull the children against the whole packet */
+		const Node &node = nodes[entry.index];
+		++stats.nodes;
+		BoundingBox3f childBounds[4];
+		float tnear[4];
+		int hits[4], hitCount = 0;
+		for (int i = 0; i < 4; ++i) {
+			childBounds[i] = node.getChildBounds(i);
+			if (!childBounds[i].isValid() || !bounds.intersect(childBounds[i], tnear[i]))
+				continue;
+			int j = hitCount++;
+			while (j > 0 && tnear[hits[j - 1]] < tnear[i]) {
+				hits[j] = hits[j - 1];
+				--j;
+			}
+			hits[j] = i;
+		}
+
+		/* Push them so that the nearest child is visited first */
+		for (int j = 0; j < hitCount; ++j) {
+			int i = hits[j];
+			stack[stack_idx++] = StackEntry { node.child[i], node.leafSize(i), tnear[i], childBounds[i] };
+		}
+		assert(stack_idx < 256);
+	}
+}
+
+void BVH::rayIntersectPacket(const Ray3f *_rays, Intersection *its, int count) const {
+	assert(count <= NORI_PACKET_SIZE);
+
+	Ray3f rays[NORI_PACKET_SIZE];
+	SIMDRay rays4[NORI_PACKET_SIZE];
+	n_UINT prims[NORI_PACKET_SIZE];
+	bool found[NORI_PACKET_SIZE], active[NORI_PACKET_SIZE];
+
+	const float inf = std::numeric_limits<float>::infinity();
+	PacketBounds bounds;
+	bounds.oMin = bounds.rMin = Vector3f::Constant(inf);
+	bounds.oMax = bounds.rMax = Vector3f::Constant(-inf);
+	bounds.mint = inf; bounds.maxt = -inf;
+	bool coherent = true;
+
+	for (int i = 0; i < count; ++i) {
+		its[i].t = inf;
+		its[i].mesh = nullptr;
+		its[i].medium = nullptr;
+		found[i] = false;
+
+		Ray3f &ray = rays[i];
+		ray = _rays[i];
+		adaptEpsilon(ray);
+		active[i] = ray.maxt >= ray.mint;
+		if (!active[i])
+			continue;
+
+		rays4[i] = SIMDRay(ray);
+		bounds.oMin = bounds.oMin.cwiseMin(ray.o);
+		bounds.oMax = bounds.oMax.cwiseMax(ray.o);
+		bounds.rMin = bounds.rMin.cwiseMin(ray.dRcp);
+		bounds.rMax = bounds.rMax.cwiseMax(ray.dRcp);
+		bounds.mint = std::min(bounds.mint, ray.mint);
+		bounds.maxt = std::max(bounds.maxt, ray.maxt);
+	}
+
+	if (bounds.mint > bounds.maxt)
+		return;
+
+	/* Interval arithmetic needs finite reciprocals of equal sign per axis */
+	for (int axis = 0; axis < 3; ++axis) {
+		coherent &= std::isfinite(bounds.rMin[axis]) && std::isfinite(bounds.rMax[axis]) &&
+			(bounds.rMin[axis] > 0 || bounds.rMax[axis] < 0);
+		bounds.negative[axis] = bounds.rMax[axis] < 0;
+	}
+
+	if (!coherent) {
+		for (int i = 0; i < count; ++i) {
+			if (!rayIntersect(_rays[i], its[i]))
+				its[i].mesh = nullptr;
+		}
+		return;
+	}
+
+	/* The packet only walks the tree over the triangles (the same one as
+	   single rays, see traverse()); instances follow ray by ray */
+	PacketStatistics stats;
+	if (!m_qnodes4.empty())
+		packetBVH4(m_qnodes4, bounds, rays, rays4, its, prims, found, count, stats);
+	else if (!m_nodes4.empty())
+		packetBVH4(m_nodes4, bounds, rays, rays4, its, prims, found, count, stats);
+	else if (!m_nodes.empty())
+		packetBVH2(bounds, rays, rays4, its, prims, found, count, stats);
+
+	if (m_statistics) {
+		for (int i = 0; i < count; ++i) {
+			if (active[i])
+				recordTraversal(stats.nodes, stats.leaves[i], stats.triangles[i], stats.culled);
+		}
+	}
+
+	n_UINT instances[NORI_PACKET_SIZE];
+	for (int i = 0; i < count; ++i) {
+		instances[i] = NoInstance;
+		if (!m_instances.empty() && rays[i].maxt >= rays[i].mint)
+			found[i] |= traverseInstances(rays[i], its[i], prims[i], instances[i]);
+		if (found[i])
+			setHit(instances[i], prims[i], its[i]);
+	}
+}
+
+std::string BVH::toString() const {
+	return tfm::format(
+		"BVH[\n"
+		"  width = %i,\n"
+		"  builder = %s,\n"
+		"  leafSize = %i,\n"
+		"  binCount = %i,\n"
+		"  traversalCost = %f,\n"
+		"  intersectionCost = %f,\n"
+		"  quality = %s,\n"
+		"  compressed = %s\n"
+		"]",
+		m_width, builderNames[m_builder], m_leafSize, m_binCount, m_traversalCost,
+		m_intersectionCost, m_quality == EHighQuality ? "high" : "normal",
+		m_compressed ? "true" : "false"
+	);
+}
+
+/* The registered variants only differ in the defaults of the width and the builder */
+static struct BVHVariants_ {
+	BVHVariants_() {
+		NoriObjectFactory::registerClass("bvh2", [](const PropertyList &list) -> NoriObject * {
+			return new BVH(list, 2, "sah");
+		});
+		NoriObjectFactory::registerClass("bvh4", [](const PropertyList &list) -> NoriObject * {
+			return new BVH(list, 4, "sah");
+		});
+		NoriObjectFactory::registerClass("lbvh", [](const PropertyList &list) -> NoriObject * {
+			return new BVH(list, 4, "lbvh");
+		});
+	}
+} BVHVariants__NORI_;
+
+NORI_NAMESPACE_END
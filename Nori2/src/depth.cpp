@@ -11,14 +11,13 @@ class DepthIntegrator : public Integrator {
     /* No parameters this time */
     }
 
-    Color3f Li(const Scene* scene , Sampler* sampler , const Ray3f& ray) const {
-        // Find the surface that is visible in the requested direction
-        Intersection its;
-        if (!scene->rayIntersect(ray, its))     // if the ray does not intersect, 
+    Color3f Li(const Scene* scene , Sampler* sampler , const Ray3f& ray, const Intersection& its) const {
+        // its holds the surface that is visible in the requested direction
+        if (!its.mesh)                          // if the ray does not intersect, 
             return scene->getBackground(ray);   // return the color of the background
-        EmitterQueryRecord emitterRecord(its.p);
-        // Calculate the distance from the camera to the intersection point
-        float dist = (its.p - ray.o).norm();
+        // Calculate the distance from the camera to the intersection point,
+        // the hit distance is enough so the surface is not reconstructed
+        float dist = its.t * ray.d.norm();
         // Transform that distance into a color of value 1/dist
         return Color3f(1.f/dist);
     }
@@ -90,6 +90,10 @@ public:
         return true;
     }
 
+    Color3f getAlbedo(const Point2f &uv) const {
+        return m_albedo->eval(uv);
+    }
+
     /// Return a human-readable summary
     std::string toString() const {
         return tfm::format(
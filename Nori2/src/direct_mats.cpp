@@ -12,7 +12,7 @@ public:
 		/* No parameters this time */
 	}
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its1) const {
         // this integrator casts a ray to the scene and uses brdf sampling to compute the direct illumination
         // the estimate computed by this integrator corresponds to: 
         // Lo(x,ωo) ≈ Le(x,ωo) + (1/N)∑((Le(r(x,ω(k)i),−ω(k)i) fr(x,ωo,ω(k)i) cosθ(k)i) / pΩ(ω(k)i))
@@ -21,15 +21,15 @@ public:
             First ray
         */
         // check if the ray intersects with anything at all
-        Intersection its1;
-        if (!scene->rayIntersect(ray, its1)) {
+        if (!its1.mesh) {
             return scene->getBackground(ray);    // if it doesn't intersect, return the background color (end of the path)
         }
+        SurfaceInteraction si1 = its1.computeSurfaceInteraction();
         if (its1.mesh->isEmitter()) {   // if it intersects with an emitter, return the radiance of the emitter (end of the path)
-            EmitterQueryRecord emitterQR(its1.p);
+            EmitterQueryRecord emitterQR(si1.p);
             emitterQR.ref = ray.o;
 			emitterQR.wi = ray.d;
-			emitterQR.n = its1.shFrame.n;
+			emitterQR.n = si1.shFrame.n;
             return its1.mesh->getEmitter()->eval(emitterQR);
         }
         /*
@@ -37,14 +37,14 @@ public:
         */
         // sample the brdf
         Point2f sample = sampler->next2D();
-        BSDFQueryRecord bsdfQR(its1.toLocal(-ray.d), sample);
+        BSDFQueryRecord bsdfQR(si1.toLocal(-ray.d), sample);
         Color3f brdfSample = its1.mesh->getBSDF()->sample(bsdfQR, sample);
         // check if the brdf sample is valid (absorbed or invalid samples are not valid)
         if (brdfSample.isZero() || brdfSample.hasNaN()) {   // if it is not valid, return black
             return Color3f(0.0f);
         }
         // now create a new ray with the sampled direction
-        Ray3f ray2(its1.p, its1.toWorld(bsdfQR.wo));
+        Ray3f ray2(si1.p, si1.toWorld(bsdfQR.wo));
         // check if the ray intersects with anything at all
         Intersection its2;
         if (!scene->rayIntersect(ray2, its2)) {
@@ -58,17 +58,18 @@ public:
         // if the ray intersects with an emitter, we will add the radiance of the emitter
         // to the radiance we will return
         if (its2.mesh->isEmitter()) {
-            EmitterQueryRecord emitterQR(its2.p);
+            SurfaceInteraction si2 = its2.computeSurfaceInteraction();
+            EmitterQueryRecord emitterQR(si2.p);
             emitterQR.ref = ray2.o;
 			emitterQR.wi = ray2.d;
-			emitterQR.n = its2.shFrame.n;
+			emitterQR.n = si2.shFrame.n;
             // calculate the radiance of the emitter to compute the contribution to the returned radiance
             Color3f Le = its2.mesh->getEmitter()->eval(emitterQR);
             // calculate the cosine foreshortening factor (this is the cosine of the angle between the normal and the ray direction)
             // if the ray direction is in the same direction as the normal, the cosine foreshortening factor will be 1
             // and therefore the contribution will be maximum
-            // float cosForeshortening = std::abs(its2.shFrame.n.dot(ray2.d)); // this is the same as the commented line below, since vectors are normalized
-            // float cosForeshortening = std::abs(Frame::cosTheta(its2.toLocal(-ray2.d)));
+            // float cosForeshortening = std::abs(si2.shFrame.n.dot(ray2.d)); // this is the same as the commented line below, since vectors are normalized
+            // float cosForeshortening = std::abs(Frame::cosTheta(si2.toLocal(-ray2.d)));
             // add the contribution to the returned radiance
             Lo = Le * brdfSample;// * cosForeshortening;
             // NOTE: okay no cosine since we're already taking that into account in the brdf (i think????)
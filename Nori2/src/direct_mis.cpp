@@ -12,7 +12,8 @@ public:
 		/* No parameters this time */
 	}
 
-    Color3f emitterSampling(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its) const {
+    Color3f emitterSampling(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its,
+            const SurfaceInteraction& si) const {
         /*
         Light importance sampling
         */
@@ -21,23 +22,18 @@ public:
         float p_em_em = 0.f, p_mat_em = 0.f;
         // randomly choose an emitter
         float pdflight;	// this is the probability density of choosing an emitter
-        EmitterQueryRecord emitterQR(its.p);	// add intersection point to emitterRecord
+        EmitterQueryRecord emitterQR(si.p);	// add intersection point to emitterRecord
 		const Emitter* em = scene->sampleEmitter(sampler->next1D(), pdflight);
         // get the radiance of said emitter
         Color3f Lem_ls = em->sample(emitterQR, sampler->next2D(), 0.f);
-        // create a shadow ray to see if the point is in shadow
-        Ray3f shadowRay(its.p, emitterQR.wi);
-        shadowRay.maxt = (emitterQR.p - its.p).norm();
-        // check if the ray intersects with an emitter or if the first intersection in shadows
-        Intersection its_ls;
-        bool inShadow = scene->rayIntersect(shadowRay, its_ls);
-        if (!inShadow || its_ls.t >= (emitterQR.dist - Epsilon)){
-            BSDFQueryRecord bsdfQR(its.toLocal(-ray.d), its.toLocal(emitterQR.wi), its.uv, ESolidAngle);
+        // check if the point is in shadow (anything between it and the sampled emitter point)
+        if (scene->isVisible(em, emitterQR)){
+            BSDFQueryRecord bsdfQR(si.toLocal(-ray.d), si.toLocal(emitterQR.wi), si.uv, ESolidAngle);
             float denominator = pdflight * emitterQR.pdf;
             if (denominator > Epsilon){	// to avoid division by 0 (resulting in NaNs and anoying warnings)
                 emitterQR.dist = its.t;
 				Color3f bsdf = its.mesh->getBSDF()->eval(bsdfQR);
-                Les = (Lem_ls * its.shFrame.n.dot(emitterQR.wi) * bsdf) / denominator;
+                Les = (Lem_ls * si.shFrame.n.dot(emitterQR.wi) * bsdf) / denominator;
 			}
             p_mat_em = its.mesh->getBSDF()->pdf(bsdfQR);    //BRDF pdf for emitter sampling
             p_em_em = denominator;  // its the same as pdflight * emitterQR.pdf
@@ -49,18 +45,19 @@ public:
         return Les * w_ems;
     }
 
-    Color3f brdfSampling(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its) const {
+    Color3f brdfSampling(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its,
+            const SurfaceInteraction& si) const {
         /*
         BRDF sampling
         */
         Color3f Lbs(0.0f);  // BRDF sampling contribution
         float w_mats = 0.f;
         float p_mat_mat = 0.f, p_em_mat = 0.f;
-        BSDFQueryRecord bsdfQR(its.toLocal(-ray.d), its.uv);
+        BSDFQueryRecord bsdfQR(si.toLocal(-ray.d), si.uv);
         Color3f brdfSample = its.mesh->getBSDF()->sample(bsdfQR, sampler->next2D());
         if (!(brdfSample.isZero() || brdfSample.hasNaN())) {    // only enter if sample is valid!
             // generate a new ray with the sampled direction
-            Ray3f bsdfRay(its.p, its.toWorld(bsdfQR.wo));
+            Ray3f bsdfRay(si.p, si.toWorld(bsdfQR.wo));
             Intersection its_bs;
             if (!scene->rayIntersect(bsdfRay, its_bs)) {
                 // if the ray doesnt intersect, take the background color
@@ -69,8 +66,9 @@ public:
             } else {
                 // if the ray intersects with an emitter, take the radiance of the emitter
                 if (its_bs.mesh->isEmitter()) {
+                    SurfaceInteraction si_bs = its_bs.computeSurfaceInteraction();
                     const Emitter* em_bs = its_bs.mesh->getEmitter();
-                    EmitterQueryRecord emitterQR(em_bs, its.p, its_bs.p, its_bs.shFrame.n, its_bs.uv);
+                    EmitterQueryRecord emitterQR(em_bs, si.p, si_bs.p, si_bs.shFrame.n, si_bs.uv);
                     p_em_mat = em_bs->pdf(emitterQR);
                     // i need to convert them to the same space first
                     // p_em_mat *= scene->pdfEmitter(em);
@@ -88,26 +86,26 @@ public:
         return Lbs * w_mats;
     }
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its) const {
         Color3f Lo(0.0f);
-        Intersection its;
-        if (!scene->rayIntersect(ray, its)) {
+        if (!its.mesh) {
             // no intersection
             return scene->getBackground(ray);
         }
+        SurfaceInteraction si = its.computeSurfaceInteraction();
         if (its.mesh->isEmitter()) {
             // intersection with an emitter
-            EmitterQueryRecord emitterQR(its.p);
+            EmitterQueryRecord emitterQR(si.p);
             emitterQR.ref = ray.o;
 			emitterQR.wi = ray.d;
-			emitterQR.n = its.shFrame.n; 
+			emitterQR.n = si.shFrame.n; 
             return its.mesh->getEmitter()->eval(emitterQR);
         }
         // If it's not an emitter nor background, we will take both samples and weight them
         //Light importance sampling
-        Color3f Les = emitterSampling(scene, sampler, ray, its);
+        Color3f Les = emitterSampling(scene, sampler, ray, its, si);
         //BRDF sampling
-        Color3f Lbs = brdfSampling(scene, sampler, ray, its);
+        Color3f Lbs = brdfSampling(scene, sampler, ray, its, si);
         // we're done taking samples, now we can return the radiance
         Lo = Les + Lbs; // both samples have been weighted already
         return Lo;
@@ -11,13 +11,13 @@ class DirectWhittedIntegrator : public Integrator {
     /* No parameters this time */
     }
 
-    Color3f Li(const Scene* scene , Sampler* sampler , const Ray3f& ray) const {
+    Color3f Li(const Scene* scene , Sampler* sampler , const Ray3f& ray, const Intersection& its) const {
         Color3f Lo (0.);
-        // Find the surface that is visible in the requested direction
-        Intersection its;
-        if (!scene->rayIntersect(ray, its))     // if the ray does not intersect, 
+        // its holds the surface that is visible in the requested direction
+        if (!its.mesh)                          // if the ray does not intersect, 
             return scene->getBackground(ray);   // return the color of the background
-        EmitterQueryRecord emitterRecord(its.p);
+        SurfaceInteraction si = its.computeSurfaceInteraction();
+        EmitterQueryRecord emitterRecord(si.p);
         // Get all lights in the scene
         const std::vector<Emitter*> lights = scene->getLights();
         // Let's iterate over all emitters
@@ -28,17 +28,9 @@ class DirectWhittedIntegrator : public Integrator {
             Color3f Le = em->sample(emitterRecord, sampler->next2D(), 0.);
             // Here perform a visibility query, to check whether the light
             // source "em" is visible from the intersection point.
-            // For that, we create a ray object (shadow ray),
-            // and compute the intersection.
-            // first of all we need to calculate the shadow ray direction towards the light source
-            Vector3f shadowRayDir = emitterRecord.p - its.p;
-            float distanceToLight = shadowRayDir.norm(); // to normalize the direction
-            shadowRayDir /= distanceToLight;
-
-            Ray3f shadowRay(its.p, shadowRayDir);
-            // Check if the shadow ray intersects with the scene
-            Intersection shadowIntersection;
-            if (!scene->rayIntersect(shadowRay, shadowIntersection)) { // if it doesn't intersect, then the light source is visible
+            // The segment between both points is tested with an
+            // any-hit (shadow) query.
+            if (scene->isVisible(em, emitterRecord)) { // if nothing blocks it, then the light source is visible
                 // Finally, we evaluate the BSDF. For that, we need to build
                 // a BSDFQueryRecord from the outgoing direction (the direction
                 // of the primary ray, in ray.d), and the incoming direction
@@ -46,10 +38,10 @@ class DirectWhittedIntegrator : public Integrator {
                 // Note that: a) the BSDF assumes directions in the local frame
                 // of reference; and b) that both the incoming and outgoing
                 // directions are assumed to start from the intersection point.
-                BSDFQueryRecord bsdfRecord(its.toLocal(-ray.d) , its.toLocal(emitterRecord.wi) , its.uv, ESolidAngle);
+                BSDFQueryRecord bsdfRecord(si.toLocal(-ray.d) , si.toLocal(emitterRecord.wi) , si.uv, ESolidAngle);
                 // For each light, we accomulate the incident light times the
                 // foreshortening times the BSDF term (i.e. the render equation).
-                Lo += Le * its.shFrame.n.dot(emitterRecord.wi) * its.mesh->getBSDF()->eval(bsdfRecord);
+                Lo += Le * si.shFrame.n.dot(emitterRecord.wi) * its.mesh->getBSDF()->eval(bsdfRecord);
             }   // if it does, then the light source is not visible from the intersection point, so it doesnt contribute
             
         }
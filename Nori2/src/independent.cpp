@@ -23,6 +23,14 @@
 
 NORI_NAMESPACE_BEGIN
 
+/// Scramble a 64 bit integer (one step of the splitmix64 generator)
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
 /**
  * Independent sampling - returns independent uniformly distributed
  * random numbers on <tt>[0, 1)x[0, 1)</tt>.
@@ -45,14 +53,22 @@ public:
         cloned->m_sampleCount = m_sampleCount;
         cloned->m_seed = m_seed;
         cloned->m_random = m_random;
+        cloned->m_offset = m_offset;
         return std::move(cloned);
     }
 
     void prepare(const ImageBlock &block) {
-        m_random.seed(
-            block.getOffset().x() + m_seed,
-            block.getOffset().y() + m_seed
-        );
+        m_offset = block.getOffset();
+        prepareSample(0);
+    }
+
+    void prepareSample(uint32_t index) {
+        /* Every sample index of a block gets its own state and stream.
+           Both are hashed, since pcg32 streams that share the initial
+           state and only differ in a few bits are correlated */
+        uint64_t block = ((uint64_t) (uint32_t) m_offset.x() << 32) | (uint32_t) m_offset.y();
+        uint64_t state = splitmix64(splitmix64(splitmix64(block) ^ m_seed) ^ index);
+        m_random.seed(state, splitmix64(state));
     }
 
     void generate() { /* No-op for this sampler */ }
@@ -84,6 +100,7 @@ protected:
 private:
     pcg32 m_random;
     uint64_t m_seed;
+    Point2i m_offset = Point2i(0, 0);
 };
 
 NORI_REGISTER_CLASS(Independent, "independent");
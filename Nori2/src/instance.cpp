@@ -0,0 +1,67 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/instance.h>
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+Instance::Instance(const PropertyList &props) {
+    m_name = props.getString("name", "");
+    m_ref = props.getString("ref", "");
+    m_toWorld = props.getTransform("toWorld", Transform());
+}
+
+void Instance::addChild(NoriObject *obj, const std::string& name) {
+    switch (obj->getClassType()) {
+        case EMesh:
+            if (m_mesh)
+                throw NoriException("Instance: tried to register multiple meshes!");
+            m_mesh = static_cast<Mesh *>(obj);
+            break;
+
+        default:
+            throw NoriException("Instance::addChild(<%s>) is not supported!",
+                classTypeName(obj->getClassType()));
+    }
+}
+
+void Instance::activate() {
+    if (!m_mesh && m_ref.empty())
+        throw NoriException("Instance: either a nested mesh or a \"ref\" is required!");
+    if (m_mesh && !m_ref.empty())
+        throw NoriException("Instance: a nested mesh and a \"ref\" cannot be combined!");
+    if (m_mesh && m_mesh->isEmitter())
+        throw NoriException("Instance: instanced meshes cannot be emitters!");
+}
+
+std::string Instance::toString() const {
+    return tfm::format(
+        "Instance[\n"
+        "  mesh = %s,\n"
+        "  name = \"%s\",\n"
+        "  ref = \"%s\",\n"
+        "  toWorld = %s\n"
+        "]",
+        m_mesh ? indent(m_mesh->toString()) : std::string("null"),
+        m_name, m_ref,
+        indent(m_toWorld.toString(), 12));
+}
+
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
@@ -19,23 +19,84 @@
 #include <nori/parser.h>
 #include <nori/scene.h>
 #include <nori/camera.h>
+#include <nori/rfilter.h>
 #include <nori/block.h>
 #include <nori/timer.h>
 #include <nori/bitmap.h>
 #include <nori/sampler.h>
 #include <nori/integrator.h>
 #include <nori/gui.h>
-#include <tbb/parallel_for.h>
-#include <tbb/blocked_range.h>
-#include <tbb/task_scheduler_init.h>
+#include <tbb/task_group.h>
+#include <tbb/task_arena.h>
 #include <filesystem/resolver.h>
 #include <thread>
+#include <atomic>
+#include <csignal>
 
 using namespace nori;
 
 static int threadCount = -1;
 
-static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
+/// Width of the square groups of pixels whose camera rays are traced as one packet
+static const int packetWidth = 8;
+static_assert(packetWidth * packetWidth <= NORI_PACKET_SIZE, "Pixel packets exceed the ray packet size");
+
+/// Minimum number of pixel samples that a block is split into when rendering small images
+static const uint32_t minSplitSamples = 16;
+
+/// Number of work items per thread that \ref render() aims for
+static const int workItemsPerThread = 4;
+
+/// Time spent on every block of the previous frame or pass, used to schedule the expensive blocks first
+static std::vector<float> blockTimes;
+
+/// Render in passes of increasing sample count (see \ref render())
+static bool progressive = false;
+
+/// Wall-clock limit of a progressive render in seconds (0: none)
+static double timeBudget = 0;
+
+/// Samples per pixel to render instead of those of the scene's sampler (0: use the sampler's)
+static uint32_t targetSampleCount = 0;
+
+/// Relative error below which pixels stop receiving samples (0: render all pixels equally)
+static float adaptiveThreshold = 0;
+
+/// Number of samples that a pixel needs before adaptive sampling considers it converged
+static const uint32_t minAdaptiveSamples = 16;
+
+/// Save an image of the number of samples of every pixel (a layer of the EXR file with \ref aovImages)
+static bool sampleCountImage = false;
+
+/// Store the auxiliary outputs of the integrator (albedo, normal, ...) as layers of the EXR file
+static bool aovImages = false;
+
+/// Set by SIGINT to stop a progressive render and save the image rendered so far
+static std::atomic<bool> interrupted(false);
+
+/// Time since the start of the current render
+static Timer renderTimer;
+
+static void onInterrupt(int) {
+    interrupted = true;
+
+    /* A second interrupt terminates the program */
+    std::signal(SIGINT, SIG_DFL);
+}
+
+/// Return the filter that image blocks splat samples with (none when the camera importance samples it)
+static const ReconstructionFilter *getFilmFilter(const Camera *camera) {
+    return camera->useFilterSampling() ? nullptr : camera->getReconstructionFilter();
+}
+
+/// Should a progressive render stop (because it was interrupted or ran out of time)?
+static bool stopRequested() {
+    return interrupted || (timeBudget > 0 && renderTimer.elapsed() > timeBudget * 1000);
+}
+
+static uint32_t renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block,
+        BlockGenerator &blockGenerator, uint32_t firstSample, bool stoppable,
+        PixelStatistics *statistics) {
     const Camera *camera = scene->getCamera();
     const Integrator *integrator = scene->getIntegrator();
 
@@ -45,25 +106,177 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     /* Clear the block contents */
     block.clear();
 
-    /* For each pixel and pixel sample sample */
-    for (int y=0; y<size.y(); ++y) {
-        for (int x=0; x<size.x(); ++x) {
-            for (uint32_t i=0; i<sampler->getSampleCount(); ++i) {
-                Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+    /* The camera rays of all pixels are generated one pixel sample at a time.
+       Each packetWidth x packetWidth group of pixels is stored contiguously
+       and traced as one packet. Converged pixels are left out */
+    std::vector<Point2i> pixels;
+    std::vector<int> packets(1, 0);
+    for (int py=0; py<size.y(); py+=packetWidth) {
+        for (int px=0; px<size.x(); px+=packetWidth) {
+            for (int y=py; y<std::min(py+packetWidth, size.y()); ++y)
+                for (int x=px; x<std::min(px+packetWidth, size.x()); ++x)
+                    if (!statistics || !statistics->isConverged(offset + Point2i(x, y)))
+                        pixels.push_back(Point2i(x, y));
+            if ((int) pixels.size() > packets.back())
+                packets.push_back((int) pixels.size());
+        }
+    }
+
+    int count = (int) pixels.size();
+    std::vector<Ray3f> rays(count);
+    std::vector<Intersection> its(count);
+    std::vector<Point2f> pixelSamples(count);
+    std::vector<float> filterWeights(camera->useFilterSampling() ? count : 0);
+    std::vector<Color3f> weights(count), values(count);
+    std::vector<VarianceEstimate> estimates(statistics ? count : 0);
+
+    /* Auxiliary outputs use the first intersection of the camera rays as well */
+    std::vector<Integrator::AOV> aovs;
+    if (block.getAOVCount() > 0)
+        aovs = integrator->getAOVs();
+    std::vector<Color3f> aovValues(aovs.size());
+
+    /* Claim the pixel samples one at a time, other threads
+       may render the remaining ones when they run out of work */
+    uint32_t i, rendered = 0;
+    while (!(stoppable && stopRequested()) && blockGenerator.nextSample(block, i)) {
+        sampler->prepareSample(firstSample + i);
+        ++rendered;
+
+        for (size_t k=0; k+1<packets.size(); ++k) {
+            for (int n=packets[k]; n<packets[k+1]; ++n) {
+                Point2f pixelSample;
+                if (camera->useFilterSampling()) {
+                    /* Place the sample by importance sampling the filter around the pixel center */
+                    pixelSample = (pixels[n] + offset).cast<float>() + Vector2f::Constant(0.5f) +
+                        camera->getReconstructionFilter()->sample(sampler->next2D(), filterWeights[n]);
+                } else {
+                    pixelSample = (pixels[n] + offset).cast<float>() + sampler->next2D();
+                }
                 Point2f apertureSample = sampler->next2D();
 
                 /* Sample a ray from the camera */
-                Ray3f ray;
-                Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
+                weights[n] = camera->sampleRay(rays[n], pixelSample, apertureSample);
+                pixelSamples[n] = pixelSample;
+            }
+
+            /* Find the first intersection of the whole packet at once */
+            scene->rayIntersectPacket(&rays[packets[k]], &its[packets[k]], packets[k+1] - packets[k]);
+        }
 
-                /* Compute the incident radiance */
-                value *= integrator->Li(scene, sampler, ray);
+        /* Compute the incident radiance of the whole batch */
+        integrator->LiBatch(scene, sampler, rays.data(), its.data(), values.data(), count);
 
-                /* Store in the image block */
-                block.put(pixelSample, value);
+        /* Unfiltered outputs (e.g. mesh IDs) only keep the first sample of a pixel */
+        if (!aovs.empty()) {
+            for (int j=0; j<count; ++j) {
+                integrator->evalAOVs(scene, rays[j], its[j], aovValues.data());
+                for (int k=0; k<(int) aovs.size(); ++k)
+                    if (aovs[k].filtered || firstSample + i == 0)
+                        block.putAOV(k, pixels[j] + offset, aovValues[k]);
             }
         }
+
+        for (int j=0; j<count; ++j)
+            values[j] *= weights[j];
+
+        /* Store in the image block */
+        if (camera->useFilterSampling()) {
+            for (int j=0; j<count; ++j)
+                block.put(pixels[j] + offset, values[j], filterWeights[j]);
+        } else {
+            block.put(pixelSamples.data(), values.data(), count);
+        }
+
+        if (statistics) {
+            for (int j=0; j<count; ++j)
+                if (values[j].isValid())
+                    estimates[j].add((double) values[j].getLuminance());
+        }
     }
+
+    if (statistics && rendered > 0)
+        statistics->put(offset, pixels, estimates);
+
+    return rendered;
+}
+
+/**
+ * \brief Render the pixel samples <tt>[firstSample, firstSample + sampleCount)</tt>
+ * of the whole image and add them to \c result
+ *
+ * When \c stoppable is set, the pass ends early once \ref stopRequested()
+ * returns \c true, and the image contains the samples rendered until then.
+ * When \c statistics are given, they are updated with the new samples and
+ * the pixels that they mark as converged are skipped.
+ */
+static void renderPass(const Scene *scene, ImageBlock &result, tbb::task_arena &arena,
+        uint32_t firstSample, uint32_t sampleCount, bool stoppable,
+        PixelStatistics *statistics) {
+    const Camera* camera = scene->getCamera();
+    Vector2i outputSize = camera->getOutputSize();
+
+    /* Small images have fewer blocks than there are threads. Hand every
+       block out to several threads in that case, which render separate
+       pixel samples into their own blocks that are merged into the result */
+    int threads = threadCount > 0 ? threadCount : (int) std::thread::hardware_concurrency();
+    int blockCount = ((outputSize.x() + NORI_BLOCK_SIZE - 1) / NORI_BLOCK_SIZE) *
+        ((outputSize.y() + NORI_BLOCK_SIZE - 1) / NORI_BLOCK_SIZE);
+    uint32_t sampleSplits = (uint32_t) std::max(1, (threads * workItemsPerThread + blockCount - 1) / blockCount);
+    sampleSplits = std::max(1u, std::min(sampleSplits, sampleCount / minSplitSamples));
+
+    /* Create a block generator (i.e. a work scheduler) */
+    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE, sampleCount, sampleSplits, blockTimes);
+    if (statistics)
+        blockGenerator.retainBlocks([&](const Point2i &offset) { return !statistics->isBlockConverged(offset); });
+
+    /* Finished blocks are added to the image without locking it */
+    BlockAccumulator accumulator(result, blockGenerator);
+
+    /* Every worker renders blocks until the block generator runs out of
+       them, and then helps with the samples of unfinished blocks */
+    auto map = [&]() {
+        /* Allocate memory for a small image block to be rendered
+           by the current thread */
+        ImageBlock block(Vector2i(NORI_BLOCK_SIZE), getFilmFilter(camera), result.getAOVCount());
+
+        /* Create a clone of the sampler for the current thread */
+        std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+
+        /* Request an image block from the block generator */
+        while (!(stoppable && stopRequested()) && blockGenerator.next(block)) {
+            Timer blockTimer;
+
+            /* Inform the sampler about the block to be rendered */
+            sampler->prepare(block);
+
+            /* Render all contained pixels */
+            uint32_t samples = renderBlock(scene, sampler.get(), block, blockGenerator,
+                firstSample, stoppable, statistics);
+            blockGenerator.addTime(block, blockTimer.elapsed());
+
+            /* The image block has been processed. Now add it to
+               the "big" block that represents the entire image */
+            if (samples > 0)
+                accumulator.put(block, samples);
+        }
+    };
+
+    /// Default: parallel rendering, one worker per thread of the arena
+    arena.execute([&] {
+        tbb::task_group group;
+        for (int i = 0; i < arena.max_concurrency(); ++i)
+            group.run(map);
+        group.wait();
+    });
+
+    /// (equivalent to the following single-threaded call)
+    // map();
+
+    /* Add the borders that the blocks share with their neighbours */
+    arena.execute([&] { accumulator.finish(); });
+
+    blockTimes = blockGenerator.getBlockTimes();
 }
 
 static void render(Scene* scene, const std::string& filename, bool nogui) {
@@ -71,13 +284,21 @@ static void render(Scene* scene, const std::string& filename, bool nogui) {
     Vector2i outputSize = camera->getOutputSize();
     scene->getIntegrator()->preprocess(scene);
 
-    /* Create a block generator (i.e. a work scheduler) */
-    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+    uint32_t sampleCount = targetSampleCount > 0 ? targetSampleCount :
+        (uint32_t) scene->getSampler()->getSampleCount();
 
     /* Allocate memory for the entire output image and clear it */
-    ImageBlock result(outputSize, camera->getReconstructionFilter());
+    std::vector<Integrator::AOV> aovs;
+    if (aovImages)
+        aovs = scene->getIntegrator()->getAOVs();
+    ImageBlock result(outputSize, getFilmFilter(camera), (int) aovs.size());
     result.clear();
 
+    /* Per-pixel statistics for adaptive sampling and the sample count image or layer */
+    std::unique_ptr<PixelStatistics> statistics;
+    if (adaptiveThreshold > 0 || sampleCountImage || aovImages)
+        statistics.reset(new PixelStatistics(outputSize, NORI_BLOCK_SIZE));
+
     /* Create a window that visualizes the partially rendered result */
     NoriScreen* screen = 0;
     if (!nogui)
@@ -86,48 +307,71 @@ static void render(Scene* scene, const std::string& filename, bool nogui) {
         screen = new NoriScreen(result);
     }
 
+    /* Stop a progressive render on Ctrl-C and still save the image */
+    if (progressive)
+        std::signal(SIGINT, onInterrupt);
+
     /* Do the following in parallel and asynchronously */
     std::thread render_thread([&] {
-        tbb::task_scheduler_init init(threadCount);
-
-        cout << "Rendering .. ";
-        cout.flush();
-        Timer timer;
-
-        tbb::blocked_range<int> range(0, blockGenerator.getBlockCount());
-
-        auto map = [&](const tbb::blocked_range<int>& range) {
-            /* Allocate memory for a small image block to be rendered
-               by the current thread */
-            ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
-                camera->getReconstructionFilter());
-
-            /* Create a clone of the sampler for the current thread */
-            std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
-
-            for (int i = range.begin(); i < range.end(); ++i) {
-                /* Request an image block from the block generator */
-                blockGenerator.next(block);
-
-                /* Inform the sampler about the block to be rendered */
-                sampler->prepare(block);
-
-                /* Render all contained pixels */
-                renderBlock(scene, sampler.get(), block);
-
-                /* The image block has been processed. Now add it to
-                   the "big" block that represents the entire image */
-                result.put(block);
+        /* Limit the render to the requested number of threads */
+        tbb::task_arena arena(threadCount);
+
+        renderTimer.reset();
+        if (!progressive) {
+            cout << "Rendering .. ";
+            cout.flush();
+            renderPass(scene, result, arena, 0, sampleCount, false, statistics.get());
+            cout << "done. (took " << renderTimer.elapsedString() << ")" << endl;
+        } else {
+            /* Render the whole image in passes that double the number of
+               samples per pixel. The first pass always runs to completion,
+               so that every pixel has at least one sample */
+            uint64_t budget = (uint64_t) sampleCount * outputSize.x() * outputSize.y();
+            uint32_t firstSample = 0, endSample = 1;
+            while (true) {
+                Timer timer;
+                cout << "Rendering samples " << firstSample << " to " << endSample << " .. ";
+                cout.flush();
+                renderPass(scene, result, arena, firstSample, endSample - firstSample, firstSample > 0,
+                    statistics.get());
+                cout << "done. (took " << timer.elapsedString() << ")" << endl;
+
+                if (stopRequested())
+                    break;
+
+                uint32_t passSamples = endSample;
+                if (adaptiveThreshold > 0) {
+                    /* Spend the samples that converged pixels do not need on
+                       the remaining ones, in passes that at most double their
+                       sample count */
+                    int active = statistics->update(adaptiveThreshold, minAdaptiveSamples);
+                    uint64_t spent = statistics->getSampleCount();
+                    if (active == 0 || spent + active > budget)
+                        break;
+                    if (active < outputSize.x() * outputSize.y())
+                        cout << "  " << active << " pixels have not converged yet" << endl;
+                    passSamples = (uint32_t) std::min((uint64_t) passSamples, (budget - spent) / active);
+                } else if (endSample == sampleCount) {
+                    break;
+                } else {
+                    passSamples = std::min(passSamples, sampleCount - endSample);
+                }
+                firstSample = endSample;
+                endSample += passSamples;
             }
-        };
-
-        /// Default: parallel rendering
-        tbb::parallel_for(range, map);
-
-        /// (equivalent to the following single-threaded call)
-        // map(range);
+            if (stopRequested())
+                cout << "Stopped early after " << renderTimer.elapsedString() << "." << endl;
+            else if (adaptiveThreshold > 0)
+                cout << "Rendered " << tfm::format("%.1f", statistics->getSampleCount() / (double) outputSize.prod())
+                     << " samples per pixel on average in " << renderTimer.elapsedString() << "." << endl;
+            else
+                cout << "Rendered " << sampleCount << " samples per pixel in " << renderTimer.elapsedString() << "." << endl;
+        }
+        scene->getAccel()->printStatistics();
 
-        cout << "done. (took " << timer.elapsedString() << ")" << endl;
+        if (ImageBlock::getInvalidSampleCount() > 0)
+            cerr << "Warning: the integrator computed " << ImageBlock::getInvalidSampleCount()
+                 << " invalid radiance values, which were discarded." << endl;
     });
 
     if (!nogui)
@@ -150,6 +394,16 @@ static void render(Scene* scene, const std::string& filename, bool nogui) {
        a properly normalized bitmap */
     std::unique_ptr<Bitmap> bitmap(result.toBitmap());
 
+    /* Write the auxiliary outputs and the sample counts into the same EXR file */
+    for (int k=0; k<(int) aovs.size(); ++k) {
+        std::unique_ptr<Bitmap> aov(result.toAOVBitmap(k));
+        bitmap->addLayer(aovs[k].name, aovs[k].channels, *aov);
+    }
+    if (aovImages) {
+        std::unique_ptr<Bitmap> samples(statistics->toSampleCountBitmap());
+        bitmap->addLayer("samples", { "count" }, *samples);
+    }
+
     /* Determine the filename of the output bitmap */
     std::string outputName = filename;
     size_t lastdot = outputName.find_last_of(".");
@@ -161,6 +415,12 @@ static void render(Scene* scene, const std::string& filename, bool nogui) {
 
     /* Save tonemapped (sRGB) output using the PNG format */
     bitmap->savePNG(outputName);
+
+    /* Save the number of samples of every pixel, unless it is already a layer of the EXR file */
+    if (sampleCountImage && !aovImages) {
+        std::unique_ptr<Bitmap> samples(statistics->toSampleCountBitmap());
+        samples->saveEXR(outputName + "_samples");
+    }
 }
 
 int main(int argc, char **argv) {
@@ -188,6 +448,42 @@ int main(int argc, char **argv) {
 
             continue;
         }
+        else if (token == "--time-budget") {
+            if (i+1 >= argc || (timeBudget = atof(argv[i+1])) <= 0) {
+                cerr << "\"--time-budget\" argument expects a positive number of seconds following it." << endl;
+                return -1;
+            }
+            i++;
+            progressive = true;
+
+            continue;
+        }
+        else if (token == "--spp") {
+            if (i+1 >= argc || atoi(argv[i+1]) <= 0) {
+                cerr << "\"--spp\" argument expects a positive integer following it." << endl;
+                return -1;
+            }
+            targetSampleCount = (uint32_t) atoi(argv[i+1]);
+            i++;
+
+            continue;
+        }
+        else if (token == "--adaptive") {
+            if (i+1 >= argc || (adaptiveThreshold = (float) atof(argv[i+1])) <= 0) {
+                cerr << "\"--adaptive\" argument expects a positive relative error following it." << endl;
+                return -1;
+            }
+            i++;
+            progressive = true;
+
+            continue;
+        }
+        else if (token == "--sample-counts")
+            sampleCountImage = true;
+        else if (token == "--aovs")
+            aovImages = true;
+        else if (token == "--progressive" || token == "-p")
+            progressive = true;
         else if(token == "--nogui" || token == "-b")
             nogui = true;
         else
@@ -227,16 +523,16 @@ int main(int argc, char **argv) {
     }
 
     if (threadCount < 0) {
-        threadCount = tbb::task_scheduler_init::automatic;
+        threadCount = tbb::task_arena::automatic;
     }
 
     if (sceneName != "") {
         try {
-            std::unique_ptr<NoriObject> root(loadFromXML(argv[1]));
+            std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
 
             /* When the XML root object is a scene, start rendering it .. */
             if (root->getClassType() == NoriObject::EScene)
-                render(static_cast<Scene*>(root.get()), argv[1], nogui);
+                render(static_cast<Scene*>(root.get()), sceneName, nogui);
         }
         catch (const std::exception& e) {
             cerr << "[FATAL ERROR]: " << e.what() << endl;
@@ -26,6 +26,7 @@
 #include <nori/emitter.h>
 #include <nori/warp.h>
 #include <nori/medium.h>
+#include <nori/transform.h>
 #include <Eigen/Geometry>
 
 NORI_NAMESPACE_BEGIN
@@ -45,6 +46,10 @@ void Mesh::activate() {
             NoriObjectFactory::createInstance("diffuse", PropertyList()));
     }
 
+    /* Analytic shapes have no triangles and sample their surface directly */
+    if (m_F.cols() == 0)
+        return;
+
     m_pdf.reserve(m_F.cols());
     for (n_UINT i = 0; i < m_F.cols(); i++) //Depending on the number of triangles
     {
@@ -54,6 +59,30 @@ void Mesh::activate() {
     m_pdf.normalize();  // this is done in order to sample the triangles with respect to their surface area
 }
 
+void Mesh::setVertexPositions(const MatrixXf &positions, const MatrixXf &normals) {
+    if (positions.rows() != 3 || positions.cols() != m_V.cols())
+        throw NoriException("Mesh::setVertexPositions(): expected 3x%i positions for mesh \"%s\", got %ix%i",
+            m_V.cols(), m_name, positions.rows(), positions.cols());
+    if (normals.size() > 0 && (normals.rows() != 3 || normals.cols() != m_V.cols()))
+        throw NoriException("Mesh::setVertexPositions(): expected 3x%i normals for mesh \"%s\", got %ix%i",
+            m_V.cols(), m_name, normals.rows(), normals.cols());
+
+    m_V = positions;
+    if (normals.size() > 0)
+        m_N = normals;
+
+    m_bbox.reset();
+    for (n_UINT i = 0; i < (n_UINT) m_V.cols(); ++i)
+        m_bbox.expandBy(m_V.col(i));
+
+    /* Triangle areas changed, so the sampling pdf has to be rebuilt */
+    m_pdf.clear();
+    m_pdf.reserve(m_F.cols());
+    for (n_UINT i = 0; i < m_F.cols(); i++)
+        m_pdf.append(surfaceArea(i));
+    m_pdf.normalize();
+}
+
 float Mesh::surfaceArea(n_UINT index) const {
     n_UINT i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
 
@@ -101,6 +130,50 @@ bool Mesh::rayIntersect(n_UINT index, const Ray3f &ray, float &u, float &v, floa
     return t >= ray.mint && t <= ray.maxt;
 }
 
+void Mesh::computeSurfaceInteraction(const Intersection &its, SurfaceInteraction &si) const {
+    n_UINT index = its.prim;
+
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1 - its.u - its.v, its.u, its.v;
+
+    /* Vertex indices of the triangle */
+    n_UINT idx0 = m_F(0, index), idx1 = m_F(1, index), idx2 = m_F(2, index);
+
+    Point3f p0 = m_V.col(idx0), p1 = m_V.col(idx1), p2 = m_V.col(idx2);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    si.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (m_UV.size() > 0)
+        si.uv = bary.x() * m_UV.col(idx0) +
+            bary.y() * m_UV.col(idx1) +
+            bary.z() * m_UV.col(idx2);
+    else
+        si.uv = Point2f(its.u, its.v);
+
+    /* Compute the geometry frame */
+    si.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
+
+    if (m_N.size() > 0) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        si.shFrame = Frame(
+            (bary.x() * m_N.col(idx0) +
+                bary.y() * m_N.col(idx1) +
+                bary.z() * m_N.col(idx2)).normalized());
+    }
+    else {
+        si.shFrame = si.geoFrame;
+    }
+}
+
 BoundingBox3f Mesh::getBoundingBox(n_UINT index) const {
     BoundingBox3f result(m_V.col(m_F(0, index)));
     result.expandBy(m_V.col(m_F(1, index)));
@@ -222,27 +295,55 @@ std::string Mesh::toString() const {
     );
 }
 
+SurfaceInteraction Intersection::computeSurfaceInteraction() const {
+    SurfaceInteraction si;
+    mesh->computeSurfaceInteraction(*this, si);
+
+    /* Move the object space surface information of an instance into world space */
+    if (instance) {
+        si.p = *instance * si.p;
+        si.geoFrame = Frame((*instance * si.geoFrame.n).normalized());
+        si.shFrame = Frame((*instance * si.shFrame.n).normalized());
+    }
+    return si;
+}
+
 std::string Intersection::toString() const {
     if (!mesh)
         return "Intersection[invalid]";
 
     return tfm::format(
         "Intersection[\n"
-        "  p = %s,\n"
         "  t = %f,\n"
+        "  u = %f,\n"
+        "  v = %f,\n"
+        "  prim = %i,\n"
+        "  mesh = %s,\n"
+        "  medium = %s,\n"
+        "  instance = %s\n"
+        "]",
+        t,
+        u,
+        v,
+        prim,
+        mesh ? mesh->toString() : std::string("null"),
+        medium ? medium->toString() : std::string("null"),
+        instance ? indent(instance->toString()) : std::string("null")
+    );
+}
+
+std::string SurfaceInteraction::toString() const {
+    return tfm::format(
+        "SurfaceInteraction[\n"
+        "  p = %s,\n"
         "  uv = %s,\n"
         "  shFrame = %s,\n"
-        "  geoFrame = %s,\n"
-        "  mesh = %s,\n"
-        "  medium = %s\n"
+        "  geoFrame = %s\n"
         "]",
         p.toString(),
-        t,
         uv.toString(),
         indent(shFrame.toString()),
-        indent(geoFrame.toString()),
-        mesh ? mesh->toString() : std::string("null"),
-        medium ? medium->toString() : std::string("null")
+        indent(geoFrame.toString())
     );
 }
 
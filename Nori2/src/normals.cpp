@@ -8,13 +8,12 @@ public:
 		// There are no parameters this time
 	}
 	/// Compute the radiance value for a given ray. Just return green here
-	Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
-		// Find out the surface that's visible in the requested direction
-		Intersection its;
-		if (!scene->rayIntersect(ray, its))
+	Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its) const {
+		// The surface that's visible in the requested direction has already been found
+		if (!its.mesh)
 			return Color3f(0.0f);
 		// Return the component-wise absolute value of the shading normal as a color
-		Normal3f n = its.shFrame.n.cwiseAbs();
+		Normal3f n = its.computeSurfaceInteraction().shFrame.n.cwiseAbs();
 		return Color3f(n.x(), n.y(), n.z());
 	}
 	/// Return a human-readable description for debugging purposes
@@ -69,6 +69,8 @@ NoriObject *loadFromXML(const std::string &filename) {
         ESampler              = NoriObject::ESampler,
         ETest                 = NoriObject::ETest,
         EReconstructionFilter = NoriObject::EReconstructionFilter,
+        EInstance             = NoriObject::EInstance,
+        EAccel                = NoriObject::EAccel,
 
         /* Properties */
         EBoolean = NoriObject::EClassTypeCount,
@@ -103,6 +105,8 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["sampler"]    = ESampler;
     tags["rfilter"]    = EReconstructionFilter;
     tags["test"]       = ETest;
+    tags["instance"]   = EInstance;
+    tags["accel"]      = EAccel;
     tags["boolean"]    = EBoolean;
     tags["integer"]    = EInteger;
     tags["float"]      = EFloat;
@@ -176,10 +180,16 @@ NoriObject *loadFromXML(const std::string &filename) {
 
         if (tag == EScene)
             node.append_attribute("type") = "scene";
+        else if (tag == EInstance)
+            node.append_attribute("type") = "instance";
         else if (tag == ETransform)
             transform.setIdentity();
 
         PropertyList propList;
+
+        /* Let the scene know where it was loaded from (e.g. to cache its BVH next to it) */
+        if (tag == EScene)
+            propList.setString("filename", filename);
         std::vector<NoriObject *> children;
         std::vector<std::string> children_names;
         for (pugi::xml_node &ch: node.children()) {
@@ -12,41 +12,43 @@ public:
 		/* No parameters this time */
 	}
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& firstIts) const {
         Color3f Lo(0.0f);   // the radiance we will return
         int depth = 1;
         float survivalProb;
         Color3f throughput(1.0f);
         Ray3f bouncyRay = ray;
-        Intersection its;
+        Intersection its(firstIts);   // the first intersection comes already traced
+        bool hit = its.mesh != nullptr;
         while (true) {
-            if (!scene->rayIntersect(bouncyRay, its)) {
+            if (!hit) {
                 // if the ray doesnt intersect with nothing, we will add the background color
                 // to the radiance we will return
                 Color3f backgroundColor = scene->getBackground(bouncyRay);
                 Lo += backgroundColor * throughput;
                 break;
             }
+            SurfaceInteraction si = its.computeSurfaceInteraction();
             if (its.mesh->isEmitter()) {
                 // if the ray intersects with an emitter, we will add the radiance of the emitter
                 // to the radiance we will return
-                EmitterQueryRecord emitterQR(its.p);
+                EmitterQueryRecord emitterQR(si.p);
                 emitterQR.ref = bouncyRay.o;
                 emitterQR.wi = bouncyRay.d;
-                emitterQR.n = its.shFrame.n;
+                emitterQR.n = si.shFrame.n;
                 Lo += its.mesh->getEmitter()->eval(emitterQR) * throughput;
                 break;
             }
             // if the ray intersects with a surface, we will sample the brdf
             Point2f sample = sampler->next2D();
-            BSDFQueryRecord bsdfQR(its.toLocal(-bouncyRay.d), sample);
+            BSDFQueryRecord bsdfQR(si.toLocal(-bouncyRay.d), sample);
             Color3f brdfSample = its.mesh->getBSDF()->sample(bsdfQR, sample);
             // check if the brdf sample is valid (absorbed or invalid samples are not valid)
             if (brdfSample.isZero() || brdfSample.hasNaN()) {   // if it is not valid, return black
                 break;
             }
             // now create a new ray with the sampled direction
-            bouncyRay = Ray3f(its.p, its.toWorld(bsdfQR.wo));
+            bouncyRay = Ray3f(si.p, si.toWorld(bsdfQR.wo));
             throughput *= brdfSample;
             if (depth > 2) {    // we want to ensure that the path has at least  bounces
                 // start the russian roulette
@@ -59,6 +61,7 @@ public:
                 }
             }
             depth++;
+            hit = scene->rayIntersect(bouncyRay, its);
         }
         return Lo;
     }
@@ -67,15 +67,16 @@ public:
         return Lo;
     }
 
-    Color3f pathTracing(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its) const {
+    Color3f pathTracing(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its,
+            const SurfaceInteraction& si) const {
         Color3f Lo(0.0f);   // the radiance we will return
         Point2f sample = sampler->next2D();
-        BSDFQueryRecord bsdfQR(its.toLocal(-ray.d), sample);
+        BSDFQueryRecord bsdfQR(si.toLocal(-ray.d), sample);
         Color3f brdfSample = its.mesh->getBSDF()->sample(bsdfQR, sample);
         if (brdfSample.isZero() || brdfSample.hasNaN()) {   // if it is not valid, return black
             return Lo;
         }
-        Ray3f bouncedRay(its.p, its.toWorld(bsdfQR.wo));
+        Ray3f bouncedRay(si.p, si.toWorld(bsdfQR.wo));
         // decide wether to continue or not via russian roulette
         float survivalProb = std::min(brdfSample.maxCoeff(), 0.95f);
         if (sampler->next1D() > survivalProb) {
@@ -85,17 +86,20 @@ public:
         return Lo;
     }
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
-        Intersection its;
+    /// Nested calls above trace their own ray through the base class version
+    using Integrator::Li;
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its) const {
         /* PATH TERMINATION CASES */
-        if (!scene->rayIntersect(ray, its)) { // if no intersection, return background color
+        if (!its.mesh) { // if no intersection, return background color
             return scene->getBackground(ray);
         }
+        SurfaceInteraction si = its.computeSurfaceInteraction();
         if (its.mesh->isEmitter()) {    // if the intersection is an emitter, add the contribution
-                EmitterQueryRecord emitterQR(its.p);
-                emitterQR.n = its.shFrame.n;
+                EmitterQueryRecord emitterQR(si.p);
+                emitterQR.n = si.shFrame.n;
                 emitterQR.ref = ray.o;
-                emitterQR.uv = its.uv;
+                emitterQR.uv = si.uv;
                 emitterQR.wi = ray.d;
                 emitterQR.dist = its.t;
                 return its.mesh->getEmitter()->eval(emitterQR);
@@ -106,12 +110,12 @@ public:
         // intersected with a medium
         if (its.medium != nullptr) {
             // if i hit a medium, will start ray marching inside the medium
-            Ray3f mediumRay(its.p, ray.d);  // this ray's origin is the point of intersection with the medium
+            Ray3f mediumRay(si.p, ray.d);  // this ray's origin is the point of intersection with the medium
             Lo = rayMarching(scene, sampler, mediumRay);
         } else {
             // if i hit a normal mesh, will continue the path
-            Ray3f pathRay(its.p, ray.d);
-            Lo = pathTracing(scene, sampler, pathRay, its);
+            Ray3f pathRay(si.p, ray.d);
+            Lo = pathTracing(scene, sampler, pathRay, its, si);
         }
         return Lo;
     }
@@ -12,28 +12,29 @@ public:
 		/* No parameters this time */
 	}
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its) const {
         Color3f Lo(0.0f);   // the radiance we will return
         int depth = 1;
         Color3f throughput(1.0f);
         Ray3f og_ray(ray);
         float survivalProb;
-        Intersection its_og;
-        if (!scene->rayIntersect(og_ray, its_og)) { // if no intersection, return background color
+        Intersection its_og(its);
+        if (!its_og.mesh) { // if no intersection, return background color
             return scene->getBackground(og_ray);
         }
+        SurfaceInteraction si_og = its_og.computeSurfaceInteraction();
         if (its_og.mesh->isEmitter()) {    // if the intersection is an emitter, add the contribution
-                EmitterQueryRecord emitterQR(its_og.p);
-                emitterQR.n = its_og.shFrame.n;
+                EmitterQueryRecord emitterQR(si_og.p);
+                emitterQR.n = si_og.shFrame.n;
                 emitterQR.ref = og_ray.o;
-                emitterQR.uv = its_og.uv;
+                emitterQR.uv = si_og.uv;
                 emitterQR.wi = og_ray.d;
                 emitterQR.dist = its_og.t;
                 return its_og.mesh->getEmitter()->eval(emitterQR);
         }
         while (true) {
             // first, get the next ray (and therefore the next intersection) via BSDF sampling
-            BSDFQueryRecord bsdfQR_og(its_og.toLocal(-og_ray.d), sampler->next2D());
+            BSDFQueryRecord bsdfQR_og(si_og.toLocal(-og_ray.d), sampler->next2D());
             Color3f bsdf_og = its_og.mesh->getBSDF()->sample(bsdfQR_og, sampler->next2D());
             if (bsdf_og.isZero() || bsdf_og.hasNaN()) {
                 break;
@@ -42,7 +43,7 @@ public:
             // check if the og intersection is delta
             bool isDelta = bsdfQR_og.measure == EDiscrete;
             // generate the new ray
-            Ray3f ray_new(its_og.p, its_og.toWorld(bsdfQR_og.wo));
+            Ray3f ray_new(si_og.p, si_og.toWorld(bsdfQR_og.wo));
             Intersection its_new;
             if (!scene->rayIntersect(ray_new, its_new)) {
                 Color3f backgroundColor = scene->getBackground(ray_new);
@@ -55,11 +56,12 @@ public:
             float p_mat_em = 0.0f;
             float w_mat = 0.0f;
             if (its_new.mesh->isEmitter()) {
-                EmitterQueryRecord emitterQR(its_new.p);
-                BSDFQueryRecord bsdfQR_bs(its_new.toLocal(-ray_new.d), sampler->next2D());
+                SurfaceInteraction si_new = its_new.computeSurfaceInteraction();
+                EmitterQueryRecord emitterQR(si_new.p);
+                BSDFQueryRecord bsdfQR_bs(si_new.toLocal(-ray_new.d), sampler->next2D());
                 emitterQR.wi = ray_new.d;
-                emitterQR.n = its_new.shFrame.n;
-                emitterQR.uv = its_new.uv;
+                emitterQR.n = si_new.shFrame.n;
+                emitterQR.uv = si_new.uv;
                 emitterQR.dist = its_new.t;
                 // this is the prob of sampling the emitter in this direction
                 p_mat_em = its_new.mesh->getEmitter()->pdf(emitterQR);
@@ -77,15 +79,11 @@ public:
             if (!isDelta){
                 float pdf_emitter;
                 const Emitter* em = scene->sampleEmitter(sampler->next1D(), pdf_emitter);
-                EmitterQueryRecord emitterQR_ls(its_og.p);
+                EmitterQueryRecord emitterQR_ls(si_og.p);
                 Color3f Le = em->sample(emitterQR_ls, sampler->next2D(), 0.0f);
-                Ray3f ray_shadow(its_og.p, emitterQR_ls.wi);
-                ray_shadow.maxt = (emitterQR_ls.p - its_og.p).norm();
-                Intersection its_shadow;
-                bool in_shadow = scene->rayIntersect(ray_shadow, its_shadow);
-                if (!in_shadow || (its_shadow.t >= (emitterQR_ls.dist - Epsilon))) {
+                if (scene->isVisible(em, emitterQR_ls)) {
                     // this BSDFQueryRecord will be the one for the light sampling (contains shadow ray direction)
-                    BSDFQueryRecord bsdfQR_ls(its_og.toLocal(-og_ray.d), its_og.toLocal(emitterQR_ls.wi), its_og.uv, ESolidAngle);
+                    BSDFQueryRecord bsdfQR_ls(si_og.toLocal(-og_ray.d), si_og.toLocal(emitterQR_ls.wi), si_og.uv, ESolidAngle);
                     float ls_den = pdf_emitter * emitterQR_ls.pdf;
                     if (ls_den > Epsilon) {
                         Color3f bsdf = its_og.mesh->getBSDF()->eval(bsdfQR_ls);
@@ -96,7 +94,7 @@ public:
                         if (w_em_den > Epsilon) {
                             w_em = pdf_emitter / w_em_den;
                         }
-                        Color3f L_ls = (Le * its_og.shFrame.n.dot(emitterQR_ls.wi) * bsdf) / ls_den;
+                        Color3f L_ls = (Le * si_og.shFrame.n.dot(emitterQR_ls.wi) * bsdf) / ls_den;
                         Lo += w_em * throughput * L_ls;
                     }
                 }
@@ -110,6 +108,7 @@ public:
             }
             og_ray = Ray3f(ray_new);
             its_og = Intersection(its_new);
+            si_og = its_og.computeSurfaceInteraction();
             depth++;
         }
         return Lo;
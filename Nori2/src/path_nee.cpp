@@ -12,26 +12,28 @@ public:
 		/* No parameters this time */
 	}
 
-    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray) const {
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& firstIts) const {
         Color3f Lo(0.0f);   // the radiance we will return
         int depth = 1;
         Color3f throughput(1.0f);
         Ray3f bouncyRay(ray);
         float survivalProb;
+        Intersection its(firstIts);   // the first intersection comes already traced
+        bool hit = its.mesh != nullptr;
         while (true) {
-            Intersection its;
-            if (!scene->rayIntersect(bouncyRay, its)) {
+            if (!hit) {
                 // if the ray doesnt intersect with nothing, we will add the background color
                 // to the radiance we will return
                 Color3f backgroundColor = scene->getBackground(bouncyRay);
                 Lo += backgroundColor * throughput;
                 break;
             }
+            SurfaceInteraction si = its.computeSurfaceInteraction();
             /*
             *   NOW WE HAVE AN INTERSECTION
             */
             Point2f sample = sampler->next2D();
-            BSDFQueryRecord bsdfQR(its.toLocal(-bouncyRay.d), sample);
+            BSDFQueryRecord bsdfQR(si.toLocal(-bouncyRay.d), sample);
             int sampleLights = (bsdfQR.measure != EDiscrete);
             float w_mats = sampleLights ? 0.5f : 1.0f;
             float w_lights = sampleLights ? 0.5f : 0.0f;
@@ -39,11 +41,11 @@ public:
             if (its.mesh->isEmitter()) {
                 sampleLights = false; // THE MATERIAL DOESN'T NECESSARILY NEED TO BE DELTA, BUT WE WILL CONSIDER IT AS ONE
                 w_mats = 1.0f;  // THIS IS IN ORDER TO ONLY SAMPLE THE EMMITER ONCE
-                EmitterQueryRecord emitterQR(its.p);
+                EmitterQueryRecord emitterQR(si.p);
                 emitterQR.ref = bouncyRay.o;
                 emitterQR.wi = bouncyRay.d;
-                emitterQR.n = its.shFrame.n;
-                emitterQR.uv = its.uv;
+                emitterQR.n = si.shFrame.n;
+                emitterQR.uv = si.uv;
                 Lo += w_mats * its.mesh->getEmitter()->eval(emitterQR) * throughput;
                 break;
             }
@@ -63,23 +65,18 @@ public:
             if (sampleLights) {
                 // randomly choose an emitter and add its contribution to the throughput
                 float pdflight;	// this is the probability density of choosing a light source
-                EmitterQueryRecord emitterQR_ls(its.p);	// add intersection point to emitterRecord
+                EmitterQueryRecord emitterQR_ls(si.p);	// add intersection point to emitterRecord
                 const Emitter* em = scene->sampleEmitter(sampler->next1D(), pdflight); 		// sample a random light source
                 Color3f Le = em->sample(emitterQR_ls, sampler->next2D(), 0.);	// radiance of the light source
-                Ray3f shadowRay(its.p, emitterQR_ls.wi); // shadow ray that goes from the intersection point to the light source
-                shadowRay.maxt = (emitterQR_ls.p - its.p).norm();	// maxt is the distance between the intersection point and the light source (?)
-                // if the shadow ray doesnt intersect with the scene, or if it intersects after the light source, then the point is not in shadow
-                Color3f L_ls(0.0f);
-                Intersection shadowIts;
-                bool inShadow = scene->rayIntersect(shadowRay, shadowIts);
-                if (!inShadow) {
-                    BSDFQueryRecord bsdfQR_ls(its.toLocal(-bouncyRay.d), its.toLocal(emitterQR_ls.wi), its.uv, ESolidAngle);
+                // if nothing blocks the segment between the intersection point and the light source, the point is not in shadow
+                if (scene->isVisible(em, emitterQR_ls)) {
+                    BSDFQueryRecord bsdfQR_ls(si.toLocal(-bouncyRay.d), si.toLocal(emitterQR_ls.wi), si.uv, ESolidAngle);
                     float denominator = pdflight * emitterQR_ls.pdf;
                     if (denominator > Epsilon){	// to avoid division by 0 (resulting in NaNs and anoying warnings)
                         // emitterQR_ls.dist = its.t;
                         Color3f bsdf = its.mesh->getBSDF()->eval(bsdfQR_ls);
                         // update the color
-                        Lo += w_lights * throughput * (Le * its.shFrame.n.dot(emitterQR_ls.wi) * bsdf) / denominator;
+                        Lo += w_lights * throughput * (Le * si.shFrame.n.dot(emitterQR_ls.wi) * bsdf) / denominator;
                     }
                 }
             }
@@ -96,8 +93,9 @@ public:
             }
 
             /* UPDATE THE RAY */
-            bouncyRay = Ray3f(its.p, its.toWorld(bsdfQR.wo));
+            bouncyRay = Ray3f(si.p, si.toWorld(bsdfQR.wo));
             depth++;
+            hit = scene->rayIntersect(bouncyRay, its);
         }
         return Lo;
     }
@@ -0,0 +1,257 @@
+#include <nori/warp.h>
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/emitter.h>
+#include <nori/bsdf.h>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Wavefront path tracer with next event estimation and MIS
+ *
+ * Instead of following one path at a time, all paths of a batch advance
+ * together, one bounce per iteration, in separate stages:
+ *
+ *  - generate: the camera rays and first hits come from the renderer
+ *  - extend:   active paths are sorted by a Morton code of their rays and
+ *              traced in packets
+ *  - shade:    hits are grouped by BSDF, then BSDF sampling continues each
+ *              path and light sampling queues one shadow ray per vertex
+ *  - connect:  the queued shadow rays are traced in one go
+ *
+ * The estimator is the same as for \c path_mis, but with MIS weights
+ * that include the emitter selection probability.
+ */
+class PathWavefront : public Integrator {
+public:
+    PathWavefront(const PropertyList& props) {
+        /* Sort rays before traversal and hits before shading */
+        m_sortRays = props.getBoolean("sortRays", true);
+        m_sortMaterials = props.getBoolean("sortMaterials", true);
+    }
+
+    Color3f Li(const Scene* scene, Sampler* sampler, const Ray3f& ray, const Intersection& its) const {
+        Color3f Lo;
+        LiBatch(scene, sampler, &ray, &its, &Lo, 1);
+        return Lo;
+    }
+
+    void LiBatch(const Scene* scene, Sampler* sampler, const Ray3f* rays,
+            const Intersection* its, Color3f* result, int count) const {
+        /* GENERATE: one path per camera ray, whose first hit is already known */
+        std::vector<PathState> paths(count);
+        std::vector<uint32_t> active(count);
+        for (int i = 0; i < count; ++i) {
+            PathState &path = paths[i];
+            path.ray = rays[i];
+            path.its = its[i];
+            path.throughput = Color3f(1.0f);
+            path.bsdfPdf = 0.0f;
+            path.specular = true;   // nothing to weight against for camera rays
+            path.depth = 1;
+            active[i] = i;
+            result[i] = Color3f(0.0f);
+        }
+
+        std::vector<ShadowRay> shadowRays;
+        shadowRays.reserve(count);
+
+        while (true) {
+            shade(scene, sampler, paths, active, shadowRays, result);
+            connect(scene, shadowRays, result);
+            if (active.empty())
+                break;
+            extend(scene, paths, active);
+        }
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "PathWavefront[\n"
+            "  sortRays = %s,\n"
+            "  sortMaterials = %s\n"
+            "]",
+            m_sortRays ? "true" : "false",
+            m_sortMaterials ? "true" : "false");
+    }
+
+private:
+    /// State of a path between two bounces
+    struct PathState {
+        Ray3f ray;              // the last ray of the path
+        Intersection its;       // and its intersection
+        Color3f throughput;
+        float bsdfPdf;          // pdf of sampling the last ray's direction
+        bool specular;          // whether the last ray comes from a delta BSDF
+        int depth;
+    };
+
+    /// Light sample waiting for its visibility test
+    struct ShadowRay {
+        Ray3f ray;
+        Color3f contribution;   // weighted contribution if unoccluded
+        uint32_t index;         // path that receives it
+    };
+
+    /// Sort key: direction octant, then Morton codes of origin and direction
+    static uint64_t rayKey(const Ray3f &ray, const BoundingBox3f &bbox) {
+        Vector3f o = (ray.o - bbox.min).cwiseQuotient(bbox.getExtents().cwiseMax(Vector3f::Constant(Epsilon)));
+        Vector3f d = (ray.d + Vector3f::Constant(1.0f)) * 0.5f;
+        uint32_t q[6];
+        for (int k = 0; k < 3; ++k) {
+            q[k] = (uint32_t) clamp((int) (o[k] * 1024.0f), 0, 1023);
+            q[k + 3] = (uint32_t) clamp((int) (d[k] * 1024.0f), 0, 1023);
+        }
+        uint64_t octant = (ray.d.x() < 0) | ((ray.d.y() < 0) << 1) | ((ray.d.z() < 0) << 2);
+        return (octant << 60) | ((uint64_t) mortonCode(q[0], q[1], q[2]) << 30) |
+            mortonCode(q[3], q[4], q[5]);
+    }
+
+    /// EXTEND: find the next intersection of every active path
+    void extend(const Scene* scene, std::vector<PathState> &paths, std::vector<uint32_t> &active) const {
+        size_t count = active.size();
+
+        /* Neighbouring rays in Morton order form coherent packets */
+        if (m_sortRays) {
+            const BoundingBox3f &bbox = scene->getBoundingBox();
+            std::vector<std::pair<uint64_t, uint32_t>> keys(count);
+            for (size_t i = 0; i < count; ++i)
+                keys[i] = std::make_pair(rayKey(paths[active[i]].ray, bbox), active[i]);
+            std::sort(keys.begin(), keys.end());
+            for (size_t i = 0; i < count; ++i)
+                active[i] = keys[i].second;
+        }
+
+        Ray3f rays[NORI_PACKET_SIZE];
+        Intersection its[NORI_PACKET_SIZE];
+        for (size_t first = 0; first < count; first += NORI_PACKET_SIZE) {
+            int n = (int) std::min(count - first, (size_t) NORI_PACKET_SIZE);
+            for (int i = 0; i < n; ++i)
+                rays[i] = paths[active[first + i]].ray;
+            scene->rayIntersectPacket(rays, its, n);
+            for (int i = 0; i < n; ++i)
+                paths[active[first + i]].its = its[i];
+        }
+    }
+
+    /// SHADE: terminate or continue every active path, queue light samples
+    void shade(const Scene* scene, Sampler* sampler, std::vector<PathState> &paths,
+            std::vector<uint32_t> &active, std::vector<ShadowRay> &shadowRays, Color3f* result) const {
+        /* Group the hits by BSDF (misses first) so each material runs as a batch */
+        if (m_sortMaterials) {
+            std::stable_sort(active.begin(), active.end(), [&](uint32_t a, uint32_t b) {
+                const Mesh *ma = paths[a].its.mesh, *mb = paths[b].its.mesh;
+                return std::less<const BSDF *>()(ma ? ma->getBSDF() : nullptr, mb ? mb->getBSDF() : nullptr);
+            });
+        }
+
+        size_t alive = 0;
+        for (uint32_t index : active) {
+            PathState &path = paths[index];
+            const Intersection &its = path.its;
+
+            if (!its.mesh) {
+                // the path escaped, add the background weighted against sampling the environment
+                const Emitter *env = scene->getEnvironmentalEmitter();
+                float w = 1.0f;
+                if (env && !path.specular) {
+                    EmitterQueryRecord emitterQR(path.ray.o);
+                    emitterQR.wi = path.ray.d;
+                    w = misWeight(path.bsdfPdf, scene->pdfEmitter(env) * env->pdf(emitterQR));
+                }
+                result[index] += w * path.throughput * scene->getBackground(path.ray);
+                continue;
+            }
+
+            SurfaceInteraction si = its.computeSurfaceInteraction();
+
+            if (its.mesh->isEmitter()) {
+                // paths end at emitters, as in the other path tracers
+                const Emitter *em = its.mesh->getEmitter();
+                EmitterQueryRecord emitterQR(si.p);
+                emitterQR.ref = path.ray.o;
+                emitterQR.wi = path.ray.d;
+                emitterQR.n = si.shFrame.n;
+                emitterQR.uv = si.uv;
+                emitterQR.dist = its.t;
+                float w = 1.0f;
+                if (!path.specular)
+                    w = misWeight(path.bsdfPdf, scene->pdfEmitter(em) * em->pdf(emitterQR));
+                result[index] += w * path.throughput * em->eval(emitterQR);
+                continue;
+            }
+
+            const BSDF *bsdf = its.mesh->getBSDF();
+            Vector3f wi = si.toLocal(-path.ray.d);
+            BSDFQueryRecord bsdfQR(wi, si.uv);
+            Color3f bsdfSample = bsdf->sample(bsdfQR, sampler->next2D());
+            bool specular = bsdfQR.measure == EDiscrete;
+
+            /* LIGHT SAMPLING, the visibility test is deferred to connect() */
+            if (!specular && !scene->getLights().empty()) {
+                float pdfSelect;
+                const Emitter *em = scene->sampleEmitter(sampler->next1D(), pdfSelect);
+                EmitterQueryRecord emitterQR(si.p);
+                Color3f Le = em->sample(emitterQR, sampler->next2D(), 0.0f);
+                float pdfLight = pdfSelect * emitterQR.pdf;
+                if (!Le.isZero() && pdfLight > Epsilon) {
+                    BSDFQueryRecord bsdfQR_ls(wi, si.toLocal(emitterQR.wi), si.uv, ESolidAngle);
+                    float w = misWeight(pdfLight, bsdf->pdf(bsdfQR_ls));
+                    Color3f contribution = w * path.throughput * Le * bsdf->eval(bsdfQR_ls) *
+                        std::abs(si.shFrame.n.dot(emitterQR.wi)) / pdfLight;
+                    if (!contribution.isZero() && contribution.isValid()) {
+                        ShadowRay shadow;
+                        if (em->getEmitterType() == EmitterType::EMITTER_ENVIRONMENT)
+                            shadow.ray = Ray3f(si.p, emitterQR.wi);
+                        else
+                            shadow.ray = Ray3f(si.p, emitterQR.wi, Epsilon, emitterQR.dist * (1 - Epsilon));
+                        shadow.contribution = contribution;
+                        shadow.index = index;
+                        shadowRays.push_back(shadow);
+                    }
+                }
+            }
+
+            /* BSDF SAMPLING continues the path */
+            if (bsdfSample.isZero() || bsdfSample.hasNaN())
+                continue;
+            path.throughput *= bsdfSample;
+            path.specular = specular;
+            path.bsdfPdf = specular ? 0.0f : bsdf->pdf(bsdfQR);
+            path.ray = Ray3f(si.p, si.toWorld(bsdfQR.wo));
+
+            /* RUSSIAN ROULETTE */
+            if (path.depth > 2) {
+                float survivalProb = std::min(path.throughput.maxCoeff(), 0.95f);
+                if (sampler->next1D() > survivalProb)
+                    continue;
+                path.throughput /= survivalProb;
+            }
+            path.depth++;
+            active[alive++] = index;
+        }
+        active.resize(alive);
+    }
+
+    /// CONNECT: trace the queued shadow rays and add the unoccluded samples
+    void connect(const Scene* scene, std::vector<ShadowRay> &shadowRays, Color3f* result) const {
+        for (const ShadowRay &shadow : shadowRays) {
+            if (!scene->rayIntersect(shadow.ray))
+                result[shadow.index] += shadow.contribution;
+        }
+        shadowRays.clear();
+    }
+
+    /// Balance heuristic
+    static float misWeight(float pdfA, float pdfB) {
+        float den = pdfA + pdfB;
+        return den > 0.0f ? pdfA / den : 0.0f;
+    }
+
+    bool m_sortRays;
+    bool m_sortMaterials;
+};
+
+NORI_REGISTER_CLASS(PathWavefront, "path_wavefront");
+NORI_NAMESPACE_END
@@ -47,6 +47,9 @@ public:
         m_nearClip = propList.getFloat("nearClip", 1e-4f);
         m_farClip = propList.getFloat("farClip", 1e4f);
 
+        /* Importance sample the reconstruction filter instead of splatting samples. Default: no */
+        m_filterSampling = propList.getBoolean("filterSampling", false);
+
         m_rfilter = NULL;
     }
 
@@ -80,9 +83,11 @@ public:
             Eigen::Translation<float, 3>(-1.0f, -1.0f/aspect, 0.0f) * perspective).inverse();
 
         /* If no reconstruction filter was assigned, instantiate a Gaussian filter */
-        if (!m_rfilter)
+        if (!m_rfilter) {
             m_rfilter = static_cast<ReconstructionFilter *>(
                 NoriObjectFactory::createInstance("gaussian", PropertyList()));
+            m_rfilter->activate();
+        }
     }
 
     Color3f sampleRay(Ray3f &ray,
@@ -130,6 +135,7 @@ public:
             "  outputSize = %s,\n"
             "  fov = %f,\n"
             "  clip = [%f, %f],\n"
+            "  filterSampling = %s,\n"
             "  rfilter = %s\n"
             "]",
             indent(m_cameraToWorld.toString(), 18),
@@ -137,6 +143,7 @@ public:
             m_fov,
             m_nearClip,
             m_farClip,
+            m_filterSampling ? "yes" : "no",
             indent(m_rfilter->toString())
         );
     }
@@ -0,0 +1,136 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/bsdf.h>
+#include <nori/emitter.h>
+#include <Eigen/Geometry>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Analytic parallelogram
+ *
+ * The square <tt>[-1, 1]^2</tt> in the XY plane, placed in the scene
+ * by the \c toWorld transform. Its normal points along the transformed
+ * Z axis. The texture coordinates span <tt>[0, 1]^2</tt>.
+ */
+class Quad : public Mesh {
+public:
+    Quad(const PropertyList &propList) {
+        Transform trafo = propList.getTransform("toWorld", Transform());
+        m_origin = trafo * Point3f(-1.f, -1.f, 0.f);
+        m_edge1 = trafo * Vector3f(2.f, 0.f, 0.f);
+        m_edge2 = trafo * Vector3f(0.f, 2.f, 0.f);
+
+        Vector3f n = m_edge1.cross(m_edge2);
+        m_area = n.norm();
+        if (m_area == 0)
+            throw NoriException("Quad: the transformation is degenerate!");
+        m_normal = n / m_area;
+
+        m_name = tfm::format("quad(%s)", m_origin.toString());
+        m_bbox = BoundingBox3f(m_origin);
+        m_bbox.expandBy(m_origin + m_edge1);
+        m_bbox.expandBy(m_origin + m_edge2);
+        m_bbox.expandBy(m_origin + m_edge1 + m_edge2);
+    }
+
+    n_UINT getPrimitiveCount() const { return 1; }
+
+    bool isAnalytic() const { return true; }
+
+    void samplePosition(const Point2f &sample, Point3f &p, Normal3f &n, Point2f &uv) const {
+        p = m_origin + sample.x() * m_edge1 + sample.y() * m_edge2;
+        n = m_normal;
+        uv = sample;
+    }
+
+    float pdf(const Point3f &) const {
+        return 1.f / m_area;
+    }
+
+    float surfaceArea(n_UINT) const {
+        return m_area;
+    }
+
+    BoundingBox3f getBoundingBox(n_UINT) const {
+        return m_bbox;
+    }
+
+    Point3f getCentroid(n_UINT) const {
+        return m_origin + 0.5f * (m_edge1 + m_edge2);
+    }
+
+    bool rayIntersect(n_UINT, const Ray3f &ray, float &u, float &v, float &t) const {
+        /* Same as the triangle test, only with the bounds of a parallelogram */
+        Vector3f pvec = ray.d.cross(m_edge2);
+        float det = m_edge1.dot(pvec);
+        if (det > -1e-8f && det < 1e-8f)
+            return false;
+        float inv_det = 1.0f / det;
+
+        Vector3f tvec = ray.o - m_origin;
+        u = tvec.dot(pvec) * inv_det;
+        if (u < 0.0 || u > 1.0)
+            return false;
+
+        Vector3f qvec = tvec.cross(m_edge1);
+        v = ray.d.dot(qvec) * inv_det;
+        if (v < 0.0 || v > 1.0)
+            return false;
+
+        t = m_edge2.dot(qvec) * inv_det;
+        return t >= ray.mint && t <= ray.maxt;
+    }
+
+    void computeSurfaceInteraction(const Intersection &its, SurfaceInteraction &si) const {
+        si.p = m_origin + its.u * m_edge1 + its.v * m_edge2;
+        si.uv = Point2f(its.u, its.v);
+        si.geoFrame = si.shFrame = Frame(m_normal);
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "Quad[\n"
+            "  origin = %s,\n"
+            "  edge1 = %s,\n"
+            "  edge2 = %s,\n"
+            "  bsdf = %s,\n"
+            "  emitter = %s,\n"
+            "  medium = %s\n"
+            "]",
+            m_origin.toString(),
+            m_edge1.toString(),
+            m_edge2.toString(),
+            m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
+            m_emitter ? indent(m_emitter->toString()) : std::string("null"),
+            m_medium ? indent(m_medium->toString()) : std::string("null")
+        );
+    }
+
+private:
+    Point3f m_origin;   ///< Corner at (-1, -1) in object space
+    Vector3f m_edge1;   ///< Image of the object space X extent
+    Vector3f m_edge2;   ///< Image of the object space Y extent
+    Normal3f m_normal;  ///< Unit normal
+    float m_area;       ///< Surface area
+};
+
+NORI_REGISTER_CLASS(Quad, "quad");
+NORI_NAMESPACE_END
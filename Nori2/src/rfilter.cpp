@@ -20,6 +20,37 @@
 
 NORI_NAMESPACE_BEGIN
 
+void ReconstructionFilter::activate() {
+    /* Bound the absolute value of the filter in every bin, so that the
+       sample weights stay below one and bins with a zero crossing of
+       the filter can still be sampled */
+    int binCount = 2 * NORI_FILTER_RESOLUTION;
+    float binWidth = 2 * m_radius / binCount;
+    m_pdf.clear();
+    m_pdf.reserve(binCount);
+    for (int i = 0; i < binCount; ++i) {
+        float x = -m_radius + i * binWidth;
+        m_pdf.append(std::max({ std::abs(eval(x)), std::abs(eval(x + 0.5f * binWidth)),
+            std::abs(eval(x + binWidth)) }));
+    }
+    m_pdf.normalize();
+}
+
+float ReconstructionFilter::sample1D(float sample, float &weight) const {
+    size_t index = m_pdf.sampleReuse(sample);
+    float binWidth = 2 * m_radius / m_pdf.size();
+    float x = -m_radius + (index + sample) * binWidth;
+    weight = eval(x) / (m_pdf[index] * m_pdf.getSum());
+    return x;
+}
+
+Point2f ReconstructionFilter::sample(const Point2f &sample, float &weight) const {
+    float weightX, weightY;
+    Point2f offset(sample1D(sample.x(), weightX), sample1D(sample.y(), weightY));
+    weight = weightX * weightY;
+    return offset;
+}
+
 /**
  * Windowed Gaussian filter with configurable extent
  * and standard deviation. Often produces pleasing 
@@ -97,6 +128,8 @@ public:
     float eval(float x) const {
         return std::max(0.0f, 1.0f - std::abs(x));
     }
+
+    EShape getShape() const { return ETent; }
     
     std::string toString() const {
         return "TentFilter[]";
@@ -113,6 +146,8 @@ public:
     float eval(float) const {
         return 1.0f;
     }
+
+    EShape getShape() const { return EBox; }
     
     std::string toString() const {
         return "BoxFilter[]";
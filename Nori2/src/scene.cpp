@@ -25,11 +25,27 @@
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/emitter.h>
+#include <nori/instance.h>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
-    m_accel = new Accel();
+Scene::Scene(const PropertyList &props) {
+    /* Without an <accel> tag, the BVH is configured by the bvh* properties of the scene
+       (see the BVH class for their meaning) */
+    m_accelProps.setInteger("width", props.getInteger("bvhWidth", 4));
+    m_accelProps.setString("builder", props.getString("bvhBuilder", "sah"));
+    m_accelProps.setFloat("splitBudget", props.getFloat("bvhSplitBudget", 0.3f));
+    m_accelProps.setString("quality", props.getString("bvhQuality", "normal"));
+    m_accelProps.setFloat("rebuildThreshold", props.getFloat("bvhRebuildThreshold", 1.5f));
+    m_accelProps.setBoolean("compressed", props.getBoolean("bvhCompressed", false));
+    m_accelProps.setBoolean("statistics", props.getBoolean("bvhStatistics", false));
+    /* On request, keep the binary tree in "<scene>.bvh" so that reloading unchanged geometry skips the build */
+    std::string filename = props.getString("filename", "");
+    if (props.getBoolean("bvhCache", false) && !filename.empty()) {
+        if (endsWith(toLower(filename), ".xml"))
+            filename.erase(filename.size() - 4);
+        m_cacheFile = filename + ".bvh";
+    }
     m_enviromentalEmitter = 0;
 }
 
@@ -38,6 +54,8 @@ Scene::~Scene() {
     delete m_sampler;
     delete m_camera;
     delete m_integrator;
+    for (auto instance : m_instances)
+        delete instance;
 }
 
 void Scene::activate() {
@@ -48,6 +66,42 @@ void Scene::activate() {
         if (m_meshes[i]->isEmitter())
             m_emitters.push_back(m_meshes[i]->getEmitter());
 
+    if (!m_accel) {
+        /* Create the default acceleration data structure */
+        m_accel = static_cast<Accel *>(
+            NoriObjectFactory::createInstance("bvh4", m_accelProps));
+    }
+    m_accel->setCacheFile(m_cacheFile);
+    n_UINT meshID = 0;
+    for (auto mesh : m_meshes) {
+        mesh->setID(++meshID);
+        m_accel->addMesh(mesh);
+    }
+    for (auto medium : m_mediums)
+        m_accel->addMedium(medium);
+
+    // Resolve references between instances and hand them to the accel;
+    // every instance of a mesh shares a single bottom-level BVH
+    std::map<std::string, Mesh *> namedMeshes;
+    for (auto instance : m_instances) {
+        if (instance->getMesh() && !instance->getName().empty()) {
+            if (!namedMeshes.insert(std::make_pair(instance->getName(), instance->getMesh())).second)
+                throw NoriException("There are multiple instanced meshes named \"%s\"!", instance->getName());
+        }
+    }
+    for (auto instance : m_instances) {
+        Mesh *mesh = instance->getMesh();
+        if (!mesh) {
+            auto it = namedMeshes.find(instance->getRef());
+            if (it == namedMeshes.end())
+                throw NoriException("Instance refers to an unknown mesh \"%s\"!", instance->getRef());
+            mesh = it->second;
+        }
+        if (mesh->getID() == 0)
+            mesh->setID(++meshID);
+        m_accel->addInstance(mesh, instance->getTransform());
+    }
+
     m_accel->build();
 
     if (!m_integrator)
@@ -69,6 +123,31 @@ void Scene::activate() {
     cout << endl;
 }
 
+void Scene::setVertexPositions(const std::string &meshName, const MatrixXf &positions,
+        const MatrixXf &normals) {
+    for (auto mesh : m_meshes) {
+        if (mesh->getName() == meshName) {
+            mesh->setVertexPositions(positions, normals);
+            return;
+        }
+    }
+    for (auto instance : m_instances) {
+        Mesh *mesh = instance->getMesh();
+        if (mesh && mesh->getName() == meshName) {
+            mesh->setVertexPositions(positions, normals);
+            return;
+        }
+    }
+    throw NoriException("Scene::setVertexPositions(): there is no mesh named \"%s\"!", meshName);
+}
+
+bool Scene::isVisible(const Emitter *emitter, const EmitterQueryRecord &eRec) const {
+    /* Environment emitters only sample a direction, see EnvironmentEmitter::sample() */
+    if (emitter->getEmitterType() == EmitterType::EMITTER_ENVIRONMENT)
+        return !m_accel->rayOccluded(Ray3f(eRec.ref, eRec.wi));
+    return isVisible(eRec.ref, eRec.p);
+}
+
 /// Sample emitter
 const Emitter * Scene::sampleEmitter(float rnd, float &pdf) const {
 	auto const & n = m_emitters.size(); // number of emitters
@@ -86,7 +165,6 @@ void Scene::addChild(NoriObject *obj, const std::string& name) {
     switch (obj->getClassType()) {
         case EMesh: {
                 Mesh *mesh = static_cast<Mesh *>(obj);
-                m_accel->addMesh(mesh);
                 m_meshes.push_back(mesh);
             }
             break;
@@ -104,6 +182,10 @@ void Scene::addChild(NoriObject *obj, const std::string& name) {
 			}
             break;
 
+        case EInstance:
+            m_instances.push_back(static_cast<Instance *>(obj));
+            break;
+
         case ESampler:
             if (m_sampler)
                 throw NoriException("There can only be one sampler per scene!");
@@ -124,11 +206,16 @@ void Scene::addChild(NoriObject *obj, const std::string& name) {
         
         case EMedium: {
                 Medium *medium = static_cast<Medium *>(obj);
-                m_accel->addMedium(medium);     // i use m_accel for the integrator to interact with the medium
-                m_mediums.push_back(medium);
+                m_mediums.push_back(medium);    // handed to m_accel for the integrator to interact with the medium
             }
             break;
 
+        case EAccel:
+            if (m_accel)
+                throw NoriException("There can only be one accel per scene!");
+            m_accel = static_cast<Accel *>(obj);
+            break;
+
         default:
             throw NoriException("Scene::addChild(<%s>) is not supported!",
                 classTypeName(obj->getClassType()));
@@ -168,6 +255,7 @@ std::string Scene::toString() const {
         "  integrator = %s,\n"
         "  sampler = %s\n"
         "  camera = %s,\n"
+        "  accel = %s,\n"
         "  meshes = {\n"
         "  %s  }\n"
 		"  emitters = {\n"
@@ -176,6 +264,7 @@ std::string Scene::toString() const {
         indent(m_integrator->toString()),
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
+        indent(m_accel->toString()),
         indent(meshes, 2),
 		indent(lights, 2)
     );
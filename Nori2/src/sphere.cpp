@@ -0,0 +1,137 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/bsdf.h>
+#include <nori/emitter.h>
+#include <nori/warp.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Analytic sphere
+ *
+ * Intersected exactly instead of being tessellated. The surface is
+ * parameterized by the spherical coordinates of the hit, which also
+ * serve as texture coordinates.
+ */
+class Sphere : public Mesh {
+public:
+    Sphere(const PropertyList &propList) {
+        m_center = propList.getPoint("center", Point3f(0.f));
+        m_radius = propList.getFloat("radius", 1.f);
+        if (m_radius <= 0)
+            throw NoriException("Sphere: the radius must be positive!");
+
+        m_name = tfm::format("sphere(%s, %f)", m_center.toString(), m_radius);
+        m_bbox = BoundingBox3f(m_center - Vector3f(m_radius), m_center + Vector3f(m_radius));
+    }
+
+    n_UINT getPrimitiveCount() const { return 1; }
+
+    bool isAnalytic() const { return true; }
+
+    void samplePosition(const Point2f &sample, Point3f &p, Normal3f &n, Point2f &uv) const {
+        Vector3f d = Warp::squareToUniformSphere(sample);
+        p = m_center + m_radius * d;
+        n = d;
+        uv = parameterization(d);
+    }
+
+    float pdf(const Point3f &) const {
+        return 1.f / surfaceArea(0);
+    }
+
+    float surfaceArea(n_UINT) const {
+        return 4 * M_PI * m_radius * m_radius;
+    }
+
+    BoundingBox3f getBoundingBox(n_UINT) const {
+        return m_bbox;
+    }
+
+    Point3f getCentroid(n_UINT) const {
+        return m_center;
+    }
+
+    bool rayIntersect(n_UINT, const Ray3f &ray, float &u, float &v, float &t) const {
+        Vector3f o = ray.o - m_center;
+        float A = ray.d.squaredNorm();
+        float B = 2 * o.dot(ray.d);
+        float C = o.squaredNorm() - m_radius * m_radius;
+
+        float discrim = B * B - 4 * A * C;
+        if (discrim < 0)
+            return false;
+
+        /* Numerically stable form of the two roots */
+        float temp = -0.5f * (B + std::copysign(std::sqrt(discrim), B));
+        float t0 = temp / A, t1 = C / temp;
+        if (t0 > t1)
+            std::swap(t0, t1);
+
+        if (t0 >= ray.mint && t0 <= ray.maxt)
+            t = t0;
+        else if (t1 >= ray.mint && t1 <= ray.maxt)
+            t = t1;
+        else
+            return false;
+
+        Point2f uv = parameterization((o + t * ray.d).normalized());
+        u = uv.x();
+        v = uv.y();
+        return true;
+    }
+
+    void computeSurfaceInteraction(const Intersection &its, SurfaceInteraction &si) const {
+        Vector3f d = sphericalDirection(its.v * M_PI, its.u * 2 * M_PI);
+        si.p = m_center + m_radius * d;
+        si.uv = Point2f(its.u, its.v);
+        si.geoFrame = si.shFrame = Frame(d);
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "Sphere[\n"
+            "  center = %s,\n"
+            "  radius = %f,\n"
+            "  bsdf = %s,\n"
+            "  emitter = %s,\n"
+            "  medium = %s\n"
+            "]",
+            m_center.toString(),
+            m_radius,
+            m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
+            m_emitter ? indent(m_emitter->toString()) : std::string("null"),
+            m_medium ? indent(m_medium->toString()) : std::string("null")
+        );
+    }
+
+private:
+    /// Map a direction from the center to (phi / 2pi, theta / pi)
+    static Point2f parameterization(const Vector3f &d) {
+        Point2f coords = sphericalCoordinates(d);
+        return Point2f(coords.y() * INV_TWOPI, coords.x() * INV_PI);
+    }
+
+    Point3f m_center;
+    float m_radius;
+};
+
+NORI_REGISTER_CLASS(Sphere, "sphere");
+NORI_NAMESPACE_END